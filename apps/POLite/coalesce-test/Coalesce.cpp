@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: BSD-2-Clause
+#include "Coalesce.h"
+
+#include <tinsel.h>
+#include <POLite.h>
+
+typedef PThread<
+          CoalesceDevice,
+          CoalesceState,    // State
+          None,             // Edge label
+          CoalesceMessage   // Message
+        > CoalesceThread;
+
+int main()
+{
+  // Point thread structure at base of thread's heap
+  CoalesceThread* thread = (CoalesceThread*) tinselHeapBaseSRAM();
+
+  // Invoke interpreter
+  thread->run();
+
+  return 0;
+}
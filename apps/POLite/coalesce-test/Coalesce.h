@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: BSD-2-Clause
+#ifndef _COALESCE_H_
+#define _COALESCE_H_
+
+// Test of message coalescing: every device multicasts a distinct
+// payload to many random destinations, so the open packs on each thread
+// fill up (and are flushed) while multicasts are still in progress
+#define POLITE_COALESCE 4
+#define POLITE_COALESCE_SLOTS 4
+
+#include <POLite.h>
+
+// Number of rounds of sending
+#define ROUNDS 4
+
+struct CoalesceMessage {
+  // Sender's payload, or receiver's id when reporting to the host
+  uint32_t val;
+  // Results reported to the host
+  uint32_t sum;
+  uint32_t count;
+};
+
+struct CoalesceState {
+  // Device id
+  uint32_t id;
+  // Sum and number of payloads received
+  uint32_t sum;
+  uint32_t count;
+};
+
+struct CoalesceDevice : PDevice<CoalesceState, None, CoalesceMessage> {
+  inline void init() {
+    *readyToSend = Pin(0);
+  }
+  inline void send(volatile CoalesceMessage* msg) {
+    // Payload is unique to the sender and round
+    msg->val = s->id + time * numVertices;
+    *readyToSend = No;
+  }
+  inline void recv(CoalesceMessage* msg, None* edge) {
+    s->sum += msg->val;
+    s->count++;
+  }
+  inline bool step() {
+    if (time+1 >= ROUNDS) return false;
+    *readyToSend = Pin(0);
+    return true;
+  }
+  inline bool finish(volatile CoalesceMessage* msg) {
+    msg->val = s->id;
+    msg->sum = s->sum;
+    msg->count = s->count;
+    return true;
+  }
+};
+
+#endif
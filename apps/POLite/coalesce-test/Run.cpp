@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: BSD-2-Clause
+#include "Coalesce.h"
+
+#include <HostLink.h>
+#include <POLite.h>
+#include <assert.h>
+#include <stdlib.h>
+
+int main(int argc, char** argv)
+{
+  if (argc != 3) {
+    fprintf(stderr, "Expected arguments: <devices> <fanout>\n");
+    return -1;
+  }
+  uint32_t numDevices = atoi(argv[1]);
+  uint32_t fanout = atoi(argv[2]);
+  assert(numDevices > 0);
+
+  // Connection to tinsel machine
+  HostLink hostLink;
+
+  // Create POETS graph
+  PGraph<CoalesceDevice, CoalesceState, None, CoalesceMessage> graph;
+  for (uint32_t i = 0; i < numDevices; i++) graph.newDevice();
+
+  // Connect each device to random destinations, and work out the
+  // expected sum and number of payloads received by each device
+  uint32_t* sum = new uint32_t [numDevices];
+  uint32_t* count = new uint32_t [numDevices];
+  for (uint32_t i = 0; i < numDevices; i++) sum[i] = count[i] = 0;
+  srand(1);
+  for (uint32_t i = 0; i < numDevices; i++) {
+    for (uint32_t j = 0; j < fanout; j++) {
+      uint32_t dest = rand() % numDevices;
+      graph.addEdge(i, 0, dest);
+      for (uint32_t t = 0; t < ROUNDS; t++)
+        sum[dest] += i + t * numDevices;
+      count[dest] += ROUNDS;
+    }
+  }
+
+  // Prepare mapping from graph to hardware
+  graph.map();
+
+  // Initialise devices
+  for (PDeviceId i = 0; i < graph.numDevices; i++)
+    graph.devices[i]->state.id = i;
+
+  // Write graph down to tinsel machine via HostLink
+  graph.write(&hostLink);
+
+  // Load code and trigger execution
+  hostLink.boot("code.v", "data.v");
+  hostLink.go();
+  printf("Starting\n");
+
+  // Check what each device received
+  uint32_t errors = 0;
+  hostLink.recvEach<PMessage<CoalesceMessage>>(graph.numDevices,
+    [&](PMessage<CoalesceMessage>* msg) {
+      uint32_t id = msg->payload.val;
+      if (id >= numDevices || msg->payload.sum != sum[id] ||
+            msg->payload.count != count[id]) {
+        if (errors < 10)
+          printf("Device %u: received %u payloads (sum %u), "
+                 "expected %u (sum %u)\n", id, msg->payload.count,
+                 msg->payload.sum, id < numDevices ? count[id] : 0,
+                 id < numDevices ? sum[id] : 0);
+        errors++;
+      }
+    });
+
+  if (errors > 0) {
+    printf("FAIL: %u devices received the wrong payloads\n", errors);
+    return EXIT_FAILURE;
+  }
+  printf("OK\n");
+  return 0;
+}
@@ -5,14 +5,17 @@
 #include <POLite.h>
 #include <EdgeList.h>
 #include <assert.h>
+#include <string.h>
 #include <iostream>
 #include <sys/time.h>
 
 int main(int argc, char **argv)
 {
   // Read in the example edge list and create data structure
-  if (argc != 2) {
-    printf("Specify edge file\n");
+  // Use -b to read the edge file in binary format
+  bool binary = argc == 3 && !strcmp(argv[1], "-b");
+  if (argc != 2 && !binary) {
+    printf("Specify edge file (use -b for binary format)\n");
     exit(EXIT_FAILURE);
   }
 
@@ -25,7 +28,7 @@ int main(int argc, char **argv)
   // Load in the edge list file
   printf("Loading in the graph..."); fflush(stdout);
   EdgeList net;
-  net.read(argv[1]);
+  if (binary) net.readBinary(argv[2]); else net.read(argv[1]);
   printf(" done\n");
 
   // Print max fan-out
@@ -79,15 +82,16 @@ int main(int argc, char **argv)
   politeSaveStats(&hostLink, "stats.txt");
 
   // Wait for response
-  PMessage<PageRankMessage> msg;
-  for (uint32_t i = 0; i < graph.numDevices; i++) {
-    hostLink.recvMsg(&msg, sizeof(msg));
-    gscore += msg.payload.val;
-    if (i == 0) {
-      // Get finish time
-      gettimeofday(&finish, NULL);
-    }
-  }
+  bool first = true;
+  hostLink.recvEach<PMessage<PageRankMessage>>(graph.numDevices,
+    [&](PMessage<PageRankMessage>* msg) {
+      gscore += msg->payload.val;
+      if (first) {
+        // Get finish time
+        gettimeofday(&finish, NULL);
+        first = false;
+      }
+    });
  
   printf("Done\n");
   printf("score=%.8f\n", gscore);
@@ -6,19 +6,22 @@
 
 #include <EdgeList.h>
 #include <assert.h>
+#include <string.h>
 #include <sys/time.h>
 #include <config.h>
 
 int main(int argc, char**argv)
 {
-  if (argc != 2) {
-    printf("Specify edges file\n");
+  // Use -b to read the edges file in binary format
+  bool binary = argc == 3 && !strcmp(argv[1], "-b");
+  if (argc != 2 && !binary) {
+    printf("Specify edges file (use -b for binary format)\n");
     exit(EXIT_FAILURE);
   }
 
   // Read network
   EdgeList net;
-  net.read(argv[1]);
+  if (binary) net.readBinary(argv[2]); else net.read(argv[1]);
 
   // Print fan-out
   printf("Max fan-out = %d\n", net.maxFanOut());
@@ -72,14 +75,13 @@ int main(int argc, char**argv)
 
   int64_t sum = 0;
   // Receive final distance to each vertex
-  for (uint32_t i = 0; i < graph.numDevices; i++) {
-    // Receive message
-    PMessage<int32_t> msg;
-    hostLink.recvMsg(&msg, sizeof(msg));
-    if (i == 0) gettimeofday(&finish, NULL);
-    // Accumulate
-    sum += msg.payload;
-  }
+  bool first = true;
+  hostLink.recvEach<PMessage<int32_t>>(graph.numDevices,
+    [&](PMessage<int32_t>* msg) {
+      if (first) { gettimeofday(&finish, NULL); first = false; }
+      // Accumulate
+      sum += msg->payload;
+    });
 
   // Emit result
   printf("Sum of distances = %ld\n", sum);
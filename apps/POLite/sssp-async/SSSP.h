@@ -32,6 +32,8 @@ struct SSSPDevice : PDevice<SSSPState,int32_t,int32_t> {
     }
   }
   inline bool step() { return false; }
+  // Bucket for POLITE_SENDERS_PRIORITY (delta-stepping; see README)
+  inline uint32_t priority() { return s->dist >> 4; }
   inline bool finish(int32_t* msg) {
     *msg = s->dist;
     return true;
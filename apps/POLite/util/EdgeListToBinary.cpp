@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Convert a text edge list (pairs of node ids) to the binary edge list
+// format read by EdgeList::readBinary (see include/EdgeList.h)
+//
+// Build:
+//   g++ -O2 -I ../../../include EdgeListToBinary.cpp -o EdgeListToBinary
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <EdgeList.h>
+
+int main(int argc, char* argv[])
+{
+  if (argc != 3) {
+    printf("Usage: EdgeListToBinary <input.txt> <output.bin>\n");
+    return -1;
+  }
+
+  EdgeList net;
+  net.read(argv[1]);
+  net.writeBinary(argv[2]);
+  printf("Nodes = %u, edges = %u\n", net.numNodes, net.numEdges);
+
+  return 0;
+}
@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Test of message coalescing in PThread::run(), on the host
+// (see tinsel.h in this directory, and test_pdevice.sh)
+
+#define TINSEL
+#define POLITE_COALESCE 4
+#define POLITE_COALESCE_SLOTS 4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <tinsel.h>
+#include <POLite.h>
+
+uint32_t mockSendSlot[1 << (TinselLogBytesPerMsg-2)];
+
+// Each device sends its id once, on pin 0
+struct TestState { uint32_t id; };
+struct TestDevice : PDevice<TestState, None, uint32_t> {
+  inline void init() { *readyToSend = Pin(0); }
+  inline void send(volatile uint32_t* msg) {
+    *msg = s->id;
+    *readyToSend = No;
+  }
+  inline void recv(uint32_t* msg, None* edge) {}
+  inline bool step() { return false; }
+  inline bool finish(volatile uint32_t* msg) { return false; }
+};
+typedef PThread<TestDevice, TestState, None, uint32_t> TestThread;
+
+// Limits
+#define MAX_DEVICES 64
+#define MAX_EDGES 1024
+
+// Thread under test
+static PState<TestState> devices[MAX_DEVICES];
+static POutEdge outTable[MAX_EDGES];
+static PLocalDeviceId senders[MAX_DEVICES];
+static uint32_t numDevices, numEdges;
+
+// Sender expected for each out-edge (indexed by key), and whether each
+// out-edge has been delivered
+static uint32_t expected[MAX_EDGES];
+static bool delivered[MAX_EDGES];
+
+// Messages sent, payloads received, and errors
+static uint32_t numMsgs, numPayloads, numErrors;
+// Mailbox of each message sent
+static uint32_t msgMbox[MAX_EDGES];
+
+static jmp_buf done;
+
+// Check a payload delivered to a mailbox
+static void check(uint32_t mbox, uint32_t key, uint32_t payload)
+{
+  numPayloads++;
+  if (key >= numEdges || outTable[key].mbox != mbox ||
+        expected[key] != payload || delivered[key]) {
+    if (numErrors < 5)
+      printf("# key %u to mailbox %u: payload %u is wrong\n",
+        key, mbox, payload);
+    numErrors++;
+  }
+  else
+    delivered[key] = true;
+}
+
+void mockMulticast(uint32_t mbox, uint32_t threadMaskHigh,
+                   uint32_t threadMaskLow, volatile void* slot)
+{
+  if (numMsgs < MAX_EDGES) msgMbox[numMsgs] = mbox;
+  numMsgs++;
+  PMessage<uint32_t>* msg = (PMessage<uint32_t>*) slot;
+  if (msg->destKey == PPackedKey) {
+    PPackedMessage<uint32_t>* pack = (PPackedMessage<uint32_t>*) slot;
+    for (uint32_t i = 0; i < pack->numPayloads; i++)
+      check(mbox, pack->keys[i], pack->payloads[i]);
+  }
+  else
+    check(mbox, msg->destKey, msg->payload);
+}
+
+void mockDone()
+{
+  longjmp(done, 1);
+}
+
+// Start a new thread
+static void reset()
+{
+  numDevices = numEdges = 0;
+  numMsgs = numPayloads = numErrors = 0;
+}
+
+// Add a device that multicasts to the given mailboxes
+static void addDevice(uint32_t numDests, const uint32_t* mboxes)
+{
+  uint32_t d = numDevices++;
+  devices[d].state.id = 1000 + d;
+  devices[d].pinBase[0] = numEdges;
+  for (uint32_t i = 0; i < numDests; i++) {
+    POutEdge* e = &outTable[numEdges];
+    e->mbox = mboxes[i];
+    e->key = numEdges;
+    e->threadMaskLow = 1;
+    e->threadMaskHigh = 0;
+    expected[numEdges] = 1000 + d;
+    delivered[numEdges] = false;
+    numEdges++;
+  }
+  outTable[numEdges++].key = InvalidKey;
+}
+
+// Run the thread, and check that every payload was delivered once
+static bool run(const char* name)
+{
+  TestThread thread;
+  thread.numDevices = numDevices;
+  thread.time = 0;
+  thread.numVertices = numDevices;
+  thread.devices = devices;
+  thread.outTableBase = outTable;
+  thread.senders = senders;
+  if (setjmp(done) == 0) thread.run();
+  for (uint32_t i = 0; i < numEdges; i++)
+    if (outTable[i].key != InvalidKey && !delivered[i]) numErrors++;
+  printf("# %s: %u payloads in %u messages, %u errors\n",
+    name, numPayloads, numMsgs, numErrors);
+  return numErrors == 0;
+}
+
+int main()
+{
+  bool ok = true;
+
+  // Fill every pack with one payload, then multicast a distinct payload
+  // to several keys, forcing packs to be sent mid-multicast.  (Senders
+  // are LIFO, so device 0 sends last.)
+  reset();
+  uint32_t multi[] = { 10, 11, 12, 13 };
+  addDevice(4, multi);
+  for (uint32_t i = 0; i < POLITE_COALESCE_SLOTS; i++) {
+    uint32_t mbox = POLITE_COALESCE_SLOTS - i;
+    addDevice(1, &mbox);
+  }
+  ok = run("full packs, then multicast") && ok;
+
+  // Open packs to mailboxes 1 to 4, fill (and so send) the first, open
+  // a pack to mailbox 5, then send to mailbox 6: the oldest open pack,
+  // to mailbox 2, must make room.  (Devices are listed in reverse.)
+  reset();
+  uint32_t order[] = { 6, 5, 1, 1, 1, 4, 3, 2, 1 };
+  for (uint32_t i = 0; i < sizeof(order)/sizeof(order[0]); i++)
+    addDevice(1, &order[i]);
+  ok = run("oldest pack first") && ok;
+  if (numMsgs < 2 || msgMbox[0] != 1 || msgMbox[1] != 2) {
+    printf("# oldest pack was not sent first\n");
+    ok = false;
+  }
+
+  // Payloads to the same mailbox share messages
+  reset();
+  for (uint32_t i = 0; i < 2*POLITE_COALESCE; i++) {
+    uint32_t mbox = 1;
+    addDevice(1, &mbox);
+  }
+  ok = run("same destination") && ok;
+  if (numMsgs != 2) {
+    printf("# expected 2 messages, got %u\n", numMsgs);
+    ok = false;
+  }
+
+  // Random multicasts, including to the routing key
+  for (uint32_t seed = 1; seed <= 100; seed++) {
+    srand(seed);
+    reset();
+    uint32_t n = 1 + rand() % 16;
+    for (uint32_t d = 0; d < n; d++) {
+      uint32_t mboxes[8];
+      uint32_t numDests = rand() % 8;
+      for (uint32_t i = 0; i < numDests; i++)
+        mboxes[i] = rand() % 10 == 0 ? MOCK_ROUTING_KEY : 1 + rand() % 8;
+      addDevice(numDests, mboxes);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "random %u", seed);
+    ok = run(name) && ok;
+  }
+
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
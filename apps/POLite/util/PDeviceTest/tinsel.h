@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: BSD-2-Clause
+#ifndef _TINSEL_H_
+#define _TINSEL_H_
+
+// Host stand-in for the parts of the Tinsel API used by PThread::run(),
+// so that the device-side POLite code can be tested on the host.  A
+// single thread is modelled: it can always send, never receives, and
+// terminates as soon as it has nothing left to send.  Each multicast is
+// passed to mockMulticast(), and the final sleep to mockDone(), both of
+// which are defined by the test.
+
+#include <stdint.h>
+#include <config.h>
+
+#define INLINE inline
+
+#define TINSEL_CAN_SEND 1
+#define TINSEL_CAN_RECV 2
+
+void mockMulticast(uint32_t mbox, uint32_t threadMaskHigh,
+                   uint32_t threadMaskLow, volatile void* msg);
+void mockDone();
+
+// Mailbox id meaning "use routing key"
+#define MOCK_ROUTING_KEY 0xfffe
+
+// The single send slot
+extern uint32_t mockSendSlot[1 << (TinselLogBytesPerMsg-2)];
+
+INLINE volatile void* tinselSendSlot() { return mockSendSlot; }
+INLINE int tinselCanSend() { return 1; }
+INLINE int tinselCanRecv() { return 0; }
+INLINE void tinselSetLen(int n) {}
+INLINE uint32_t tinselId() { return 0; }
+INLINE uint32_t tinselHostId() { return 0; }
+INLINE uint32_t tinselUseRoutingKey() { return MOCK_ROUTING_KEY; }
+INLINE int tinselIdle(int vote) { return 2; }
+INLINE void tinselMulticast(uint32_t mbox, uint32_t threadMaskHigh,
+                            uint32_t threadMaskLow, volatile void* msg)
+  { mockMulticast(mbox, threadMaskHigh, threadMaskLow, msg); }
+INLINE void tinselSend(uint32_t dest, volatile void* msg) {}
+INLINE volatile void* tinselRecv() { return 0; }
+INLINE void tinselFree(volatile void* msg) {}
+INLINE void tinselWaitUntil(int when)
+  { if (when == TINSEL_CAN_RECV) mockDone(); }
+
+// Performance counters
+INLINE void tinselPerfCountReset() {}
+INLINE void tinselPerfCountStop() {}
+INLINE uint32_t tinselCycleCount() { return 0; }
+INLINE uint32_t tinselCycleCountU() { return 0; }
+INLINE uint32_t tinselCPUIdleCount() { return 0; }
+INLINE uint32_t tinselCPUIdleCountU() { return 0; }
+INLINE uint32_t tinselHitCount() { return 0; }
+INLINE uint32_t tinselMissCount() { return 0; }
+INLINE uint32_t tinselWritebackCount() { return 0; }
+INLINE uint32_t tinselProgRouterSent() { return 0; }
+INLINE uint32_t tinselProgRouterSentInterBoard() { return 0; }
+
+#endif
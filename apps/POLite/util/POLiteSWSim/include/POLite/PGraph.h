@@ -15,6 +15,9 @@
 #include <random>
 #include <atomic>
 #include <algorithm>
+#include <queue>
+#include <unordered_map>
+#include <POLite/HierPlacer.h>
 
 namespace POLiteSWSim {
 
@@ -98,6 +101,15 @@ namespace config
     const unsigned TinselMeshYBits=3;
     const unsigned TinselBoxMeshXLen=4;
     const unsigned TinselBoxMeshYLen=4;
+    const unsigned TinselMeshXLenWithinBox=3;
+    const unsigned TinselMeshYLenWithinBox=2;
+    const unsigned TinselMailboxMeshXLen=4;
+    const unsigned TinselMailboxMeshYLen=4;
+    const unsigned TinselLogThreadsPerCore=4;
+    const unsigned TinselLogCoresPerMailbox=2;
+    const unsigned TinselLogThreadsPerMailbox=6;
+    const unsigned TinselLogMsgsPerMailbox=9;
+    const unsigned TinselClockFreq=210;
 
 };
 
@@ -299,6 +311,20 @@ public:
         m_cond.notify_all();
     }
 
+    // Receive numMsgs messages, passing a pointer to each one in turn
+    // to the given handler (same interface as the hardware HostLink)
+    template <typename T, typename F>
+    void recvEach(uint32_t numMsgs, F handler)
+    {
+        static_assert(sizeof(T) <= (1<<TinselLogBytesPerMsg),
+            "recvEach: message type exceeds max message size");
+        for(uint32_t i=0; i<numMsgs; i++){
+            T msg;
+            recvMsg(&msg, sizeof(T));
+            handler(&msg);
+        }
+    }
+
     // Blocking receive of max size message
     void recv(void* msg)
     {
@@ -336,6 +362,285 @@ struct PThread {
 
 };
 
+// Optional cycle-approximate timing model (POLITE_SW_SIM_TIMING=1).
+// Devices are placed on threads with the one-pass hierarchical mapper,
+// and each simulated event is charged cycles on the core of the device
+// that handles it: handlers run one at a time per core (the threads of
+// a core share its pipeline).  A send is injected into the network once
+// per destination mailbox, taking one cycle per flit on each link of its
+// dimension-ordered route over the mailbox mesh, plus a fixed latency
+// per hop (much larger between boards, whose links are also slower).
+// Messages then wait for a free slot in the destination mailbox, and
+// for the receiving core.  Synchronous steps wait for every core.
+class TimingModel
+{
+public:
+    // Cost parameters, in cycles
+    unsigned send_cycles;
+    unsigned recv_cycles;
+    unsigned step_cycles;
+    unsigned idle_cycles=2000;
+    unsigned hop_cycles=5;
+    unsigned board_hop_cycles=250;
+    unsigned board_link_cycles_per_flit=3;
+    unsigned flits_per_msg=1;
+
+    TimingModel()
+    {
+        send_cycles=get_option_unsigned("POLITE_SW_SIM_SEND_CYCLES", 80);
+        recv_cycles=get_option_unsigned("POLITE_SW_SIM_RECV_CYCLES", 60);
+        step_cycles=get_option_unsigned("POLITE_SW_SIM_STEP_CYCLES", 40);
+    }
+
+    bool placed() const
+    { return !m_slot.empty(); }
+
+    // Record the thread slot of each device
+    // (Slots are numbered as by HierPlacer)
+    void place(std::vector<uint32_t> slots, unsigned boardsX, unsigned boardsY)
+    {
+        m_slot=std::move(slots);
+        m_mesh_x=boardsX*TinselMailboxMeshXLen;
+        m_mesh_y=boardsY*TinselMailboxMeshYLen;
+        unsigned numBoxes=m_mesh_x*m_mesh_y;
+        m_core_clock.assign(numBoxes << TinselLogCoresPerMailbox, 0);
+        m_inject_clock.assign(numBoxes, 0);
+        m_link_busy.assign(numBoxes*4, 0);
+        m_slots_busy.assign(numBoxes, {});
+        m_mailbox_stall.assign(numBoxes, 0);
+    }
+
+    // Charge a send handler
+    void on_send(unsigned dev)
+    {
+        uint64_t &clock=m_core_clock[core(dev)];
+        clock += send_cycles;
+        m_send_src=dev;
+        m_send_time=clock;
+        m_send_arrivals.clear();
+    }
+
+    // Time at which the message from the last send handler arrives at
+    // the mailbox of the given device (it is sent once per mailbox)
+    uint64_t route(unsigned dst)
+    {
+        unsigned from=mailbox(m_send_src), to=mailbox(dst);
+        auto it=m_send_arrivals.find(to);
+        if(it!=m_send_arrivals.end()){
+            return it->second;
+        }
+        uint64_t &inject=m_inject_clock[from];
+        uint64_t t=m_send_time;
+        inject=std::max(inject, t) + flits_per_msg;
+        t=inject;
+        unsigned x=from % m_mesh_x, y=from / m_mesh_x;
+        unsigned toX=to % m_mesh_x, toY=to / m_mesh_x;
+        while(x!=toX || y!=toY){
+            unsigned dir, nx=x, ny=y;
+            if(x!=toX){
+                dir = x<toX ? 0 : 1;
+                nx = x<toX ? x+1 : x-1;
+            }else{
+                dir = y<toY ? 2 : 3;
+                ny = y<toY ? y+1 : y-1;
+            }
+            bool board=(x/TinselMailboxMeshXLen != nx/TinselMailboxMeshXLen) ||
+                       (y/TinselMailboxMeshYLen != ny/TinselMailboxMeshYLen);
+            m_link_busy[(y*m_mesh_x+x)*4+dir] +=
+                board ? flits_per_msg*board_link_cycles_per_flit : flits_per_msg;
+            t += board ? board_hop_cycles : hop_cycles;
+            x=nx;
+            y=ny;
+        }
+        m_messages++;
+        m_send_arrivals[to]=t;
+        return t;
+    }
+
+    // Charge a receive handler for a message arriving at the given time
+    void on_recv(unsigned dev, uint64_t arrival)
+    {
+        // Wait for a free mailbox slot
+        auto &busy=m_slots_busy[mailbox(dev)];
+        while(!busy.empty() && busy.top() <= arrival){
+            busy.pop();
+        }
+        if(busy.size() >= (1u<<TinselLogMsgsPerMailbox)){
+            m_stall_cycles += busy.top() - arrival;
+            m_mailbox_stall[mailbox(dev)] += busy.top() - arrival;
+            arrival=busy.top();
+            busy.pop();
+        }
+        // Wait for the core
+        uint64_t &clock=m_core_clock[core(dev)];
+        clock=std::max(clock, arrival) + recv_cycles;
+        busy.push(clock);
+        m_max_occupancy=std::max<uint64_t>(m_max_occupancy, busy.size());
+    }
+
+    // All cores wait for global idle detection
+    void barrier()
+    {
+        uint64_t t=0;
+        for(uint64_t c : m_core_clock){
+            t=std::max(t, c);
+        }
+        t += idle_cycles;
+        std::fill(m_core_clock.begin(), m_core_clock.end(), t);
+        m_barriers++;
+    }
+
+    // Charge a step handler
+    void on_step(unsigned dev)
+    { m_core_clock[core(dev)] += step_cycles; }
+
+    void report(FILE *dst)
+    {
+        uint64_t cores=0;
+        for(uint64_t c : m_core_clock){
+            cores=std::max(cores, c);
+        }
+        uint64_t busiest=0, busiestBoard=0, total=0;
+        unsigned used=0;
+        for(unsigned i=0; i<m_link_busy.size(); i++){
+            uint64_t b=m_link_busy[i];
+            if(b==0) continue;
+            unsigned x=(i/4) % m_mesh_x, y=(i/4) / m_mesh_x, dir=i%4;
+            bool board = dir<2 ? (x % TinselMailboxMeshXLen)==(dir==0 ? TinselMailboxMeshXLen-1 : 0)
+                               : (y % TinselMailboxMeshYLen)==(dir==2 ? TinselMailboxMeshYLen-1 : 0);
+            if(board){
+                busiestBoard=std::max(busiestBoard, b);
+            }else{
+                busiest=std::max(busiest, b);
+            }
+            total += b;
+            used++;
+        }
+        // The busiest link bounds the runtime too
+        uint64_t cycles=std::max(cores, std::max(busiest, busiestBoard));
+        double pct = cycles ? 100.0/cycles : 0;
+        fprintf(dst, "POLiteSWSim::TimingModel : Predicted runtime %llu cycles (%.6f s at %u MHz), %llu messages, %llu barriers\n",
+            (unsigned long long)cycles, cycles / (TinselClockFreq*1e6), TinselClockFreq,
+            (unsigned long long)m_messages, (unsigned long long)m_barriers);
+        fprintf(dst, "POLiteSWSim::TimingModel : Link utilisation: busiest on-board %.1f%%, busiest between boards %.1f%%, mean of %u links used %.1f%%\n",
+            busiest*pct, busiestBoard*pct, used, used ? total*pct/used : 0.0);
+        uint64_t worstStall=0;
+        for(uint64_t s : m_mailbox_stall){
+            worstStall=std::max(worstStall, s);
+        }
+        fprintf(dst, "POLiteSWSim::TimingModel : Max mailbox occupancy %llu of %u slots, message wait for full mailboxes (summed over messages) %llu cycles in total, %llu at the worst mailbox\n",
+            (unsigned long long)m_max_occupancy, 1u<<TinselLogMsgsPerMailbox,
+            (unsigned long long)m_stall_cycles, (unsigned long long)worstStall);
+        fprintf(dst, "POLiteSWSim::TimingModel : Devices placed by HierPlacer, not by POLite's mapper, so predictions may not match runs on hardware\n");
+    }
+private:
+    std::vector<uint32_t> m_slot;
+    unsigned m_mesh_x=0, m_mesh_y=0;
+    std::vector<uint64_t> m_core_clock;
+    std::vector<uint64_t> m_inject_clock;
+    std::vector<uint64_t> m_link_busy;
+    std::vector<std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<uint64_t>>> m_slots_busy;
+    uint64_t m_messages=0;
+    uint64_t m_barriers=0;
+    uint64_t m_max_occupancy=0;
+    uint64_t m_stall_cycles=0;
+    std::vector<uint64_t> m_mailbox_stall;
+    unsigned m_send_src=0;
+    uint64_t m_send_time=0;
+    std::unordered_map<unsigned, uint64_t> m_send_arrivals;
+
+    unsigned core(unsigned dev) const
+    { return m_slot[dev] >> TinselLogThreadsPerCore; }
+
+    // Index of mailbox in the mesh of all mailboxes, in row-major order
+    unsigned mailbox(unsigned dev) const
+    {
+        unsigned box=m_slot[dev] >> TinselLogThreadsPerMailbox;
+        unsigned boxesPerBoard=TinselMailboxMeshXLen*TinselMailboxMeshYLen;
+        unsigned board=box / boxesPerBoard, local=box % boxesPerBoard;
+        unsigned boardsX=m_mesh_x / TinselMailboxMeshXLen;
+        unsigned x=(board % boardsX)*TinselMailboxMeshXLen + local % TinselMailboxMeshXLen;
+        unsigned y=(board / boardsX)*TinselMailboxMeshYLen + local / TinselMailboxMeshXLen;
+        return y*m_mesh_x + x;
+    }
+};
+
+// Threads that run each phase of a simulation step over all partitions
+// of the devices. The calling thread runs partition 0 itself. Idle
+// threads spin briefly for the next phase, then block.
+class SimWorkerPool
+{
+private:
+    unsigned m_num_threads;
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::function<void (unsigned)> m_job;
+    std::atomic<unsigned> m_generation{0};
+    std::atomic<unsigned> m_remaining{0};
+    std::atomic<bool> m_stop{false};
+
+    static const unsigned SpinLimit = 4096;
+
+    void worker_proc(unsigned index)
+    {
+        unsigned seen=0;
+        while(1){
+            unsigned spins=0;
+            while(m_generation.load()==seen && !m_stop.load() && spins<SpinLimit){
+                std::this_thread::yield();
+                spins++;
+            }
+            if(m_generation.load()==seen && !m_stop.load()){
+                std::unique_lock<std::mutex> lk(m_mutex);
+                m_cond.wait(lk, [&](){ return m_generation.load()!=seen || m_stop.load(); });
+            }
+            if(m_stop.load()){
+                return;
+            }
+            seen=m_generation.load();
+            m_job(index);
+            m_remaining.fetch_sub(1);
+        }
+    }
+public:
+    SimWorkerPool(unsigned num_threads)
+        : m_num_threads(num_threads)
+    {
+        for(unsigned i=1; i<m_num_threads; i++){
+            m_threads.emplace_back([=](){ worker_proc(i); });
+        }
+    }
+
+    ~SimWorkerPool()
+    {
+        {
+            std::unique_lock<std::mutex> lk(m_mutex);
+            m_stop.store(true);
+        }
+        m_cond.notify_all();
+        for(auto &t : m_threads){
+            t.join();
+        }
+    }
+
+    // Run job(i) for each partition i, returning when all are done
+    void run(std::function<void (unsigned)> job)
+    {
+        m_job=job;
+        m_remaining.store(m_num_threads-1);
+        {
+            std::unique_lock<std::mutex> lk(m_mutex);
+            m_generation.fetch_add(1);
+        }
+        m_cond.notify_all();
+        job(0);
+        while(m_remaining.load()!=0){
+            std::this_thread::yield();
+        }
+    }
+};
+
 template <typename DeviceType, typename S, typename E, typename M>
 class PGraph
     : public PGraphBase // Implementation detail
@@ -362,6 +667,7 @@ public:
     PGraph()
     {
         deliver_out_of_order=POLiteSWSim::get_option_bool("POLITE_SW_SIM_DELIVER_OUT_OF_ORDER", true);
+        timing_enabled=POLiteSWSim::get_option_bool("POLITE_SW_SIM_TIMING", false);
         verbosity=POLiteSWSim::get_option_unsigned("POLITE_SW_SIM_VERBOSITY", 1);
     }
 
@@ -454,10 +760,20 @@ public:
         addLabelledEdgeImpl(edge,from, pin, to, true);
     }
 
+    // Mapping weights have no effect in SW
+    void setDeviceWeight(PDeviceId id, uint32_t weight)
+    {}
+
+    void setPinWeight(PDeviceId id, PinId pin, uint32_t weight)
+    {
+        assert(pin<POLITE_NUM_PINS);
+    }
+
     bool mapVerticesToDRAM=false; // Dummy flag
     bool mapInEdgeHeadersToDRAM=false; // Dummy flag
     bool mapInEdgeRestToDRAM=false; // Dummy flag
     bool mapOutEdgesToDRAM=false; // Dummy flag
+    bool autoMapRegions=false; // Dummy flag
 
     // uint32_t i = graph.numDevices;
     uint32_t numDevices = 0;
@@ -490,9 +806,13 @@ public:
     uint64_t getEdgeCount() const
     { return m_edgeCount; }
 
-    // No-op for sw
+    // No-op for sw, unless the timing model needs a placement
     void map()
-    {}
+    {
+        if(timing_enabled){
+            place_for_timing();
+        }
+    }
 
     void write(HostLink *h)
     {
@@ -510,38 +830,187 @@ private:
         unsigned src;
         unsigned key;
         unsigned time;
+        uint64_t arrival;
         M msg;
     };
 
+    // State of each simulation thread, which owns a contiguous range of
+    // devices. Messages to another thread's devices go in that thread's
+    // slot of the sender's outbox, which only the sender writes during
+    // the send phase and only the owner reads during the deliver phase,
+    // so no locking is needed.
+    struct alignas(64) SimThread
+    {
+        unsigned first_device;
+        unsigned end_device;
+        std::mt19937_64 rng;
+        std::deque<std::vector<transit_msg>> messages_in_flight;
+        unsigned messages_in_flight_total=0;
+        std::vector<std::vector<transit_msg>> outbox;
+        std::vector<M> to_host;
+        uint64_t messages_sent=0;
+        uint64_t messages_received=0;
+        unsigned max_time_skew=0;
+        bool idle;
+        bool active;
+    };
+
     unsigned time_now=0;
-    unsigned max_time_skew=0;
-    uint64_t messages_sent=0;
-    uint64_t messages_received=0;
-    unsigned messages_in_flight_total=0;
-    uint64_t sum_messages_in_flight_since_last_print=0;
     unsigned max_in_flight_ever=0;
+    uint64_t sum_messages_in_flight_since_last_print=0;
     unsigned next_print_time=10000;
     unsigned time_since_print=0;
-    std::deque<std::vector<transit_msg>> messages_in_flight;
     std::geometric_distribution<> msg_delay_distribution{0.1};
 
     bool deliver_out_of_order;
 
-    void post_message(std::mt19937_64 &rng, unsigned dst, unsigned src, unsigned key, const M &msg)
+    bool timing_enabled;
+    TimingModel timing;
+
+    // Place devices on threads as the one-pass mapper would
+    void place_for_timing()
+    {
+        Graph g;
+        for(unsigned i=0; i<numDevices; i++){
+            g.newNode();
+        }
+        for(unsigned i=0; i<numDevices; i++){
+            for(unsigned p=0; p<POLITE_NUM_PINS; p++){
+                for(const auto &e : devices[i]->outgoing[p]){
+                    g.addEdge(i, p, e.first);
+                }
+            }
+        }
+        unsigned boardsX=get_option_unsigned("POLITE_BOARDS_X", TinselMeshXLenWithinBox);
+        unsigned boardsY=get_option_unsigned("POLITE_BOARDS_Y", TinselMeshYLenWithinBox);
+        HierPlacer placer(&g, boardsX, boardsY,
+            TinselMailboxMeshXLen, TinselMailboxMeshYLen,
+            1<<TinselLogThreadsPerMailbox);
+        placer.place();
+        std::vector<uint32_t> slots(numDevices);
+        for(unsigned i=0; i<numDevices; i++){
+            slots[i]=placer.slot(i);
+        }
+        timing.place(std::move(slots), boardsX, boardsY);
+    }
+
+    unsigned num_sim_threads=1;
+    unsigned devices_per_sim_thread=1;
+    std::vector<SimThread> sim_threads;
+    std::unique_ptr<SimWorkerPool> sim_pool;
+
+    unsigned owner(unsigned dev) const
+    { return dev / devices_per_sim_thread; }
+
+    // Queue a message for delivery, after a random delay
+    void post_message(SimThread &t, const transit_msg &m)
     {
         unsigned distance;
         if(deliver_out_of_order){
-            distance=msg_delay_distribution(rng);
+            distance=msg_delay_distribution(t.rng);
         }else{
             distance=1;
         }
-        while(messages_in_flight.size() <= distance){
-            messages_in_flight.push_back({});
+        while(t.messages_in_flight.size() <= distance){
+            t.messages_in_flight.push_back({});
+        }
+        t.messages_in_flight.at(distance).push_back(m);
+        t.messages_in_flight_total ++;
+    }
+
+    // Each ready device may send, with probability 1/2
+    void send_phase(SimThread &t)
+    {
+        t.idle=true;
+        for(unsigned i=t.first_device; i<t.end_device; i++){
+            auto &d=device_states[i];
+            if(d._realReadyToSend.index){
+                if((t.rng()&1)==0){
+                    PPin pin=d._realReadyToSend;
+
+                    M msg;
+                    d.send(&msg);
+
+                    if(pin==No){
+                        // Do nothing
+                    }else if(pin==HostPin){
+                        if(timing_enabled) timing.on_send(i);
+                        t.to_host.push_back(msg);
+                    }else{
+                        if(timing_enabled) timing.on_send(i);
+                        for(const auto &e : devices[i]->outgoing.at(pin.index-2)){
+                            uint64_t arrival = timing_enabled ? timing.route(e.first) : 0;
+                            t.outbox[owner(e.first)].push_back({e.first, i, e.second, time_now, arrival, msg});
+                            t.messages_sent++;
+                        }
+                    }
+                }
+                t.idle=false;
+            }
+        }
+    }
+
+    // Collect messages sent to this thread, and deliver those now due
+    void deliver_phase(unsigned self)
+    {
+        SimThread &t=sim_threads[self];
+        for(auto &src : sim_threads){
+            for(const transit_msg &m : src.outbox[self]){
+                post_message(t, m);
+            }
+            src.outbox[self].clear();
+        }
+
+        if(!t.messages_in_flight.empty()){
+            const auto &now=t.messages_in_flight.front();
+            for(const transit_msg &m : now){
+                unsigned time_skew=time_now - m.time;
+                if(time_skew > t.max_time_skew){
+                    t.max_time_skew=time_skew;
+                }
+                if(timing_enabled){
+                    timing.on_recv(m.dst, m.arrival);
+                }
+                device_states[m.dst].recv((M*)&m.msg, &devices[m.dst]->incoming[m.key]);
+            }
+            t.messages_in_flight_total -= now.size();
+            t.messages_received += now.size();
+            t.messages_in_flight.pop_front();
+            t.idle=false;
+        }
+    }
+
+    void step_phase(SimThread &t)
+    {
+        t.active=false;
+        for(unsigned i=t.first_device; i<t.end_device; i++){
+            t.active |= device_states[i].step();
+            device_states[i].time++;
+            if(timing_enabled){
+                timing.on_step(i);
+            }
         }
+    }
 
-        messages_in_flight.at(distance).push_back({dst, src, key, time_now, msg});
-        messages_in_flight_total ++;
-        messages_sent++;
+    void finish_phase(SimThread &t)
+    {
+        for(unsigned i=t.first_device; i<t.end_device; i++){
+            M msg;
+            if(device_states[i].finish(&msg)){
+                t.to_host.push_back(msg);
+            }
+        }
+    }
+
+    // Pass messages for the host on, in device order
+    void flush_to_host(std::function<void (void *, size_t)> &send_cb)
+    {
+        for(auto &t : sim_threads){
+            for(M &msg : t.to_host){
+                send_cb(&msg, sizeof(M));
+            }
+            t.to_host.clear();
+        }
     }
 public:
 
@@ -556,14 +1025,60 @@ public:
 
             device_states[i].init();
         }
+
+        // The timing model is updated serially
+        if(timing_enabled){
+            if(!timing.placed()){
+                place_for_timing();
+            }
+            // Bytes in a hardware message: a 16-bit key, then the payload
+            unsigned bytes=std::max<unsigned>(2, alignof(M)) + sizeof(M);
+            timing.flits_per_msg=(bytes + (1<<TinselLogBytesPerFlit) - 1) >> TinselLogBytesPerFlit;
+        }
+
+        // Partition devices between simulation threads
+        num_sim_threads = timing_enabled ? 1 :
+            POLiteSWSim::get_option_unsigned("POLITE_SW_SIM_THREADS",
+                std::max(1u, std::thread::hardware_concurrency()));
+        num_sim_threads=std::max(1u, std::min(num_sim_threads, numDevices));
+        devices_per_sim_thread=std::max(1u, (numDevices+num_sim_threads-1) / num_sim_threads);
+        num_sim_threads=std::max(1u, (numDevices+devices_per_sim_thread-1) / devices_per_sim_thread);
+        sim_threads.resize(num_sim_threads);
+        for(unsigned i=0; i<num_sim_threads; i++){
+            sim_threads[i].first_device=i*devices_per_sim_thread;
+            sim_threads[i].end_device=std::min(numDevices, (i+1)*devices_per_sim_thread);
+            sim_threads[i].outbox.resize(num_sim_threads);
+        }
+        sim_pool.reset(new SimWorkerPool(num_sim_threads));
+        if(verbosity >= 2){
+            fprintf(stderr, "POLiteSWSim::PGraph::sim_prepare : Info - simulating on %u threads\n", num_sim_threads);
+        }
     }
 
     virtual bool sim_step(
         std::mt19937_64 &rng,
         std::function<void (void *, size_t)> send_cb
     ){
+        if(time_now==0){
+            for(auto &t : sim_threads){
+                t.rng.seed(rng());
+            }
+        }
+
+        unsigned messages_in_flight_total=0;
+        for(const auto &t : sim_threads){
+            messages_in_flight_total += t.messages_in_flight_total;
+        }
+
         if(time_now >= next_print_time){
             if(verbosity >= 1){
+                uint64_t messages_sent=0, messages_received=0;
+                unsigned max_time_skew=0;
+                for(const auto &t : sim_threads){
+                    messages_sent += t.messages_sent;
+                    messages_received += t.messages_received;
+                    max_time_skew=std::max(max_time_skew, t.max_time_skew);
+                }
                 double avg_in_flight=sum_messages_in_flight_since_last_print / (double)time_since_print;
                 fprintf(stderr, "POLiteSWSim::PGraph::sim_step : Info - step=%u, sent=%llu, recv=%llu, in_flight:[now=%u, avg=%.1f, max=%u], max_skew=%u\n",
                         time_now, (unsigned long long)messages_sent, (unsigned long long)messages_received, messages_in_flight_total, avg_in_flight, max_in_flight_ever, max_time_skew);
@@ -576,55 +1091,27 @@ public:
         sum_messages_in_flight_since_last_print += messages_in_flight_total;
         time_since_print++;
 
-        bool idle=true;
-        for(unsigned i=0; i<numDevices; i++){
-            auto &d=device_states[i];
-            if(d._realReadyToSend.index){
-                if((rng()&1)==0){
-                    PPin pin=d._realReadyToSend;
-
-                    M msg;
-                    d.send(&msg);
-
-                    if(pin==No){
-                        // Do nothing
-                    }else if(pin==HostPin){
-                        send_cb(&msg, sizeof(msg));
-                    }else{
-                        for(const auto &e : devices[i]->outgoing.at(pin.index-2)){
-                            post_message(rng, e.first, i, e.second, msg);
-                        }
-                    }
-                }
-                idle=false;
-            }
-        }
-
-        if(!messages_in_flight.empty()){
-            const auto &now=messages_in_flight.front();
-            for(const transit_msg &m : now){
-                unsigned time_skew=time_now - m.time;
-                if(time_skew > max_time_skew){
-                    max_time_skew=time_skew;
-                }
-                device_states[m.dst].recv((M*)&m.msg, &devices[m.dst]->incoming[m.key]);
-            }
-            messages_in_flight_total -= now.size();
-            messages_received += now.size();
-            messages_in_flight.pop_front();
-            idle=false;
-        }
+        sim_pool->run([&](unsigned i){ send_phase(sim_threads[i]); });
+        flush_to_host(send_cb);
+        sim_pool->run([&](unsigned i){ deliver_phase(i); });
 
         time_now++;
 
+        bool idle=true;
+        for(const auto &t : sim_threads){
+            idle = idle && t.idle;
+        }
         if(!idle){
             return true;
         }
 
+        if(timing_enabled){
+            timing.barrier();
+        }
+        sim_pool->run([&](unsigned i){ step_phase(sim_threads[i]); });
         bool any_active=false;
-        for(unsigned i=0; i<numDevices; i++){
-            any_active |= device_states[i].step();
-            device_states[i].time++;
+        for(const auto &t : sim_threads){
+            any_active |= t.active;
         }
         if(any_active){
             return true;
@@ -632,11 +1119,11 @@ public:
 
         time_now++;
 
-        for(unsigned i=0; i<numDevices; i++){
-            M msg;
-            if(device_states[i].finish(&msg)){
-                send_cb(&msg, sizeof(M));
-            }
+        sim_pool->run([&](unsigned i){ finish_phase(sim_threads[i]); });
+        flush_to_host(send_cb);
+
+        if(timing_enabled && verbosity >= 1){
+            timing.report(stderr);
         }
 
         return false;
@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Placer benchmark: time the placement of a large synthetic graph onto a
+// mesh, using both the incremental (swap-delta) cost evaluation and the
+// original full cost() recomputation, and then using multi-start
+// simulated annealing.
+//
+// Build (from this directory):
+//   g++ -O2 -fopenmp -I ../../../include PlacerBench.cpp -lmetis
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <POLite/Placer.h>
+
+// Time since given start time, in seconds
+double elapsed(struct timeval* start)
+{
+  struct timeval finish, diff;
+  gettimeofday(&finish, NULL);
+  timersub(&finish, start, &diff);
+  return (double) diff.tv_sec + (double) diff.tv_usec / 1000000.0;
+}
+
+// Reference hill-climbing placement, using full cost recomputation
+// (This mirrors Placer::place() prior to incremental cost evaluation)
+void placeReference(Placer* p, uint32_t numAttempts)
+{
+  p->savedCost = ~0;
+  for (uint32_t n = 0; n < numAttempts; n++) {
+    p->randomPlacement();
+    p->currentCost = p->cost();
+    bool change;
+    do {
+      change = false;
+      for (uint32_t y = 0; y < p->height-1; y++) {
+        for (uint32_t x = 0; x < p->width-1; x++) {
+          uint32_t xs[3] = {x+1, x, x+1};
+          uint32_t ys[3] = {y, y+1, y+1};
+          for (int i = 0; i < 3; i++) {
+            p->swap(x, y, xs[i], ys[i]);
+            uint64_t c = p->cost();
+            if (c < p->currentCost) {
+              p->currentCost = c;
+              change = true;
+              break;
+            }
+            p->swap(x, y, xs[i], ys[i]);
+          }
+        }
+      }
+    } while (change);
+    if (p->currentCost <= p->savedCost) p->save(); else p->restore();
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 6) {
+    printf("Usage: PlacerBench <vertices> <fanout> <width> <height> "
+                              "<attempts>\n");
+    return -1;
+  }
+
+  uint32_t numVertices = atoi(argv[1]);
+  uint32_t fanOut = atoi(argv[2]);
+  uint32_t width = atoi(argv[3]);
+  uint32_t height = atoi(argv[4]);
+  uint32_t attempts = atoi(argv[5]);
+
+  // Synthetic graph: mostly-local edges with some long-range ones,
+  // so that the partitions have a non-trivial connection matrix
+  Graph graph;
+  for (uint32_t i = 0; i < numVertices; i++) graph.newNode();
+  unsigned int seed = 1;
+  for (uint32_t i = 0; i < numVertices; i++) {
+    for (uint32_t j = 0; j < fanOut; j++) {
+      uint32_t dst;
+      if ((rand_r(&seed) % 8) == 0)
+        dst = rand_r(&seed) % numVertices;
+      else
+        dst = (i + 1 + rand_r(&seed) % 64) % numVertices;
+      graph.addEdge(i, dst);
+    }
+  }
+
+  // Partition (using POLITE_PLACER method) and count connections
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  Placer placer(&graph, width, height);
+  printf("Partitioning: %lfs\n", elapsed(&start));
+
+  // Incremental cost evaluation
+  placer.placeMethod = Placer::HillClimb;
+  placer.setRand(1);
+  gettimeofday(&start, NULL);
+  placer.place(attempts);
+  double fastTime = elapsed(&start);
+  uint64_t fastCost = placer.savedCost;
+  printf("Placement (swap delta):   %lfs, cost %lu\n", fastTime, fastCost);
+
+  // Full cost recomputation
+  placer.setRand(1);
+  gettimeofday(&start, NULL);
+  placeReference(&placer, attempts);
+  double slowTime = elapsed(&start);
+  uint64_t slowCost = placer.savedCost;
+  printf("Placement (full cost):    %lfs, cost %lu\n", slowTime, slowCost);
+
+  if (fastCost != slowCost) {
+    printf("Error: placements differ\n");
+    return EXIT_FAILURE;
+  }
+  printf("Speedup: %.1lfx\n", slowTime / fastTime);
+
+  // Simulated annealing, with restarts in parallel
+  placer.placeMethod = Placer::Anneal;
+  placer.setRand(1);
+  gettimeofday(&start, NULL);
+  placer.place(attempts);
+  printf("Placement (annealing):    %lfs, cost %lu\n",
+    elapsed(&start), placer.savedCost);
+  return 0;
+}
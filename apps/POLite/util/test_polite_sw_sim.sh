@@ -9,7 +9,7 @@ COMPILE_APPS="asp-gals asp-sync asp-tiles-sync clocktree-async \
     izhikevich-gals izhikevich-sync \
     pagerank-gals pagerank-sync \
     sssp-async sssp-sync \
-    pressure-sync nhood-sync"
+    pressure-sync nhood-sync coalesce-test"
 
 echo "TAP version 13"
 
@@ -88,3 +88,15 @@ function test_run {
 test_run "clocktree-async" 5 5
 test_run "pressure-sync" 10
 test_run "nhood-sync"
+# POLiteSWSim does not coalesce messages, so coalesce-test only checks
+# the app itself; the device-side packing is tested on the host against
+# a stand-in tinsel.h
+test_run "coalesce-test" 2000 16
+
+OUTPUT=$(make -C $SCRIPT_DIR/PDeviceTest test 2>&1)
+RES=$?
+if [[ $RES -eq 0 ]] ; then
+    record_ok "Run PThread coalescing test"
+else
+    record_not_ok "Run PThread coalescing test" "$OUTPUT"
+fi
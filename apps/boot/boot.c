@@ -39,9 +39,13 @@ int main()
       // (We avoid using a switch statement here so that the compiler
       // doesn't generate a data section)
       uint8_t cmd = msgIn->cmd;
+      int n = msgIn->numArgs;
+      if (cmd == MulticastCmd) {
+        cmd = msgIn->mcastCmd;
+        n = msgIn->mcastNumArgs;
+      }
       if (cmd == WriteInstrCmd) {
         // Write instructions to instruction memory
-        int n = msgIn->numArgs;
         for (int i = 0; i < n; i++) {
           tinselWriteInstr(addrReg, msgIn->args[i]);
           addrReg += 4;
@@ -49,7 +53,6 @@ int main()
       }
       else if (cmd == StoreCmd) {
         // Store words to data memory
-        int n = msgIn->numArgs;
         for (int i = 0; i < n; i++) {
           uint32_t* ptr = (uint32_t*) addrReg;
           *ptr = msgIn->args[i];
@@ -59,7 +62,7 @@ int main()
       }
       else if (cmd == LoadCmd) {
         // Load words from data memory
-        int n = msgIn->args[0];
+        n = msgIn->args[0];
         while (n > 0) {
           int m = n > 4 ? 4 : n;
           tinselWaitUntil(TINSEL_CAN_SEND);
@@ -76,7 +79,7 @@ int main()
         // Set address register
         addrReg = msgIn->args[0];
       }
-      else if (cmd == StartCmd) {
+      else if (cmd == StartCmd || cmd == FlushCmd) {
         // Cache flush
         tinselCacheFlush();
         // Wait until lines written back, by issuing a load
@@ -87,14 +90,16 @@ int main()
         tinselWaitUntil(TINSEL_CAN_SEND);
         msgOut[0] = tinselId();
         tinselSend(hostId, msgOut);
-        // Wait for trigger
-        while ((tinselUartTryGet() & 0x100) == 0);
-        // Start remaining threads
-        int numThreads = msgIn->args[0];
-        for (int i = 0; i < numThreads; i++)
-          tinselCreateThread(i+1);
-        tinselFree(msgIn);
-        break;
+        if (cmd == StartCmd) {
+          // Wait for trigger
+          while ((tinselUartTryGet() & 0x100) == 0);
+          // Start remaining threads
+          int numThreads = msgIn->args[0];
+          for (int i = 0; i < numThreads; i++)
+            tinselCreateThread(i+1);
+          tinselFree(msgIn);
+          break;
+        }
       }
       tinselFree(msgIn);
     }
@@ -4,6 +4,7 @@
 #include "MemFileReader.h"
 #include "PowerLink.h"
 #include "SocketUtils.h"
+#include "ShmRing.h"
 
 #include <boot.h>
 #include <ctype.h>
@@ -12,6 +13,8 @@
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -20,10 +23,136 @@
 #include <limits.h>
 #include <string.h>
 #include <signal.h>
+#include <sched.h>
 
 // Send buffer size (in flits)
 #define SEND_BUFFER_SIZE 8192
 
+// Receive buffer size (in messages)
+#define RECV_BUFFER_SIZE 16384
+
+// Number of times to poll the shared-memory RX ring, or the receive
+// queue, before sleeping
+#define SHM_RECV_SPIN 256
+
+// Bytes per block of the receive queue (a multiple of the message size,
+// so that messages never straddle blocks)
+#define RECV_QUEUE_BLOCK_BYTES (1 << 20)
+
+// Block of the receive queue
+struct RecvQueueBlock {
+  // Bytes of whole messages written, published by the receive thread
+  volatile uint32_t numBytes;
+  // Next block, published by the receive thread once this one is full
+  RecvQueueBlock* volatile next;
+  // Contents
+  char data[RECV_QUEUE_BLOCK_BYTES];
+};
+
+// Allocate an empty block of the receive queue
+static RecvQueueBlock* newRecvQueueBlock()
+{
+  RecvQueueBlock* block = (RecvQueueBlock*) malloc(sizeof(RecvQueueBlock));
+  if (block == NULL) {
+    fprintf(stderr, "Out of memory for HostLink receive queue\n");
+    exit(EXIT_FAILURE);
+  }
+  block->numBytes = 0;
+  block->next = NULL;
+  return block;
+}
+
+// Routing tables for multicast boot live in the last 1024 bytes of the
+// POLite routing table region of each board's first DRAM (which POLite
+// never uses)
+#define BOOT_ROUTES_BYTES 1024
+#define BOOT_ROUTES_BASE \
+  (TinselPOLiteProgRouterBase + TinselPOLiteProgRouterLength - \
+     BOOT_ROUTES_BYTES)
+
+// The power-on self test stores a word to, and loads it back from, the
+// last line of the same region
+#define SELF_TEST_ADDR \
+  (BOOT_ROUTES_BASE + BOOT_ROUTES_BYTES - (1 << TinselLogBytesPerLine))
+
+// Self-test tags identify the attempt and the board and half probed
+#define SELF_TEST_TAG_BASE 0x5e1f0000
+#define SELF_TEST_TAG(attempt, probe) \
+  (SELF_TEST_TAG_BASE + ((attempt) << 12) + (probe))
+
+// Deadline for all responses to the power-on self test (in seconds),
+// and the number of attempts made for boards that fail to respond
+#define SELF_TEST_TIMEOUT 3.0
+#define SELF_TEST_ATTEMPTS 3
+
+// Deadline for all cores to acknowledge a start request (in seconds)
+#define START_TIMEOUT 10.0
+
+// Routing records for one key of the multicast boot tables
+// (See the "Tinsel Router" section of the README for the encoding)
+struct BootRoute {
+  // At most one MRM record per mailbox (two per beat), and two RR records
+  static const uint32_t MaxBeats = TinselMailboxesPerBoard/2 + 2;
+
+  // Encoded routing beats
+  uint8_t beats[MaxBeats][32];
+  uint32_t numBeats;
+
+  // Number of 48-bit chunks used in the current beat
+  uint32_t numChunks;
+
+  BootRoute() {
+    memset(beats, 0, sizeof(beats));
+    numBeats = 0;
+    numChunks = 5;
+  }
+
+  // Allocate a record of the given number of chunks
+  uint8_t* newRecord(uint32_t chunks) {
+    if (numChunks + chunks > 5) {
+      assert(numBeats < MaxBeats);
+      numBeats++;
+      numChunks = 0;
+    }
+    uint8_t* beat = beats[numBeats-1];
+    numChunks += chunks;
+    beat[30]++;
+    return &beat[6*(5-numChunks)];
+  }
+
+  // Add an RR record
+  void addRR(uint32_t dir, uint32_t key) {
+    uint8_t* ptr = newRecord(1);
+    ptr[0] = key;
+    ptr[1] = key >> 8;
+    ptr[2] = key >> 16;
+    ptr[3] = key >> 24;
+    ptr[5] = (2 << 5) | (dir << 3);
+  }
+
+  // Add an MRM record for each mailbox with a non-empty thread mask
+  void addMRMs(uint64_t* masks, uint16_t localKey) {
+    for (uint32_t b = 0; b < TinselMailboxesPerBoard; b++) {
+      if (masks[b] == 0) continue;
+      uint32_t mboxX = b % TinselMailboxMeshXLen;
+      uint32_t mboxY = b / TinselMailboxMeshXLen;
+      uint8_t* ptr = newRecord(2);
+      for (int i = 0; i < 8; i++) ptr[i] = masks[b] >> (8*i);
+      ptr[8] = localKey;
+      ptr[9] = localKey >> 8;
+      ptr[11] = (3 << 5) | (mboxY << 3) | (mboxX << 1);
+    }
+  }
+};
+
+// Current time in seconds
+static double currentTime()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+}
+
 // Function to connect to a PCIeStream UNIX domain socket
 static int connectToPCIeStream(const char* socketPath)
 {
@@ -59,6 +188,46 @@ static int connectToPCIeStream(const char* socketPath)
   return sock;
 }
 
+#ifndef SIMULATE
+// Ask PCIeStream daemon for shared-memory rings (see ShmRing.h)
+static ShmRegion* connectToShmRings(int sock)
+{
+  uint32_t hello[4] = { 0, ShmHelloMagic, 0, 0 };
+  socketBlockingPut(sock, (char*) hello, sizeof(hello));
+
+  // Receive ack, carrying the file descriptor of the region
+  uint32_t ack[4];
+  struct iovec iov;
+  iov.iov_base = ack;
+  iov.iov_len = sizeof(ack);
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  int ret = recvmsg(sock, &msg, MSG_WAITALL);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (ret != sizeof(ack) || ack[1] != ShmHelloMagic ||
+      ack[2] != sizeof(ShmRegion) || cmsg == NULL ||
+      cmsg->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "PCIeStream daemon does not support shared memory\n");
+    exit(EXIT_FAILURE);
+  }
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  void* ptr = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    perror("mmap PCIeStream rings");
+    exit(EXIT_FAILURE);
+  }
+  return (ShmRegion*) ptr;
+}
+#endif
+
 // Internal constructor
 void HostLink::constructor(HostLinkParams p)
 {
@@ -93,6 +262,13 @@ void HostLink::constructor(HostLinkParams p)
     pcieLink = connectToPCIeStream(PCIESTREAM);
   #endif
 
+  // Use shared-memory rings, if requested
+  shm = NULL;
+  shmTxHead = shmRxTail = 0;
+  #ifndef SIMULATE
+    if (getenv("HOSTLINK_SHM")) shm = connectToShmRings(pcieLink);
+  #endif
+
   // Create DebugLink
   DebugLinkParams debugLinkParams;
   debugLinkParams.numBoxesX = p.numBoxesX;
@@ -134,6 +310,10 @@ void HostLink::constructor(HostLinkParams p)
     }
   }
 
+  // Multicast boot is opt-in, as it needs an up-to-date boot loader
+  useMulticastBoot = getenv("HOSTLINK_MULTICAST_BOOT") != NULL;
+  verbose = getenv("HOSTLINK_VERBOSE") != NULL;
+
   // Initialise send buffer
   useSendBuffer = false;
   sendBuffer = new char [(1<<TinselLogBytesPerFlit) * SEND_BUFFER_SIZE];
@@ -143,8 +323,18 @@ void HostLink::constructor(HostLinkParams p)
   memset(sendBuffer, 0, (1<<TinselLogBytesPerFlit) * SEND_BUFFER_SIZE);
   sendBufferLen = 0;
 
-  // Run the self test
-  if (! powerOnSelfTest()) {
+  // Initialise receive buffer
+  recvBuffer = new char [(1<<TinselLogBytesPerMsg) * RECV_BUFFER_SIZE];
+  recvBufferHead = recvBufferTail = 0;
+
+  // Start receive thread, if requested
+  recvQueue = NULL;
+  sendAsleep = 0;
+  if (p.useRecvThread || getenv("HOSTLINK_RECV_THREAD")) startRecvThread();
+
+  // Run the self test (unless testing against a daemon with no FPGA,
+  // such as "pciestreamd -s", which cannot respond to it)
+  if (getenv("HOSTLINK_NO_SELF_TEST") == NULL && ! powerOnSelfTest()) {
     fprintf(stderr, "Power-on self test failed.  Please try again.\n");
     exit(EXIT_FAILURE);
   }
@@ -198,13 +388,18 @@ HostLink::~HostLink()
   delete [] lineBuffer;
   delete [] lineBufferLen;
 
+  // Stop receive thread
+  if (recvQueue) stopRecvThread();
+
   // Free send buffer
   delete [] sendBuffer;
+  delete [] recvBuffer;
 
   // Close debug link
   delete debugLink;
 
   // Close connection to the PCIe stream daemon
+  if (shm) munmap(shm, sizeof(ShmRegion));
   close(pcieLink);
 
   // Release HostLink lock
@@ -255,7 +450,30 @@ bool HostLink::sendHelper(uint32_t dest, uint32_t numFlits, void* payload,
   // (Because PCIeStream currently has this assumption)
   assert(TinselLogBytesPerFlit == 4);
 
-  if (useSendBuffer) {
+  if (shm) {
+    // Wait for space in the TX ring
+    uint32_t totalBytes = 16 * (1 + numFlits);
+    if (shmRingSpace(&shm->tx, shmTxHead) < totalBytes) {
+      if (! block) return false;
+      shmPublish();
+      shmWaitSend(totalBytes);
+    }
+
+    // Write message to the TX ring, from which the daemon copies it to
+    // a DMA buffer
+    // (See DE5BridgeTop.bsv for details of the header)
+    uint32_t header[4];
+    header[0] = dest;
+    header[1] = 0;
+    header[2] = (numFlits-1) << 24;
+    header[3] = key;
+    shmRingPut(&shm->tx, shmTxHead, header, 16);
+    shmRingPut(&shm->tx, shmTxHead + 16, payload, numFlits*16);
+    shmTxHead += totalBytes;
+    if (! useSendBuffer) shmPublish();
+    return true;
+  }
+  else if (useSendBuffer) {
     // Flush the buffer when we run out of space
     if ((sendBufferLen + numFlits + 1) >= SEND_BUFFER_SIZE) flush();
 
@@ -317,10 +535,271 @@ bool HostLink::send(uint32_t dest, uint32_t numFlits, void* msg, bool block)
   return sendHelper(dest, numFlits, msg, block, 0);
 }
 
+// Make messages written to the TX ring visible to PCIeStream
+void HostLink::shmPublish()
+{
+  if (shm->tx.head != shmTxHead) {
+    shmRingPublish(&shm->tx, shmTxHead);
+    shmDoorbell(&shm->daemonAsleep, pcieLink);
+  }
+}
+
+// Wait until the RX ring holds at least numBytes unread bytes
+// (Returns false if the receive thread is asked to stop)
+bool HostLink::shmWaitRecv(uint32_t numBytes)
+{
+  // Spin for a while before sleeping
+  for (int i = 0; i < SHM_RECV_SPIN; i++) {
+    if (shmRingAvail(&shm->rx, shmRxTail) >= numBytes) return true;
+    sched_yield();
+  }
+  for (;;) {
+    // Ask for a doorbell, and recheck the ring
+    shm->clientAsleep = 1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (shmRingAvail(&shm->rx, shmRxTail) >= numBytes) break;
+    if (! waitLink()) return false;
+    // Discard doorbell bytes
+    char buf[64];
+    int ret = ::recv(pcieLink, buf, sizeof(buf), MSG_DONTWAIT);
+    if (ret == 0 || (ret < 0 && errno != EAGAIN)) {
+      fprintf(stderr, "Lost connection to PCIeStream daemon\n");
+      exit(EXIT_FAILURE);
+    }
+    // The doorbell may have been for a sender
+    shmWakeSender();
+  }
+  shm->clientAsleep = 0;
+  return true;
+}
+
+// Wait until the TX ring has space for numBytes
+void HostLink::shmWaitSend(uint32_t numBytes)
+{
+  // Spin for a while before sleeping
+  for (int i = 0; i < SHM_RECV_SPIN; i++) {
+    if (shmRingSpace(&shm->tx, shmTxHead) >= numBytes) return;
+    sched_yield();
+  }
+  if (recvQueue) {
+    // The receive thread reads the doorbells, and wakes us
+    pthread_mutex_lock(&recvLock);
+    sendAsleep = 1;
+    for (;;) {
+      // Ask for a doorbell, and recheck the ring
+      shm->clientSendAsleep = 1;
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (shmRingSpace(&shm->tx, shmTxHead) >= numBytes) break;
+      pthread_cond_wait(&sendCond, &recvLock);
+    }
+    sendAsleep = 0;
+    pthread_mutex_unlock(&recvLock);
+  }
+  else {
+    for (;;) {
+      // Ask for a doorbell, and recheck the ring
+      shm->clientSendAsleep = 1;
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (shmRingSpace(&shm->tx, shmTxHead) >= numBytes) break;
+      waitLink();
+      // Discard doorbell bytes
+      char buf[64];
+      int ret = ::recv(pcieLink, buf, sizeof(buf), MSG_DONTWAIT);
+      if (ret == 0 || (ret < 0 && errno != EAGAIN)) {
+        fprintf(stderr, "Lost connection to PCIeStream daemon\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  shm->clientSendAsleep = 0;
+}
+
+// Wake a sender waiting for space in the TX ring
+// (The full barrier orders reading the doorbell before reading the
+// flag, which the sender sets before asking for a doorbell)
+void HostLink::shmWakeSender()
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (sendAsleep) {
+    pthread_mutex_lock(&recvLock);
+    pthread_cond_signal(&sendCond);
+    pthread_mutex_unlock(&recvLock);
+  }
+}
+
+// Block until the link to PCIeStream is readable
+// (Returns false if the receive thread is asked to stop)
+bool HostLink::waitLink()
+{
+  struct pollfd fds[2];
+  fds[0].fd = pcieLink; fds[0].events = POLLIN;
+  fds[1].fd = recvStop; fds[1].events = POLLIN;
+  // The stop eventfd is only polled by the receive thread
+  int n = recvQueue ? 2 : 1;
+  while (poll(fds, n, -1) < 0) {
+    if (errno != EINTR) {
+      perror("poll");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return ! recvStopping;
+}
+
+// Start the receive thread
+void HostLink::startRecvThread()
+{
+  recvQueue = newRecvQueueBlock();
+  recvQueueOffset = 0;
+  recvAsleep = 0;
+  sendAsleep = 0;
+  recvStopping = false;
+  recvStop = eventfd(0, 0);
+  if (recvStop == -1) {
+    perror("eventfd");
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_init(&recvLock, NULL);
+  pthread_cond_init(&recvCond, NULL);
+  pthread_cond_init(&sendCond, NULL);
+  if (pthread_create(&recvThread, NULL, recvThreadEntry, this) != 0) {
+    fprintf(stderr, "Failed to create HostLink receive thread\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Stop the receive thread, and free the receive queue
+void HostLink::stopRecvThread()
+{
+  recvStopping = true;
+  uint64_t one = 1;
+  ssize_t ret = write(recvStop, &one, sizeof(one));
+  (void) ret;
+  pthread_join(recvThread, NULL);
+  close(recvStop);
+  pthread_cond_destroy(&recvCond);
+  pthread_cond_destroy(&sendCond);
+  pthread_mutex_destroy(&recvLock);
+  while (recvQueue) {
+    RecvQueueBlock* next = recvQueue->next;
+    free(recvQueue);
+    recvQueue = next;
+  }
+}
+
+void* HostLink::recvThreadEntry(void* arg)
+{
+  ((HostLink*) arg)->recvThreadLoop();
+  return NULL;
+}
+
+// Body of the receive thread: move incoming bytes from the socket, or
+// messages from the RX ring, to the back of the receive queue,
+// publishing whole messages only
+void HostLink::recvThreadLoop()
+{
+  const uint32_t msgBytes = 1 << TinselLogBytesPerMsg;
+
+  // Block being filled (the consumer can't move past the first block
+  // until the thread has filled it)
+  RecvQueueBlock* block = recvQueue;
+
+  // Bytes written to the block, including any partial message
+  uint32_t written = 0;
+
+  while (! recvStopping) {
+    // Start a new block when the current one is full
+    if (written == RECV_QUEUE_BLOCK_BYTES) {
+      RecvQueueBlock* next = newRecvQueueBlock();
+      __atomic_store_n(&block->next, next, __ATOMIC_RELEASE);
+      block = next;
+      written = 0;
+    }
+    uint32_t space = RECV_QUEUE_BLOCK_BYTES - written;
+
+    if (shm) {
+      // Copy as many whole messages as possible from the RX ring
+      if (! shmWaitRecv(msgBytes)) break;
+      uint32_t n = shmRingAvail(&shm->rx, shmRxTail);
+      if (n > space) n = space;
+      n -= n % msgBytes;
+      shmRingGet(&shm->rx, shmRxTail, &block->data[written], n);
+      shmRxTail += n;
+      shmRingRelease(&shm->rx, shmRxTail);
+      shmDoorbell(&shm->daemonAsleep, pcieLink);
+      // A doorbell for a sender may be waiting unread on the socket
+      shmWakeSender();
+      written += n;
+    }
+    else {
+      // Read as much as is available from the socket
+      int ret = ::recv(pcieLink, &block->data[written], space, MSG_DONTWAIT);
+      if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (! waitLink()) break;
+        continue;
+      }
+      if (ret <= 0) {
+        fprintf(stderr, "Lost connection to PCIeStream daemon\n");
+        exit(EXIT_FAILURE);
+      }
+      written += ret;
+    }
+
+    // Publish whole messages, and wake the consumer if it is asleep
+    // (The full barrier orders the publish before reading the flag,
+    // pairing with the barrier between setting the flag and rechecking
+    // the queue in recvQueueWait(), which holds the lock until it waits)
+    uint32_t whole = written - written % msgBytes;
+    if (whole != block->numBytes) {
+      __atomic_store_n(&block->numBytes, whole, __ATOMIC_RELEASE);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (recvAsleep) {
+        pthread_mutex_lock(&recvLock);
+        pthread_cond_signal(&recvCond);
+        pthread_mutex_unlock(&recvLock);
+      }
+    }
+  }
+}
+
+// Bytes available in the receive queue, moving on to the next block
+// when the current one has been consumed
+uint32_t HostLink::recvQueueAvail()
+{
+  if (recvQueueOffset == RECV_QUEUE_BLOCK_BYTES) {
+    RecvQueueBlock* next = __atomic_load_n(&recvQueue->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) return 0;
+    free(recvQueue);
+    recvQueue = next;
+    recvQueueOffset = 0;
+  }
+  return __atomic_load_n(&recvQueue->numBytes, __ATOMIC_ACQUIRE) -
+           recvQueueOffset;
+}
+
+// Wait for a message in the receive queue
+void HostLink::recvQueueWait()
+{
+  // Spin for a while before sleeping
+  for (int i = 0; i < SHM_RECV_SPIN; i++) {
+    if (recvQueueAvail() > 0) return;
+    sched_yield();
+  }
+  pthread_mutex_lock(&recvLock);
+  recvAsleep = 1;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  while (recvQueueAvail() == 0) pthread_cond_wait(&recvCond, &recvLock);
+  recvAsleep = 0;
+  pthread_mutex_unlock(&recvLock);
+}
+
 // Flush the send buffer
 void HostLink::flush()
 {
   assert(useSendBuffer);
+  if (shm) {
+    shmPublish();
+    return;
+  }
   if (sendBufferLen > 0) {
     socketBlockingPut(pcieLink, sendBuffer, sendBufferLen * 16);
     sendBufferLen = 0;
@@ -354,89 +833,297 @@ bool HostLink::keyTrySend(uint32_t key, uint32_t numFlits, void* msg)
   return sendHelper(useRoutingKey, numFlits, msg, false, key);
 }
 
+// Receive a batch of messages via PCIe (blocking)
+uint32_t HostLink::recvBatch(void** msgs, uint32_t maxMsgs)
+{
+  const uint32_t msgBytes = 1 << TinselLogBytesPerMsg;
+  const uint32_t bufferBytes = msgBytes * RECV_BUFFER_SIZE;
+
+  if (recvQueue) {
+    // Wait for a whole message, and consume messages in place
+    // (The block holding messages returned by the previous call is
+    // freed here, once they have all been consumed)
+    recvQueueWait();
+    uint32_t n = recvQueueAvail() / msgBytes;
+    if (n > maxMsgs) n = maxMsgs;
+    *msgs = &recvQueue->data[recvQueueOffset];
+    recvQueueOffset += n * msgBytes;
+    return n;
+  }
+
+  if (shm) {
+    // Release messages returned by the previous call
+    if (shm->rx.tail != shmRxTail) {
+      shmRingRelease(&shm->rx, shmRxTail);
+      shmDoorbell(&shm->daemonAsleep, pcieLink);
+    }
+    // Wait for a whole message, and consume messages in place
+    // (They never wrap, as the ring size is a multiple of msgBytes)
+    shmWaitRecv(msgBytes);
+    uint32_t n = shmRingAvail(&shm->rx, shmRxTail) / msgBytes;
+    uint32_t offset = shmRxTail % ShmRingBytes;
+    uint32_t contiguous = (ShmRingBytes - offset) / msgBytes;
+    if (n > contiguous) n = contiguous;
+    if (n > maxMsgs) n = maxMsgs;
+    *msgs = &shm->rx.data[offset];
+    shmRxTail += n * msgBytes;
+    return n;
+  }
+
+  // Refill the buffer if it doesn't hold a whole message
+  if (recvBufferTail - recvBufferHead < msgBytes) {
+    // Move any partial message to the start of the buffer
+    uint32_t partial = recvBufferTail - recvBufferHead;
+    memmove(recvBuffer, &recvBuffer[recvBufferHead], partial);
+    recvBufferHead = 0;
+    recvBufferTail = partial;
+    // Read as much as is available
+    while (recvBufferTail < msgBytes)
+      recvBufferTail += socketBlockingGetSome(pcieLink,
+        &recvBuffer[recvBufferTail], bufferBytes - recvBufferTail);
+  }
+
+  // Consume whole messages
+  uint32_t n = (recvBufferTail - recvBufferHead) / msgBytes;
+  if (n > maxMsgs) n = maxMsgs;
+  *msgs = &recvBuffer[recvBufferHead];
+  recvBufferHead += n * msgBytes;
+  return n;
+}
+
 // Receive a message via PCIe (blocking)
 void HostLink::recv(void* msg)
 {
-  int numBytes = 1 << TinselLogBytesPerMsg;
-  socketBlockingGet(pcieLink, (char*) msg, numBytes);
+  recvMsg(msg, 1 << TinselLogBytesPerMsg);
 }
 
 // Receive a message (blocking), given size of message in bytes
 void HostLink::recvMsg(void* msg, uint32_t numBytes)
 {
-  // Number of padding bytes that need to be received but not stored
-  int paddingBytes = (1 << TinselLogBytesPerMsg) - numBytes;
-
-  // Fill message
-  uint8_t* ptr = (uint8_t*) msg;
-  socketBlockingGet(pcieLink, (char*) ptr, numBytes);
-
-  // Discard padding bytes
-  uint8_t padding[1 << TinselLogBytesPerMsg];
-  socketBlockingGet(pcieLink, (char*) padding, paddingBytes);
+  void* buffered;
+  recvBatch(&buffered, 1);
+  memcpy(msg, buffered, numBytes);
 }
 
 // Receive multiple messages (blocking)
 void HostLink::recvBulk(int numMsgs, void* msgs)
 {
-  int numBytes = numMsgs * (1 << TinselLogBytesPerMsg);
-  socketBlockingGet(pcieLink, (char*) msgs, numBytes);
+  recvMsgs(numMsgs, 1 << TinselLogBytesPerMsg, msgs);
 }
 
 // Receive multiple messages (blocking), given size of each message
 void HostLink::recvMsgs(int numMsgs, int msgSize, void* msgs)
 {
-  int numBytes = numMsgs * (1 << TinselLogBytesPerMsg);
-  uint8_t* buffer = new uint8_t [numBytes];
   uint8_t* ptr = (uint8_t*) msgs;
-  socketBlockingGet(pcieLink, (char*) buffer, numBytes);
-  for (int i = 0; i < numMsgs; i++)
-    memcpy(&ptr[i*msgSize], &buffer[i*(1<<TinselLogBytesPerMsg)], msgSize);
-  delete [] buffer;
+  while (numMsgs > 0) {
+    void* buffered;
+    uint32_t n = recvBatch(&buffered, numMsgs);
+    uint8_t* src = (uint8_t*) buffered;
+    for (uint32_t i = 0; i < n; i++) {
+      memcpy(ptr, src, msgSize);
+      ptr += msgSize;
+      src += 1 << TinselLogBytesPerMsg;
+    }
+    numMsgs -= n;
+  }
 }
 
 // Can receive a flit without blocking?
 bool HostLink::canRecv()
 {
-  return socketCanGet(pcieLink);
+  if (recvQueue) {
+    // Check without moving on to the next block, which would free this one
+    RecvQueueBlock* block = recvQueue;
+    uint32_t offset = recvQueueOffset;
+    if (offset == RECV_QUEUE_BLOCK_BYTES) {
+      block = __atomic_load_n(&block->next, __ATOMIC_ACQUIRE);
+      if (block == NULL) return false;
+      offset = 0;
+    }
+    return __atomic_load_n(&block->numBytes, __ATOMIC_ACQUIRE) > offset;
+  }
+  if (shm)
+    return shmRingAvail(&shm->rx, shmRxTail) >= (1 << TinselLogBytesPerMsg);
+  return recvBufferTail > recvBufferHead || socketCanGet(pcieLink);
+}
+
+// Write the routing tables used to multicast boot requests, returning
+// the routing keys for code and data at the mesh origin, and the total
+// number of boot loaders reached by the two keys
+uint32_t HostLink::writeBootRoutes(uint32_t* codeKey, uint32_t* dataKey)
+{
+  // Compute number of cores per DRAM
+  const uint32_t coresPerDRAM = 1 <<
+    (TinselLogCoresPerDCache + TinselLogDCachesPerDRAM);
+
+  // Mailbox-local thread masks: code goes to thread 0 of each core with
+  // its own instruction memory, and data to thread 0 of one core per DRAM
+  uint64_t codeMasks[TinselMailboxesPerBoard];
+  uint64_t dataMasks[TinselMailboxesPerBoard];
+  memset(codeMasks, 0, sizeof(codeMasks));
+  memset(dataMasks, 0, sizeof(dataMasks));
+  uint32_t numDests = 0;
+  for (uint32_t c = 0; c < TinselCoresPerBoard; c++) {
+    uint64_t bit = 1ull <<
+      ((c % TinselCoresPerMailbox) << TinselLogThreadsPerCore);
+    uint32_t mbox = c / TinselCoresPerMailbox;
+    // Cores 2k and 2k+1 share an instruction memory
+    if (! (TinselSharedInstrMem && (c & 1))) {
+      codeMasks[mbox] |= bit;
+      numDests++;
+    }
+    if ((c % coresPerDRAM) == 0) {
+      dataMasks[mbox] |= bit;
+      numDests++;
+    }
+  }
+
+  // Routing keys for each board
+  uint32_t* codeKeys = new uint32_t [meshXLen*meshYLen];
+  uint32_t* dataKeys = new uint32_t [meshXLen*meshYLen];
+
+  // Request to boot loader
+  BootReq req;
+  memset(&req, 0, sizeof(BootReq));
+
+  // Host messages sent with a routing key are looked up by the router
+  // on the board at the mesh origin.  The bridge board forwards them
+  // to that board with the key in place of the thread mask (rule
+  // toLink1 in DE5BridgeTop.bsv), and a board's ProgRouter looks up
+  // every key flit it receives, whatever the board in its address
+  // (rule consumeMessage0 in ProgRouter.bsv); keySend() relies on the
+  // same.  From there, requests travel east along the bottom row and
+  // then north up each column (dimension-ordered, hence deadlock-free).
+  // Tables are built from the far corner back to the origin, so that
+  // the RR records on each board can refer to the keys of its
+  // neighbours.
+  for (int y = meshYLen-1; y >= 0; y--) {
+    for (int x = meshXLen-1; x >= 0; x--) {
+      int n = y*meshXLen + x;
+      BootRoute routes[2];
+      for (int k = 0; k < 2; k++) {
+        uint32_t* keys = k == 0 ? codeKeys : dataKeys;
+        if (y == 0 && x+1 < meshXLen) routes[k].addRR(2, keys[n+1]);
+        if (y+1 < meshYLen) routes[k].addRR(0, keys[n+meshXLen]);
+      }
+      routes[0].addMRMs(codeMasks, MulticastCmd);
+      routes[1].addMRMs(dataMasks, MulticastCmd);
+      uint32_t numBeats = routes[0].numBeats + routes[1].numBeats;
+      if (BOOT_ROUTES_BASE + 32*numBeats > SELF_TEST_ADDR) {
+        fprintf(stderr, "HostLink: multicast boot tables too large\n");
+        exit(EXIT_FAILURE);
+      }
+      codeKeys[n] = BOOT_ROUTES_BASE | routes[0].numBeats;
+      dataKeys[n] = (BOOT_ROUTES_BASE + 32*routes[0].numBeats) |
+                      routes[1].numBeats;
+
+      // Write both tables to the board's first DRAM
+      uint32_t dest = toAddr(x, y, 0, 0);
+      req.cmd = SetAddrCmd;
+      req.numArgs = 1;
+      req.args[0] = BOOT_ROUTES_BASE;
+      send(dest, 1, &req);
+      uint32_t tableWords[8*2*BootRoute::MaxBeats];
+      memcpy(tableWords, routes[0].beats, 32*routes[0].numBeats);
+      memcpy(&tableWords[8*routes[0].numBeats], routes[1].beats,
+               32*routes[1].numBeats);
+      for (uint32_t i = 0; i < 8*numBeats; i += BootReqMaxArgs) {
+        uint32_t numWords = 8*numBeats - i;
+        if (numWords > BootReqMaxArgs) numWords = BootReqMaxArgs;
+        req.cmd = StoreCmd;
+        req.numArgs = numWords;
+        memcpy(req.args, &tableWords[i], numWords * sizeof(uint32_t));
+        send(dest, BootReqFlits(numWords), &req);
+      }
+
+      // Make sure the tables have reached DRAM
+      req.cmd = FlushCmd;
+      req.numArgs = 0;
+      send(dest, 1, &req);
+    }
+  }
+  flush();
+
+  // Wait for flush responses
+  uint32_t msg[1 << TinselLogWordsPerMsg];
+  for (int i = 0; i < meshXLen*meshYLen; i++) recv(msg);
+
+  *codeKey = codeKeys[0];
+  *dataKey = dataKeys[0];
+  delete [] codeKeys;
+  delete [] dataKeys;
+  return numDests * meshXLen * meshYLen;
 }
 
 // Load application code and data onto the mesh
 void HostLink::loadAll(const char* codeFilename, const char* dataFilename)
 {
-  MemFileReader code(codeFilename);
-  MemFileReader data(dataFilename);
+  MemFileReader code(codeFilename, MemFileCode);
+  MemFileReader data(dataFilename, MemFileData);
 
   // Request to boot loader
   BootReq req;
   memset(&req, 0, sizeof(BootReq)); // Keep valgrind happy about un-init bytes.
 
+  // Pack requests into the send buffer
+  bool useSendBufferOld = useSendBuffer;
+  useSendBuffer = true;
+
+  // When multicasting, each request is sent once, via a routing key
+  uint32_t codeKey, dataKey, numMulticastDests = 0;
+  if (useMulticastBoot)
+    numMulticastDests = writeBootRoutes(&codeKey, &dataKey);
 
   // Step 1: load code into instruction memory
   // -----------------------------------------
 
+  // Each request carries a contiguous run of up to BootReqMaxArgs words
   uint32_t addrReg = 0xffffffff;
-  uint32_t addr, word;
-  while (code.getWord(&addr, &word)) {
-    // Send instruction to each core
-    for (int x = 0; x < meshXLen; x++) {
-      for (int y = 0; y < meshYLen; y++) {
-        for (int i = 0; i < (1 << TinselLogCoresPerBoard); i++) {
-          uint32_t dest = toAddr(x, y, i, 0);
-          if (addr != addrReg) {
-            req.cmd = SetAddrCmd;
-            req.numArgs = 1;
-            req.args[0] = addr;
-            send(dest, 1, &req);
+  uint32_t words[BootReqMaxArgs];
+  for (uint32_t r = 0; r < code.numRanges(); r++) {
+    const MemRange* range = &code.ranges()[r];
+    for (uint32_t offset = 0; offset < range->numBytes;
+           offset += 4*BootReqMaxArgs) {
+      uint32_t addr = range->addr + offset;
+      uint32_t numWords =
+        range->getWords(offset, words, BootReqMaxArgs);
+      if (useMulticastBoot) {
+        req.cmd = MulticastCmd;
+        if (addr != addrReg) {
+          req.mcastCmd = SetAddrCmd;
+          req.mcastNumArgs = 1;
+          req.args[0] = addr;
+          keySend(codeKey, 1, &req);
+        }
+        req.mcastCmd = WriteInstrCmd;
+        req.mcastNumArgs = numWords;
+        memcpy(req.args, words, numWords * sizeof(uint32_t));
+        keySend(codeKey, BootReqFlits(numWords), &req);
+        addrReg = addr + 4*numWords;
+        continue;
+      }
+      // Send instructions to each core
+      for (int x = 0; x < meshXLen; x++) {
+        for (int y = 0; y < meshYLen; y++) {
+          for (int i = 0; i < (1 << TinselLogCoresPerBoard); i++) {
+            // Cores 2k and 2k+1 share an instruction memory
+            if (TinselSharedInstrMem && (i & 1)) continue;
+            uint32_t dest = toAddr(x, y, i, 0);
+            if (addr != addrReg) {
+              req.cmd = SetAddrCmd;
+              req.numArgs = 1;
+              req.args[0] = addr;
+              send(dest, 1, &req);
+            }
+            req.cmd = WriteInstrCmd;
+            req.numArgs = numWords;
+            memcpy(req.args, words, numWords * sizeof(uint32_t));
+            send(dest, BootReqFlits(numWords), &req);
           }
-          req.cmd = WriteInstrCmd;
-          req.numArgs = 1;
-          req.args[0] = word;
-          send(dest, 1, &req);
         }
       }
+      addrReg = addr + 4*numWords;
     }
-    addrReg = addr + 4;
   }
 
   // Step 2: initialise data memory
@@ -448,27 +1135,70 @@ void HostLink::loadAll(const char* codeFilename, const char* dataFilename)
 
   // Write data to DRAMs
   addrReg = 0xffffffff;
-  while (data.getWord(&addr, &word)) {
-    for (int x = 0; x < meshXLen; x++) {
-      for (int y = 0; y < meshYLen; y++) {
-        for (int i = 0; i < TinselDRAMsPerBoard; i++) {
-          // Use one core to initialise each DRAM
-          uint32_t dest = toAddr(x, y, coresPerDRAM * i, 0);
-          if (addr != addrReg) {
-            req.cmd = SetAddrCmd;
-            req.numArgs = 1;
-            req.args[0] = addr;
-            send(dest, 1, &req);
+  for (uint32_t r = 0; r < data.numRanges(); r++) {
+    const MemRange* range = &data.ranges()[r];
+    for (uint32_t offset = 0; offset < range->numBytes;
+           offset += 4*BootReqMaxArgs) {
+      uint32_t addr = range->addr + offset;
+      uint32_t numWords =
+        range->getWords(offset, words, BootReqMaxArgs);
+      if (useMulticastBoot) {
+        if (addr < BOOT_ROUTES_BASE + BOOT_ROUTES_BYTES &&
+              addr + 4*numWords > BOOT_ROUTES_BASE) {
+          fprintf(stderr, "HostLink: data overlaps multicast boot tables\n");
+          exit(EXIT_FAILURE);
+        }
+        req.cmd = MulticastCmd;
+        if (addr != addrReg) {
+          req.mcastCmd = SetAddrCmd;
+          req.mcastNumArgs = 1;
+          req.args[0] = addr;
+          keySend(dataKey, 1, &req);
+        }
+        req.mcastCmd = StoreCmd;
+        req.mcastNumArgs = numWords;
+        memcpy(req.args, words, numWords * sizeof(uint32_t));
+        keySend(dataKey, BootReqFlits(numWords), &req);
+        addrReg = addr + 4*numWords;
+        continue;
+      }
+      for (int x = 0; x < meshXLen; x++) {
+        for (int y = 0; y < meshYLen; y++) {
+          for (int i = 0; i < TinselDRAMsPerBoard; i++) {
+            // Use one core to initialise each DRAM
+            uint32_t dest = toAddr(x, y, coresPerDRAM * i, 0);
+            if (addr != addrReg) {
+              req.cmd = SetAddrCmd;
+              req.numArgs = 1;
+              req.args[0] = addr;
+              send(dest, 1, &req);
+            }
+            req.cmd = StoreCmd;
+            req.numArgs = numWords;
+            memcpy(req.args, words, numWords * sizeof(uint32_t));
+            send(dest, BootReqFlits(numWords), &req);
           }
-          req.cmd = StoreCmd;
-          req.numArgs = 1;
-          req.args[0] = word;
-          send(dest, 1, &req);
         }
       }
+      addrReg = addr + 4*numWords;
     }
-    addrReg = addr + 4;
   }
+
+  // Multicast requests may take different paths to unicast ones, so
+  // wait until every boot loader has processed them
+  if (useMulticastBoot) {
+    req.cmd = MulticastCmd;
+    req.mcastCmd = FlushCmd;
+    req.mcastNumArgs = 0;
+    keySend(codeKey, 1, &req);
+    keySend(dataKey, 1, &req);
+    flush();
+    uint32_t msg[1 << TinselLogWordsPerMsg];
+    for (uint32_t i = 0; i < numMulticastDests; i++) recv(msg);
+  }
+
+  flush();
+  useSendBuffer = useSendBufferOld;
 }
 
 // Load application code and data onto the mesh, and start the cores
@@ -494,26 +1224,34 @@ void HostLink::loadInstrsOntoCore(const char* codeFilename,
        uint32_t meshX, uint32_t meshY, uint32_t coreId)
 {
   // Code file
-  MemFileReader code(codeFilename);
+  MemFileReader code(codeFilename, MemFileCode);
 
   // Load loop
   BootReq req;
+  memset(&req, 0, sizeof(BootReq)); // Keep valgrind happy about un-init bytes.
   uint32_t addrReg = 0xffffffff;
-  uint32_t addr, word;
+  uint32_t words[BootReqMaxArgs];
   uint32_t dest = toAddr(meshX, meshY, coreId, 0);
-  while (code.getWord(&addr, &word)) {
-    // Write instruction
-    if (addr != addrReg) {
-      req.cmd = SetAddrCmd;
-      req.numArgs = 1;
-      req.args[0] = addr;
-      send(dest, 1, &req);
+  for (uint32_t r = 0; r < code.numRanges(); r++) {
+    const MemRange* range = &code.ranges()[r];
+    for (uint32_t offset = 0; offset < range->numBytes;
+           offset += 4*BootReqMaxArgs) {
+      uint32_t addr = range->addr + offset;
+      uint32_t numWords =
+        range->getWords(offset, words, BootReqMaxArgs);
+      // Write instructions
+      if (addr != addrReg) {
+        req.cmd = SetAddrCmd;
+        req.numArgs = 1;
+        req.args[0] = addr;
+        send(dest, 1, &req);
+      }
+      req.cmd = WriteInstrCmd;
+      req.numArgs = numWords;
+      memcpy(req.args, words, numWords * sizeof(uint32_t));
+      send(dest, BootReqFlits(numWords), &req);
+      addrReg = addr + 4*numWords;
     }
-    req.cmd = WriteInstrCmd;
-    req.numArgs = 1;
-    req.args[0] = word;
-    send(dest, 1, &req);
-    addrReg = addr + 4;
   }
 }
 
@@ -521,26 +1259,34 @@ void HostLink::loadInstrsOntoCore(const char* codeFilename,
 void HostLink::loadDataViaCore(const char* dataFilename,
         uint32_t meshX, uint32_t meshY, uint32_t coreId)
 {
-  MemFileReader data(dataFilename);
+  MemFileReader data(dataFilename, MemFileData);
 
   // Write data to DRAM
   BootReq req;
+  memset(&req, 0, sizeof(BootReq)); // Keep valgrind happy about un-init bytes.
   uint32_t addrReg = 0xffffffff;
-  uint32_t addr, word;
+  uint32_t words[BootReqMaxArgs];
   uint32_t dest = toAddr(meshX, meshY, coreId, 0);
-  while (data.getWord(&addr, &word)) {
-    // Write data
-    if (addr != addrReg) {
-      req.cmd = SetAddrCmd;
-      req.numArgs = 1;
-      req.args[0] = addr;
-      send(dest, 1, &req);
+  for (uint32_t r = 0; r < data.numRanges(); r++) {
+    const MemRange* range = &data.ranges()[r];
+    for (uint32_t offset = 0; offset < range->numBytes;
+           offset += 4*BootReqMaxArgs) {
+      uint32_t addr = range->addr + offset;
+      uint32_t numWords =
+        range->getWords(offset, words, BootReqMaxArgs);
+      // Write data
+      if (addr != addrReg) {
+        req.cmd = SetAddrCmd;
+        req.numArgs = 1;
+        req.args[0] = addr;
+        send(dest, 1, &req);
+      }
+      req.cmd = StoreCmd;
+      req.numArgs = numWords;
+      memcpy(req.args, words, numWords * sizeof(uint32_t));
+      send(dest, BootReqFlits(numWords), &req);
+      addrReg = addr + 4*numWords;
     }
-    req.cmd = StoreCmd;
-    req.numArgs = 1;
-    req.args[0] = word;
-    send(dest, 1, &req);
-    addrReg = addr + 4;
   }
 }
 
@@ -564,42 +1310,56 @@ void HostLink::startOne(uint32_t meshX, uint32_t meshY,
 }
 
 // Start all threads on all cores
+// (Requests are spread across boards, and acknowledgements consumed as
+// they arrive, under a single deadline)
 void HostLink::startAll()
 {
   // Request to boot loader
   BootReq req;
   memset(&req, 0, sizeof(BootReq)); // Keep valgrind happy about un-init bytes.
+  req.cmd = StartCmd;
+  req.args[0] = (1<<TinselLogThreadsPerCore)-1;
 
-  // Total number of cores
-  const uint32_t numCores =
-    (meshXLen*meshYLen) << TinselLogCoresPerBoard;
+  // Total number of boards and cores
+  const uint32_t numBoards = meshXLen*meshYLen;
+  const uint32_t numCores = numBoards << TinselLogCoresPerBoard;
 
-  // Send start command
-  uint32_t started = 0;
+  // Number of acknowledgements from each board
+  uint32_t* acks = new uint32_t [numBoards];
+  memset(acks, 0, numBoards * sizeof(uint32_t));
+
+  // Send start commands, visiting every board before moving on to the
+  // next core, and consume acknowledgements
+  double deadline = currentTime() + START_TIMEOUT;
+  uint32_t sent = 0, started = 0;
   uint32_t msg[1 << TinselLogWordsPerMsg];
-  for (int x = 0; x < meshXLen; x++) {
-    for (int y = 0; y < meshYLen; y++) {
-      for (int i = 0; i < (1 << TinselLogCoresPerBoard); i++) {
-        uint32_t dest = toAddr(x, y, i, 0);
-        req.cmd = StartCmd;
-        req.args[0] = (1<<TinselLogThreadsPerCore)-1;
-        while (1) {
-          bool ok = trySend(dest, 1, &req);
-          if (canRecv()) {
-            recv(msg);
-            started++;
-          }
-          if (ok) break;
-        }
+  while (started < numCores) {
+    if (sent < numCores) {
+      uint32_t b = sent % numBoards;
+      uint32_t core = sent / numBoards;
+      if (trySend(toAddr(b % meshXLen, b / meshXLen, core, 0), 1, &req))
+        sent++;
+    }
+    if (canRecv()) {
+      recv(msg);
+      uint32_t x, y, core, thread;
+      fromAddr(msg[0], &x, &y, &core, &thread);
+      if (x < (uint32_t) meshXLen && y < (uint32_t) meshYLen)
+        acks[y*meshXLen + x]++;
+      started++;
+    }
+    else if (currentTime() > deadline) {
+      for (uint32_t b = 0; b < numBoards; b++) {
+        if (acks[b] < TinselCoresPerBoard)
+          fprintf(stderr, "Board (%u, %u): %u of %u cores failed to start\n",
+            b % meshXLen, b / meshXLen,
+            TinselCoresPerBoard - acks[b], TinselCoresPerBoard);
       }
+      exit(EXIT_FAILURE);
     }
   }
 
-  // Wait for all start responses
-  while (started < numCores) {
-    recv(msg);
-    started++;
-  }
+  delete [] acks;
 }
 
 // Trigger application execution on all started threads on given core
@@ -632,82 +1392,152 @@ void HostLink::store(uint32_t meshX, uint32_t meshY,
 
   req.cmd = StoreCmd;
   while (numWords > 0) {
-    uint32_t sendWords = numWords > 15 ? 15 : numWords;
+    uint32_t sendWords = numWords > BootReqMaxArgs ?
+                           BootReqMaxArgs : numWords;
     numWords = numWords - sendWords;
     req.numArgs = sendWords;
     for (uint32_t i = 0; i < sendWords; i++) req.args[i] = data[i];
-    uint32_t numFlits = 1 + (sendWords >> 2);
-    send(toAddr(meshX, meshY, coreId, 0), numFlits, &req);
+    data += sendWords;
+    send(toAddr(meshX, meshY, coreId, 0), BootReqFlits(sendWords), &req);
+  }
+}
+
+// Fill in the requests for one probe of the power-on self test:
+// load a word from each SRAM, then store the tag and load it back
+static void selfTestRequests(BootReq* reqs, uint32_t tag)
+{
+  const uint32_t addrs[3] = {
+    1 << TinselLogBytesPerSRAM, 2 << TinselLogBytesPerSRAM, SELF_TEST_ADDR
+  };
+  for (int i = 0; i < 3; i++) {
+    reqs->cmd = SetAddrCmd;
+    reqs->numArgs = 1;
+    reqs->args[0] = addrs[i];
+    reqs++;
+    if (i == 2) {
+      reqs->cmd = StoreCmd;
+      reqs->numArgs = 1;
+      reqs->args[0] = tag;
+      reqs++;
+      reqs->cmd = SetAddrCmd;
+      reqs->numArgs = 1;
+      reqs->args[0] = addrs[i];
+      reqs++;
+    }
+    reqs->cmd = LoadCmd;
+    reqs->numArgs = 1;
+    reqs->args[0] = 1;
+    reqs++;
   }
 }
 
 // Power-on self test
+// (Each board is probed via one core in each half, which reads from
+// that half's SRAMs and then loads back a tag it has stored.  The boot
+// loader handles requests in order, and a core's replies arrive in
+// order, so the tag shows that the SRAM loads completed and identifies
+// the probe.  Other replies are discarded.  All probes are sent at
+// once, responses are collected under a single deadline, and only the
+// boards that fail to respond are probed again.)
 bool HostLink::powerOnSelfTest()
 {
-  const double timeout = 3.0;
-
-  // Need to check that we get a response within a given time
-  struct timeval start, finish, diff;
-
-  // Boot request to load data from memory
-  // (The test involves reading from QDRII+ SRAMs on each board)
-  BootReq req;
-  memset(&req, 0, sizeof(BootReq)); // Keep valgrind happy about un-init bytes.
-
-  req.cmd = LoadCmd;
-  req.numArgs = 1;
-  req.args[0] = 1;
-
-  // Flit buffer to store responses
+  // Requests per probe (see selfTestRequests)
+  const uint32_t reqsPerProbe = 8;
+
+  // One probe per half of each board
+  const uint32_t numBoards = meshXLen*meshYLen;
+  const uint32_t numProbes = 2*numBoards;
+  assert(numProbes <= 4096);
+
+  // Requests for each probe, probes in the current attempt, and
+  // whether each probe's tag is still awaited
+  BootReq* reqs = new BootReq [numProbes*reqsPerProbe];
+  memset(reqs, 0, numProbes*reqsPerProbe*sizeof(BootReq));
+  uint32_t* probes = new uint32_t [numProbes];
+  bool* awaiting = new bool [numProbes];
+  // Attempt on which each board passed
+  uint32_t* passedAttempt = new uint32_t [numBoards];
+
+  for (int y = 0; y < meshYLen; y++)
+    for (int x = 0; x < meshXLen; x++)
+      selfTestLatency[y][x] = -1.0;
+
+  uint32_t numFailed = numBoards;
   uint32_t msg[1 << TinselLogWordsPerMsg];
+  for (uint32_t attempt = 0;
+         attempt < SELF_TEST_ATTEMPTS && numFailed > 0; attempt++) {
+    if (attempt > 0)
+      fprintf(stderr, "Power-on self test: retrying %u board(s)\n",
+        numFailed);
+
+    // Probe both halves of each board that has not yet passed
+    uint32_t numActive = 0;
+    for (uint32_t p = 0; p < numProbes; p++) {
+      uint32_t b = p/2;
+      awaiting[p] = selfTestLatency[b / meshXLen][b % meshXLen] < 0;
+      if (awaiting[p]) {
+        probes[numActive++] = p;
+        selfTestRequests(&reqs[p*reqsPerProbe], SELF_TEST_TAG(attempt, p));
+      }
+    }
 
-  // Count number of responses received
-  int count = 0;
-
-  // Send request and consume responses
-  for (int slice = 0; slice < 2; slice++) {
-    int core = slice << (TinselLogCoresPerBoard-1);
-    for (int ram = 1; ram <= 2; ram++) {
-      for (int y = 0; y < meshYLen; y++) {
-        for (int x = 0; x < meshXLen; x++) {
-          // Request a word from SRAM
-          uint32_t addr = ram << TinselLogBytesPerSRAM;
-          setAddr(x, y, core, addr);
-          gettimeofday(&start, NULL);
-          while (1) {
-            bool ok = trySend(toAddr(x, y, core, 0), 1, &req);
-            if (canRecv()) {
-              recv(msg);
-              count++;
-            }
-            if (ok) break;
-            gettimeofday(&finish, NULL);
-            timersub(&finish, &start, &diff);
-            double duration = (double) diff.tv_sec +
-                              (double) diff.tv_usec / 1000000.0;
-            if (duration > timeout) return false;
+    // Send the requests, issuing each step of every probe before the
+    // next step of any (spreading requests across boards), and consume
+    // responses
+    double start = currentTime();
+    double deadline = start + SELF_TEST_TIMEOUT;
+    uint32_t numReqs = numActive*reqsPerProbe;
+    uint32_t sent = 0, outstanding = numActive;
+    while (outstanding > 0) {
+      if (sent < numReqs) {
+        uint32_t p = probes[sent % numActive];
+        uint32_t step = sent / numActive;
+        uint32_t b = p/2;
+        uint32_t core = (p%2) << (TinselLogCoresPerBoard-1);
+        if (trySend(toAddr(b % meshXLen, b / meshXLen, core, 0), 1,
+                    &reqs[p*reqsPerProbe + step]))
+          sent++;
+      }
+      if (canRecv()) {
+        recv(msg);
+        uint32_t p = msg[0] - SELF_TEST_TAG(attempt, 0);
+        if (p < numProbes && awaiting[p]) {
+          awaiting[p] = false;
+          outstanding--;
+          if (! awaiting[p^1]) {
+            uint32_t b = p/2;
+            selfTestLatency[b / meshXLen][b % meshXLen] =
+              currentTime() - start;
+            passedAttempt[b] = attempt;
+            numFailed--;
           }
         }
       }
+      else if (currentTime() > deadline) break;
     }
   }
 
-  // Consume remaining responses
-  gettimeofday(&start, NULL);
-  while (count < (4*meshXLen*meshYLen)) {
-    if (canRecv()) {
-      recv(msg);
-      count++;
-      gettimeofday(&start, NULL);
+  // Report boards that failed, and the response times of the others
+  for (int y = 0; y < meshYLen; y++)
+    for (int x = 0; x < meshXLen; x++) {
+      uint32_t attempt = passedAttempt[y*meshXLen + x];
+      if (selfTestLatency[y][x] < 0)
+        fprintf(stderr, "Power-on self test: no response from board "
+                        "(%d, %d)\n", x, y);
+      else if (verbose && attempt > 0)
+        fprintf(stderr, "Power-on self test: board (%d, %d) responded "
+                        "in %.3lfms (retried %u time(s))\n", x, y,
+                        1000*selfTestLatency[y][x], attempt);
+      else if (verbose)
+        fprintf(stderr, "Power-on self test: board (%d, %d) responded "
+                        "in %.3lfms\n", x, y, 1000*selfTestLatency[y][x]);
     }
-    gettimeofday(&finish, NULL);
-    timersub(&finish, &start, &diff);
-    double duration = (double) diff.tv_sec +
-                      (double) diff.tv_usec / 1000000.0;
-    if (duration > timeout) return false;
-  }
 
-  return true;
+  delete [] reqs;
+  delete [] probes;
+  delete [] awaiting;
+  delete [] passedAttempt;
+  return numFailed == 0;
 }
 
 // Redirect UART StdOut to given file
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include <config.h>
 #include <DebugLink.h>
 
@@ -25,9 +26,26 @@ struct HostLinkParams {
   // Used to allow retries when connecting to the socket. When performing rapid sweeps,
   // it is quite common for the first attempt in the next process to fail.
   int max_connection_attempts;
-  HostLinkParams(): max_connection_attempts(5){}
+
+  // When enabled, a background thread continuously drains incoming
+  // messages into an in-memory queue, which the receive functions then
+  // read from.  The application can then stream sends at full rate
+  // without interleaving receives by hand: a blocking send can no longer
+  // stall because the FPGAs are themselves blocked sending to the host.
+  // The queue is unbounded, so received messages should be consumed
+  // eventually.  (HostLink must still be called from one thread only.)
+  // Also enabled by setting the HOSTLINK_RECV_THREAD environment variable.
+  bool useRecvThread;
+
+  HostLinkParams(): max_connection_attempts(5), useRecvThread(false){}
 };
 
+// Shared-memory rings to PCIeStream (see ShmRing.h)
+struct ShmRegion;
+
+// Block of the receive queue filled by the receive thread
+struct RecvQueueBlock;
+
 class HostLink {
   // Lock file for acquring exclusive access to PCIeStream
   int lockFile;
@@ -45,6 +63,87 @@ class HostLink {
   char* sendBuffer;
   int sendBufferLen;
 
+  // Receive buffer, for bulk receiving over PCIe
+  // (Bytes from recvBufferHead up to recvBufferTail are yet to be consumed)
+  char* recvBuffer;
+  uint32_t recvBufferHead;
+  uint32_t recvBufferTail;
+
+  // Shared-memory rings to PCIeStream, used instead of the socket and
+  // the send and receive buffers when negotiated (see ShmRing.h)
+  ShmRegion* shm;
+
+  // Position at which the next message will be written to the TX ring
+  // (Messages before it are made visible to PCIeStream on each send, or
+  // on flush when the send buffer is enabled)
+  uint64_t shmTxHead;
+
+  // Position of the next message to be read from the RX ring
+  // (Messages before it are released on the next receive call)
+  uint64_t shmRxTail;
+
+  // Make messages written to the TX ring visible to PCIeStream
+  void shmPublish();
+
+  // Wait until the RX ring holds at least numBytes unread bytes
+  // (Returns false if the receive thread is asked to stop)
+  bool shmWaitRecv(uint32_t numBytes);
+
+  // Wait until the TX ring has space for numBytes
+  void shmWaitSend(uint32_t numBytes);
+
+  // Wake a sender waiting for space in the TX ring, if the receive
+  // thread is running (as the sender then can't read doorbells itself)
+  void shmWakeSender();
+
+  // Receive queue, filled by the receive thread and used instead of the
+  // socket, the receive buffer, and the RX ring when the thread is
+  // running.  This is a lock-free single-producer single-consumer list
+  // of blocks, which grows as needed so that the thread never stops
+  // draining the link.  It points to the block being consumed.
+  RecvQueueBlock* recvQueue;
+
+  // Bytes of the current block consumed so far
+  // (Messages returned by a receive call remain valid until the next one)
+  uint32_t recvQueueOffset;
+
+  // Receive thread
+  pthread_t recvThread;
+
+  // For sleeping when the receive queue is empty, and being woken by
+  // the receive thread
+  pthread_mutex_t recvLock;
+  pthread_cond_t recvCond;
+  volatile uint32_t recvAsleep;
+
+  // For sleeping when the TX ring is full, and being woken by the
+  // receive thread when it sees a doorbell (uses recvLock)
+  pthread_cond_t sendCond;
+  volatile uint32_t sendAsleep;
+
+  // Set, and signalled via the recvStop eventfd, to stop the thread
+  volatile bool recvStopping;
+  int recvStop;
+
+  // Start and stop the receive thread
+  void startRecvThread();
+  void stopRecvThread();
+
+  // Body of the receive thread
+  static void* recvThreadEntry(void* arg);
+  void recvThreadLoop();
+
+  // Block until the link to PCIeStream is readable
+  // (Returns false if the receive thread is asked to stop)
+  bool waitLink();
+
+  // Bytes available in the receive queue, moving on to the next block
+  // when the current one has been consumed
+  uint32_t recvQueueAvail();
+
+  // Wait for a message in the receive queue
+  void recvQueueWait();
+
   // Request an extra send slot when bringing up Tinsel FPGAs
   bool useExtraSendSlot;
 
@@ -54,6 +153,11 @@ class HostLink {
   // Internal helper for sending messages
   bool sendHelper(uint32_t dest, uint32_t numFlits, void* payload,
          bool block, uint32_t key);
+
+  // Write the routing tables used to multicast boot requests, returning
+  // the routing keys for code and data at the mesh origin, and the total
+  // number of boot loaders reached by the two keys
+  uint32_t writeBootRoutes(uint32_t* codeKey, uint32_t* dataKey);
  public:
   // Dimensions of board mesh
   int meshXLen;
@@ -68,8 +172,15 @@ class HostLink {
   ~HostLink();
  
   // Power-on self test
+  // (Probes all boards at once, retrying boards that fail to respond;
+  // returns false if any board still fails)
   bool powerOnSelfTest();
 
+  // Time taken by each board to respond to the last power-on self test,
+  // in seconds, or negative if it failed (indexed by board Y then X)
+  double selfTestLatency[TinselMeshYLenWithinBox * TinselBoxMeshYLen]
+                        [TinselMeshXLenWithinBox * TinselBoxMeshXLen];
+
   // Debug links
   // -----------
 
@@ -109,6 +220,34 @@ class HostLink {
   // Receive multiple messages (blocking), given size of each message
   void recvMsgs(int numMsgs, int msgSize, void* msgs);
 
+  // Streaming receive
+  // -----------------
+
+  // Receive a batch of max-sized messages (blocking until at least one
+  // is available), using a single read for as many messages as are
+  // waiting.  On return, msgs points to the batch, which lives in the
+  // receive buffer and remains valid until the next receive call.
+  // Returns the number of messages in the batch (at most maxMsgs).
+  uint32_t recvBatch(void** msgs, uint32_t maxMsgs);
+
+  // Receive numMsgs messages, passing a pointer to each one in turn to
+  // the given handler (callable as handler(T*)) without copying it
+  template <typename T, typename F> void recvEach(uint32_t numMsgs,
+                                                   F handler) {
+    static_assert(sizeof(T) <= (1 << TinselLogBytesPerMsg),
+      "recvEach: message type exceeds max message size");
+    while (numMsgs > 0) {
+      void* msgs;
+      uint32_t n = recvBatch(&msgs, numMsgs);
+      char* ptr = (char*) msgs;
+      for (uint32_t i = 0; i < n; i++) {
+        handler((T*) ptr);
+        ptr += 1 << TinselLogBytesPerMsg;
+      }
+      numMsgs -= n;
+    }
+  }
+
   // When enabled, use buffer for sending messages, permitting bulk writes
   // The buffer must be flushed to ensure data is sent
   // Currently, only blocking sends are supported in this mode
@@ -133,6 +272,16 @@ class HostLink {
   //
   // (Only thread 0 on each core is active when the boot loader is running)
 
+  // When enabled, loadAll() sends each code and data request once,
+  // using programmable-router keys to multicast it to the cores
+  // (requires a boot loader supporting the multicast boot commands;
+  // enabled by setting the HOSTLINK_MULTICAST_BOOT environment variable)
+  bool useMulticastBoot;
+
+  // Report the response time of each board to the power-on self test
+  // (enabled by setting the HOSTLINK_VERBOSE environment variable)
+  bool verbose;
+
   // Load application code and data onto the mesh
   void loadAll(const char* codeFilename, const char* dataFilename);
 
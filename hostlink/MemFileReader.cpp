@@ -6,69 +6,351 @@
 //   6F 00 40 00 13 01
 //
 //   @00100000
-//   48 65 6C 6C 6F 20 66 72 6F 6D 20 74 68 72 65 61 
-//   64 20 30 78 25 78 0A 00 
+//   48 65 6C 6C 6F 20 66 72 6F 6D 20 74 68 72 65 61
+//   64 20 30 78 25 78 0A 00
 //
 // The @ sign denotes a start address.  The hex bytes that follow it,
 // up to the next @ sign, are a contiguous stream of bytes starting
 // at that address.
+//
+// Alternatively, the file may be the ELF executable itself, in which
+// case the allocated sections are read directly, avoiding the need for
+// objcopy and the cost of parsing hex.
 
 #include "MemFileReader.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-// Constructor
-MemFileReader::MemFileReader(const char* filename)
+// Parsed memory image
+struct MemImage {
+  // Identity of the file it was parsed from, and the part requested
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  MemFilePart part;
+  // Number of readers using the image
+  uint32_t users;
+  // Contents of all ranges, back to back
+  uint8_t* bytes;
+  uint32_t numBytes;
+  uint32_t maxBytes;
+  // Ranges, pointing into bytes
+  MemRange* ranges;
+  uint32_t numRanges;
+  uint32_t maxRanges;
+  // Next image in cache
+  MemImage* next;
+};
+
+// Parsed images, most recently used first, keyed by file identity and
+// part.  Images not in use are freed once there are more than
+// MaxCachedImages in the cache.
+#define MaxCachedImages 8
+static MemImage* imageCache = NULL;
+
+// Free a parsed image
+static void freeImage(MemImage* image)
 {
-  address = 0;
-  fp = fopen(filename, "rt");
-  if (fp == NULL) {
-    fprintf(stderr, "Failed to open file '%s'\n", filename);
-    exit(EXIT_FAILURE);
+  free(image->bytes);
+  free(image->ranges);
+  free(image);
+}
+
+// Free unused images beyond the cache limit
+static void trimCache()
+{
+  uint32_t n = 0;
+  MemImage** prev = &imageCache;
+  while (*prev != NULL) {
+    MemImage* image = *prev;
+    n++;
+    if (n > MaxCachedImages && image->users == 0) {
+      *prev = image->next;
+      freeImage(image);
+    }
+    else
+      prev = &image->next;
   }
 }
 
-// Read a byte
-bool MemFileReader::getByte(uint32_t* addr, uint8_t* byte)
+// Append uninitialised bytes to an image, returning a pointer to them
+static uint8_t* extendBytes(MemImage* image, uint32_t n)
 {
-  assert(fp != NULL);
-  uint32_t data;
-  *addr = address;
-  while (fscanf(fp, " @%x", &address) > 0) *addr = address;
-  if (fscanf(fp, " %x", &data) > 0) {
-    *byte = (uint8_t) data;
-    address++;
-    return true;
+  if (image->numBytes + n > image->maxBytes) {
+    while (image->numBytes + n > image->maxBytes)
+      image->maxBytes = image->maxBytes ? 2*image->maxBytes : 4096;
+    image->bytes = (uint8_t*) realloc(image->bytes, image->maxBytes);
+    assert(image->bytes != NULL);
   }
-  return false;
+  uint8_t* ptr = &image->bytes[image->numBytes];
+  image->numBytes += n;
+  return ptr;
 }
 
-// Read a 32-bit word
-bool MemFileReader::getWord(uint32_t* addr, uint32_t* word)
+// Start a new range at the end of an image
+// (The bytes pointer holds an offset until the image is complete)
+static void newRange(MemImage* image, uint32_t addr)
 {
-  assert(fp != NULL);
-  *word = 0;
-  uint8_t* bytePtr = (uint8_t*) word;
-  uint32_t data;
-  *addr = address;
-  int count = 0;
-  while (fscanf(fp, " @%x", &address) > 0) *addr = address;
-  while (fscanf(fp, " %x", &data) > 0) {
-    bytePtr[count] = (uint8_t) data;
-    count++;
-    if (count == 4) break;
+  if (image->numRanges == image->maxRanges) {
+    image->maxRanges = image->maxRanges ? 2*image->maxRanges : 16;
+    image->ranges = (MemRange*)
+      realloc(image->ranges, image->maxRanges * sizeof(MemRange));
+    assert(image->ranges != NULL);
   }
-  if (count != 0) {
-    address += 4;
-    return true;
+  MemRange* r = &image->ranges[image->numRanges++];
+  r->addr = addr;
+  r->numBytes = 0;
+  r->bytes = (const uint8_t*) (uintptr_t) image->numBytes;
+}
+
+// Order ranges by address
+static int compareRanges(const void* a, const void* b)
+{
+  uint32_t x = ((const MemRange*) a)->addr;
+  uint32_t y = ((const MemRange*) b)->addr;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Copy up to maxWords 32-bit words starting at the given byte offset
+uint32_t MemRange::getWords(uint32_t offset, uint32_t* words,
+                            uint32_t maxWords) const
+{
+  uint32_t avail = numBytes > offset ? numBytes - offset : 0;
+  uint32_t n = (avail + 3) / 4;
+  if (n > maxWords) n = maxWords;
+  uint32_t len = 4*n < avail ? 4*n : avail;
+  if (n > 0) words[n-1] = 0;
+  memcpy(words, &bytes[offset], len);
+  return n;
+}
+
+// Value of a hex digit, or -1
+static inline int hexDigit(uint8_t c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Parse verilog hex format
+static void parseHex(const char* filename, const uint8_t* buf, size_t len,
+                     MemImage* image)
+{
+  uint32_t address = 0;
+  bool startRange = true;
+  size_t i = 0;
+  while (i < len) {
+    uint8_t c = buf[i];
+    if (c == ' ' || c == '\n' || c == '\r' || c == '\t') { i++; continue; }
+    bool isAddr = c == '@';
+    if (isAddr) i++;
+    uint32_t value = 0;
+    int digits = 0;
+    int d;
+    while (i < len && (d = hexDigit(buf[i])) >= 0) {
+      value = (value << 4) | d;
+      digits++;
+      i++;
+    }
+    if (digits == 0) {
+      fprintf(stderr, "Failed to parse file '%s' at byte %lu\n",
+        filename, (unsigned long) i);
+      exit(EXIT_FAILURE);
+    }
+    if (isAddr) {
+      address = value;
+      startRange = true;
+    }
+    else {
+      if (startRange) {
+        newRange(image, address);
+        startRange = false;
+      }
+      *extendBytes(image, 1) = (uint8_t) value;
+      image->ranges[image->numRanges-1].numBytes++;
+      address++;
+    }
   }
-  return false;
+}
+
+// Read allocated sections of a 32-bit little-endian ELF file
+static void parseELF(const char* filename, const uint8_t* buf, size_t len,
+                     MemFilePart part, MemImage* image)
+{
+  const Elf32_Ehdr* ehdr = (const Elf32_Ehdr*) buf;
+  if (len < sizeof(Elf32_Ehdr) ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||
+      ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+      ehdr->e_shoff + (size_t) ehdr->e_shnum * sizeof(Elf32_Shdr) > len ||
+      ehdr->e_shstrndx >= ehdr->e_shnum) {
+    fprintf(stderr, "Unsupported ELF file '%s'\n", filename);
+    exit(EXIT_FAILURE);
+  }
+  if (ehdr->e_phoff + (size_t) ehdr->e_phnum * sizeof(Elf32_Phdr) > len) {
+    fprintf(stderr, "Truncated ELF file '%s'\n", filename);
+    exit(EXIT_FAILURE);
+  }
+  const Elf32_Phdr* phdrs = (const Elf32_Phdr*) &buf[ehdr->e_phoff];
+  const Elf32_Shdr* shdrs = (const Elf32_Shdr*) &buf[ehdr->e_shoff];
+  const Elf32_Shdr* strtab = &shdrs[ehdr->e_shstrndx];
+  if (strtab->sh_offset + (size_t) strtab->sh_size > len) {
+    fprintf(stderr, "Truncated ELF file '%s'\n", filename);
+    exit(EXIT_FAILURE);
+  }
+  const char* names = (const char*) &buf[strtab->sh_offset];
+  for (uint32_t i = 0; i < ehdr->e_shnum; i++) {
+    const Elf32_Shdr* sh = &shdrs[i];
+    if (! (sh->sh_flags & SHF_ALLOC) || sh->sh_size == 0) continue;
+    // Section name must be a terminated string within the string table
+    if (sh->sh_name >= strtab->sh_size ||
+        memchr(&names[sh->sh_name], 0, strtab->sh_size - sh->sh_name)
+          == NULL) {
+      fprintf(stderr, "Malformed ELF file '%s'\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    bool isText = strcmp(&names[sh->sh_name], ".text") == 0;
+    if (part == MemFileCode && ! isText) continue;
+    if (part == MemFileData && isText) continue;
+    // Load at the section's physical address (as objcopy does), which
+    // differs from its virtual address if the linker script uses AT()
+    uint32_t addr = sh->sh_addr;
+    for (uint32_t j = 0; j < ehdr->e_phnum; j++) {
+      const Elf32_Phdr* ph = &phdrs[j];
+      if (ph->p_type == PT_LOAD && sh->sh_addr >= ph->p_vaddr &&
+            sh->sh_addr - ph->p_vaddr < ph->p_memsz) {
+        addr = sh->sh_addr - ph->p_vaddr + ph->p_paddr;
+        break;
+      }
+    }
+    newRange(image, addr);
+    image->ranges[image->numRanges-1].numBytes = sh->sh_size;
+    uint8_t* ptr = extendBytes(image, sh->sh_size);
+    if (sh->sh_type == SHT_NOBITS) {
+      memset(ptr, 0, sh->sh_size);
+    }
+    else {
+      if (sh->sh_offset + (size_t) sh->sh_size > len) {
+        fprintf(stderr, "Truncated ELF file '%s'\n", filename);
+        exit(EXIT_FAILURE);
+      }
+      memcpy(ptr, &buf[sh->sh_offset], sh->sh_size);
+    }
+  }
+}
+
+// Constructor
+MemFileReader::MemFileReader(const char* filename, MemFilePart part)
+{
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Failed to open file '%s'\n", filename);
+    exit(EXIT_FAILURE);
+  }
+
+  // Look for previously parsed image of the same, unmodified file
+  MemImage** prev = &imageCache;
+  for (image = imageCache; image != NULL; image = image->next) {
+    if (image->dev == st.st_dev && image->ino == st.st_ino &&
+          image->size == st.st_size &&
+          image->mtime.tv_sec == st.st_mtim.tv_sec &&
+          image->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+          image->part == part) {
+      close(fd);
+      // Move to front
+      *prev = image->next;
+      image->next = imageCache;
+      imageCache = image;
+      image->users++;
+      return;
+    }
+    prev = &image->next;
+  }
+
+  // Map file
+  size_t len = st.st_size;
+  const uint8_t* buf = NULL;
+  if (len > 0) {
+    void* map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      perror("mmap");
+      exit(EXIT_FAILURE);
+    }
+    buf = (const uint8_t*) map;
+  }
+  close(fd);
+
+  // Parse file
+  image = (MemImage*) calloc(1, sizeof(MemImage));
+  assert(image != NULL);
+  image->dev = st.st_dev;
+  image->ino = st.st_ino;
+  image->size = st.st_size;
+  image->mtime = st.st_mtim;
+  image->part = part;
+  image->users = 1;
+  bool isELF = len >= 4 && memcmp(buf, ELFMAG, SELFMAG) == 0;
+  if (isELF)
+    parseELF(filename, buf, len, part, image);
+  else
+    parseHex(filename, buf, len, image);
+  if (len > 0) munmap((void*) buf, len);
+
+  // Resolve byte offsets to pointers, now that the bytes won't move
+  for (uint32_t i = 0; i < image->numRanges; i++)
+    image->ranges[i].bytes =
+      &image->bytes[(uintptr_t) image->ranges[i].bytes];
+
+  // Sort by address, and merge ranges that are contiguous both in
+  // memory and in the image
+  qsort(image->ranges, image->numRanges, sizeof(MemRange), compareRanges);
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < image->numRanges; i++) {
+    MemRange r = image->ranges[i];
+    if (r.numBytes == 0) continue;
+    if (n > 0) {
+      MemRange* last = &image->ranges[n-1];
+      if (last->addr + last->numBytes == r.addr &&
+          last->bytes + last->numBytes == r.bytes) {
+        last->numBytes += r.numBytes;
+        continue;
+      }
+    }
+    image->ranges[n++] = r;
+  }
+  image->numRanges = n;
+
+  // Add to cache
+  image->next = imageCache;
+  imageCache = image;
+  trimCache();
 }
 
 // Destructor
 MemFileReader::~MemFileReader()
 {
-  if (fp != NULL) fclose(fp);
+  image->users--;
+  trimCache();
+}
+
+// Number of contiguous address ranges in the image
+uint32_t MemFileReader::numRanges()
+{
+  return image->numRanges;
+}
+
+// Contiguous address ranges in the image
+const MemRange* MemFileReader::ranges()
+{
+  return image->ranges;
 }
@@ -6,22 +6,49 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+// A contiguous range of bytes in a memory image
+struct MemRange {
+  uint32_t addr;
+  uint32_t numBytes;
+  const uint8_t* bytes;
+
+  // Copy up to maxWords 32-bit words starting at the given byte offset,
+  // zero-padding the final word.  Returns the number of words copied.
+  uint32_t getWords(uint32_t offset, uint32_t* words,
+                    uint32_t maxWords) const;
+};
+
+// Which sections to take from an ELF file
+// (Verilog hex files contain a single part and are read in full)
+enum MemFilePart {
+  // All allocated sections
+  MemFileAll,
+  // The .text section (as "objcopy --only-section=.text")
+  MemFileCode,
+  // All allocated sections except .text, including .bss
+  MemFileData
+};
+
+// Parsed memory image
+struct MemImage;
+
 class MemFileReader {
-  FILE* fp;
-  uint32_t address;
+  // Parsed image (owned by the image cache)
+  MemImage* image;
 
  public:
   // Constructor
-  MemFileReader(const char* filename);
-
-  // Read a byte
-  bool getByte(uint32_t* addr, uint8_t* byte);
-
-  // Read a 32-bit word
-  bool getWord(uint32_t* addr, uint32_t* word);
+  // The file is memory mapped and parsed, unless a recent reader of the
+  // same file, unmodified since (by device, inode, size and mtime),
+  // left a parsed image in the cache
+  MemFileReader(const char* filename, MemFilePart part = MemFileAll);
 
   // Destructor
   ~MemFileReader();
+
+  // Contiguous address ranges in the image, in ascending address order
+  uint32_t numRanges();
+  const MemRange* ranges();
 };
 
 #endif
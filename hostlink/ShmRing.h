@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: BSD-2-Clause
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+// Shared-memory transport between HostLink and pciestreamd
+// ========================================================
+//
+// Rather than streaming flits over the UNIX domain socket, HostLink
+// can ask pciestreamd for a shared-memory region holding two
+// single-producer single-consumer byte rings, one per direction.
+// HostLink writes messages into the TX ring and reads received messages
+// from the RX ring, while the daemon copies data between the rings and
+// its DMA buffers.  This removes the copy through the socket (and its
+// system calls) in each direction, but is not zero-copy: the DMA
+// buffers are private to the daemon, so one copy per direction remains.
+// The socket is then used only to detect closure, and to wake a side
+// that has gone to sleep (by sending it a "doorbell" byte).
+//
+// To negotiate, the client sends a 16-byte hello as the first data on
+// the connection.  The second word of the hello is ShmHelloMagic, which
+// is never set in a message header.  The daemon replies with a 16-byte
+// ack of the same form, whose third word is the size of the region, and
+// which carries the region's file descriptor (SCM_RIGHTS).
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// Magic value in the second word of the hello and ack
+#define ShmHelloMagic 0x314d4853
+
+// Bytes per ring (a multiple of the message size, so that messages
+// received from the FPGA never wrap around the end of the ring)
+#define ShmRingBytes (1 << 22)
+
+// Single-producer single-consumer byte ring
+struct ShmRing {
+  // Free-running byte counts, written only by the producer (head)
+  // and only by the consumer (tail)
+  volatile uint64_t head __attribute__((aligned(64)));
+  volatile uint64_t tail __attribute__((aligned(64)));
+  // Contents
+  char data[ShmRingBytes] __attribute__((aligned(64)));
+};
+
+// Shared region
+struct ShmRegion {
+  // From HostLink to the FPGA
+  ShmRing tx;
+  // From the FPGA to HostLink
+  ShmRing rx;
+  // Set by each side before it blocks on the socket, to request a
+  // doorbell when the other side produces or consumes data
+  volatile uint32_t daemonAsleep __attribute__((aligned(64)));
+  volatile uint32_t clientAsleep __attribute__((aligned(64)));
+  // Set by the client before it blocks waiting for space in the TX
+  // ring, to request a doorbell when the daemon consumes data from it
+  volatile uint32_t clientSendAsleep __attribute__((aligned(64)));
+};
+
+// Bytes available to a consumer at position tail
+inline uint32_t shmRingAvail(ShmRing* r, uint64_t tail)
+{
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+// Bytes free for a producer at position head
+inline uint32_t shmRingSpace(ShmRing* r, uint64_t head)
+{
+  return ShmRingBytes - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+// Copy bytes into the ring at position pos
+inline void shmRingPut(ShmRing* r, uint64_t pos, const void* src, uint32_t n)
+{
+  uint32_t offset = pos % ShmRingBytes;
+  uint32_t first = n < ShmRingBytes - offset ? n : ShmRingBytes - offset;
+  memcpy(&r->data[offset], src, first);
+  memcpy(r->data, (const char*) src + first, n - first);
+}
+
+// Copy bytes out of the ring at position pos
+inline void shmRingGet(ShmRing* r, uint64_t pos, void* dst, uint32_t n)
+{
+  uint32_t offset = pos % ShmRingBytes;
+  uint32_t first = n < ShmRingBytes - offset ? n : ShmRingBytes - offset;
+  memcpy(dst, &r->data[offset], first);
+  memcpy((char*) dst + first, r->data, n - first);
+}
+
+// Make bytes up to head visible to the consumer
+inline void shmRingPublish(ShmRing* r, uint64_t head)
+{
+  __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+}
+
+// Hand bytes up to tail back to the producer
+inline void shmRingRelease(ShmRing* r, uint64_t tail)
+{
+  __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+}
+
+// Ring the other side's doorbell, if it is asleep
+// (The full barrier orders our ring update before reading the flag,
+// pairing with the barrier between setting the flag and rechecking the
+// ring on the other side)
+inline void shmDoorbell(volatile uint32_t* asleep, int sock)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (*asleep) {
+    *asleep = 0;
+    char byte = 0;
+    ssize_t ret = send(sock, &byte, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void) ret;
+  }
+}
+
+#endif
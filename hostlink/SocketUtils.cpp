@@ -166,3 +166,18 @@ void socketBlockingPut(int fd, char* buf, int numBytes)
     }
   }
 }
+
+// Read at least one and at most maxBytes from socket, blocking
+// Returns the number of bytes read
+int socketBlockingGetSome(int fd, char* buf, int maxBytes)
+{
+  int ret;
+  do {
+    ret = recv(fd, buf, maxBytes, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret <= 0) {
+    fprintf(stderr, "Error reading from socket\n");
+    exit(EXIT_FAILURE);
+  }
+  return ret;
+}
@@ -29,6 +29,10 @@ void socketBlockingGet(int fd, char* buf, int numBytes);
 // Either send exactly numBytes to a socket, blocking
 void socketBlockingPut(int fd, char* buf, int numBytes);
 
+// Read at least one and at most maxBytes from socket, blocking
+// Returns the number of bytes read
+int socketBlockingGetSome(int fd, char* buf, int maxBytes);
+
 // Create TCP connection to given host/port
 /*!
     \param returnIfCantConnect In the case that we cant connect, return -1 rather than exit
@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Drive HostLink against "pciestreamd -s", which loops every message
+// back to the host, and check that each comes back intact and in order.
+// Run by run.sh, once per transport (see README.md, HOSTLINK_SHM).
+
+#include <HostLink.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Flits sent per message
+// (A message comes back with its 16-byte header as its first flit)
+#define SEND_FLITS 3
+
+// Words per received message
+#define MSG_WORDS (1 << TinselLogWordsPerMsg)
+
+// Number of errors
+static uint64_t errors = 0;
+
+// Fill the payload of message number n
+static void fill(uint32_t* payload, uint32_t n)
+{
+  for (uint32_t i = 0; i < 4*SEND_FLITS; i++)
+    payload[i] = n * 4*SEND_FLITS + i;
+}
+
+// Check that a received message is message number n
+static void check(const char* test, uint32_t* msg, uint32_t n)
+{
+  bool ok = msg[0] == n % 1024;
+  for (uint32_t i = 0; i < 4*SEND_FLITS; i++)
+    ok = ok && msg[4+i] == n * 4*SEND_FLITS + i;
+  if (! ok) {
+    if (errors < 5)
+      printf("%s: message %u is wrong\n", test, n);
+    errors++;
+  }
+}
+
+// Stream messages through the send buffer, in batches, so that the
+// shared-memory rings wrap around many times
+static void stream(HostLink* hl, uint32_t numMsgs)
+{
+  const uint32_t batch = 4096;
+  uint32_t payload[4*SEND_FLITS];
+  uint32_t sent = 0, received = 0;
+  hl->useSendBuffer = true;
+  while (sent < numMsgs) {
+    for (uint32_t i = 0; i < batch && sent < numMsgs; i++) {
+      fill(payload, sent);
+      hl->send(sent % 1024, SEND_FLITS, payload);
+      sent++;
+    }
+    hl->flush();
+    while (received < sent) {
+      void* msgs;
+      uint32_t n = hl->recvBatch(&msgs, sent - received);
+      for (uint32_t i = 0; i < n; i++)
+        check("stream", (uint32_t*) msgs + MSG_WORDS*i, received++);
+    }
+  }
+  hl->useSendBuffer = false;
+}
+
+// Send one message at a time, waiting for each to return, with pauses
+// long enough for the daemon and HostLink to go to sleep and have to be
+// woken by a doorbell
+static void pingPong(HostLink* hl, uint32_t numMsgs)
+{
+  uint32_t payload[4*SEND_FLITS];
+  uint32_t msg[MSG_WORDS];
+  for (uint32_t n = 0; n < numMsgs; n++) {
+    if (n % 64 == 0) usleep(20000);
+    fill(payload, n);
+    hl->send(n % 1024, SEND_FLITS, payload);
+    hl->recv(msg);
+    check("ping-pong", msg, n);
+  }
+}
+
+// Send every message before receiving any, more than the transport can
+// hold, so that the sender must wait for space (needs the receive
+// thread, which drains returning messages meanwhile)
+static void burst(HostLink* hl, uint32_t numMsgs)
+{
+  uint32_t payload[4*SEND_FLITS];
+  uint32_t msg[MSG_WORDS];
+  for (uint32_t n = 0; n < numMsgs; n++) {
+    fill(payload, n);
+    hl->send(n % 1024, SEND_FLITS, payload);
+  }
+  for (uint32_t n = 0; n < numMsgs; n++) {
+    hl->recv(msg);
+    check("burst", msg, n);
+  }
+}
+
+int main()
+{
+  HostLink hl;
+  stream(&hl, 500000);
+  pingPong(&hl, 1000);
+  if (getenv("HOSTLINK_RECV_THREAD")) burst(&hl, 300000);
+  if (hl.canRecv()) {
+    printf("unexpected message\n");
+    errors++;
+  }
+  return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
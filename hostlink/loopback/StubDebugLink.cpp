@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Stand-in for DebugLink, presenting a single board and no UART data,
+// so that HostLink can run without boardctrld
+
+#include "DebugLink.h"
+
+DebugLink::DebugLink(DebugLinkParams p)
+{
+  boxMeshXLen = boxMeshYLen = 1;
+  meshXLen = meshYLen = 1;
+}
+
+void DebugLink::setDest(uint32_t boardX, uint32_t boardY,
+                        uint32_t coreId, uint32_t threadId) {}
+
+void DebugLink::setBroadcastDest(uint32_t boardX, uint32_t boardY,
+                                 uint32_t threadId) {}
+
+void DebugLink::put(uint32_t boardX, uint32_t boardY, uint8_t byte) {}
+
+void DebugLink::get(uint32_t* boardX, uint32_t* boardY,
+                    uint32_t* coreId, uint32_t* threadId, uint8_t* byte) {}
+
+bool DebugLink::canGet() { return false; }
+
+int32_t DebugLink::getBoardTemp(uint32_t boardX, uint32_t boardY)
+  { return 0; }
+
+int32_t DebugLink::getBridgeTemp(uint32_t boxX, uint32_t boxY)
+  { return 0; }
+
+DebugLink::~DebugLink() {}
@@ -0,0 +1,36 @@
+#!/bin/bash
+# SPDX-License-Identifier: BSD-2-Clause
+# Run the loopback test over each transport, against a private
+# instance of "pciestreamd -s"
+
+cd "$( dirname "${BASH_SOURCE[0]}" )"
+
+../pciestreamd -s &
+DAEMON=$!
+sleep 1
+if ! kill -0 $DAEMON 2> /dev/null ; then
+  echo "Failed to start pciestreamd -s (is pciestreamd already running?)"
+  exit 1
+fi
+
+export HOSTLINK_NO_SELF_TEST=1
+FAILED=0
+
+function run {
+  NAME="$1"
+  shift
+  if env "$@" timeout 120 ./loopback ; then
+    echo "ok $NAME"
+  else
+    echo "not ok $NAME"
+    FAILED=1
+  fi
+}
+
+run "socket"
+run "socket with receive thread" HOSTLINK_RECV_THREAD=1
+run "shared memory" HOSTLINK_SHM=1
+run "shared memory with receive thread" HOSTLINK_SHM=1 HOSTLINK_RECV_THREAD=1
+
+kill $DAEMON
+exit $FAILED
@@ -5,6 +5,13 @@
 // =================
 //
 // Connect UNIX domain socket to FPGA FIFO via PCIeStream.
+//
+// The event loop spins on the DMA CSRs for a short (adaptive) period
+// when idle, and then blocks on the client socket using epoll, with a
+// timerfd bounding the time before the CSRs are next checked.
+//
+// A client may ask to exchange data through shared-memory rings rather
+// than the socket (see ShmRing.h).
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,6 +28,13 @@
 #include <assert.h>
 #include <poll.h>
 #include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "ShmRing.h"
 
 // Constants
 // ---------
@@ -47,6 +61,21 @@
 #define CSR_INFLIGHT  10
 #define CSR_RESET     11
 
+// Size of CSR region in bytes
+#define CSRRegionSize 0x40000
+
+// Bounds on number of idle iterations spent spinning before blocking
+#define MinSpin 64
+#define MaxSpin 65536
+
+// Bounds on time spent blocking (in microseconds) before checking CSRs
+#define MinSleep 1
+#define MaxSleep 100
+
+// Number of buckets in latency histogram (bucket i counts latencies
+// in the range [2^(i-1), 2^i) microseconds, and bucket 0 those < 1us)
+#define LatencyBuckets 24
+
 // Helper functions
 // ----------------
 
@@ -81,6 +110,20 @@ int alive(int sock)
   return send(sock, &buf, 0, 0) == 0;
 }
 
+// Hint to the CPU that we are in a spin loop
+static inline void cpuRelax()
+{
+  asm volatile("pause");
+}
+
+// Current time in nanoseconds
+static inline uint64_t nowNs()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1000000000ul + t.tv_nsec;
+}
+
 // Types
 // -----
 
@@ -110,6 +153,13 @@ typedef struct {
   int bufferReady;
   // The number of bytes written to the active buffer but not yet sent
   int pending;
+  // Has no data yet been received on the connection?
+  int atStart;
+  // First bytes received, while deciding whether they are a hello
+  uint8_t hello[16];
+  int helloLen;
+  // Shared-memory rings, if negotiated by the client
+  ShmRegion* shm;
 } TxState;
 
 // Receiver state
@@ -128,6 +178,8 @@ typedef struct {
   int written;
   // The number of bytes in the DMA buffer available for reading
   int available;
+  // Shared-memory rings, if negotiated by the client
+  ShmRegion* shm;
 } RxState;
 
 // Transmitter
@@ -144,6 +196,81 @@ void txInit(TxState* s, int client, volatile uint64_t* csrs,
   s->activeBuffer = 0;
   s->bufferReady = 0;
   s->pending = 0;
+  s->atStart = 1;
+  s->helloLen = 0;
+  s->shm = NULL;
+}
+
+// Create shared-memory rings and send them to the client
+ShmRegion* shmCreate(int client)
+{
+  int fd = memfd_create("pciestream", 0);
+  if (fd == -1 || ftruncate(fd, sizeof(ShmRegion)) != 0) {
+    perror("pciestreamd: memfd");
+    return NULL;
+  }
+  void* ptr = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  if (ptr == MAP_FAILED) {
+    perror("pciestreamd: mmap rings");
+    close(fd);
+    return NULL;
+  }
+
+  // Send ack, carrying the file descriptor
+  uint32_t ack[4] = { 0, ShmHelloMagic, (uint32_t) sizeof(ShmRegion), 0 };
+  struct iovec iov;
+  iov.iov_base = ack;
+  iov.iov_len = sizeof(ack);
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  int ret = sendmsg(client, &msg, MSG_NOSIGNAL);
+  close(fd);
+  if (ret != sizeof(ack)) {
+    munmap(ptr, sizeof(ShmRegion));
+    return NULL;
+  }
+  return (ShmRegion*) ptr;
+}
+
+// Check whether the first data on the connection is a shared-memory
+// hello, and if so, set up the rings.  Bytes are consumed as they
+// arrive (so that a partial hello doesn't keep the socket readable),
+// and are passed on to the FPGA if they turn out to be ordinary data.
+// Returns < 0 on error, 0 if more data is needed to decide, and 1
+// otherwise.
+int shmCheckHello(TxState* s)
+{
+  int want = s->helloLen < 8 ? 8 : (int) sizeof(s->hello);
+  int n = recv(s->client, &s->hello[s->helloLen], want - s->helloLen,
+               MSG_DONTWAIT);
+  if (n < 0) return errno == EAGAIN ? 0 : -1;
+  if (n == 0) return -1;
+  s->helloLen += n;
+  if (s->helloLen < 8) return 0;
+  uint32_t magic;
+  memcpy(&magic, &s->hello[4], sizeof(magic));
+  if (magic != ShmHelloMagic) {
+    memcpy((void*) &s->txA[s->pending], s->hello, s->helloLen);
+    s->pending += s->helloLen;
+    s->atStart = 0;
+    return 1;
+  }
+  if (s->helloLen < (int) sizeof(s->hello)) return 0;
+  s->atStart = 0;
+  s->shm = shmCreate(s->client);
+  return s->shm ? 1 : -1;
 }
 
 // Read from socket and write to FPGA
@@ -156,11 +283,16 @@ Status tx(TxState* s)
   if (s->pending == DMABufferSize) doSend = 1;
 
   // Send pending data if: (1) pending is a non-zero multiple of
-  // 16 and (2) there's no data available on the socket.
+  // 16 and (2) there's no data available from the client.
   if (s->pending != 0 && (s->pending&0xf) == 0) {
-    struct pollfd fd; fd.fd = s->client; fd.events = POLLIN;
-    int ret = poll(&fd, 1, 0);
-    if (ret <= 0) doSend = 1;
+    if (s->shm) {
+      if (shmRingAvail(&s->shm->tx, s->shm->tx.tail) == 0) doSend = 1;
+    }
+    else {
+      struct pollfd fd; fd.fd = s->client; fd.events = POLLIN;
+      int ret = poll(&fd, 1, 0);
+      if (ret <= 0) doSend = 1;
+    }
   }
 
   // Try to read data from client
@@ -172,6 +304,17 @@ Status tx(TxState* s)
       else
         return FULL;
     }
+    if (s->shm) {
+      // Copy data from the TX ring to the DMA buffer
+      ShmRing* r = &s->shm->tx;
+      int n = min(shmRingAvail(r, r->tail), DMABufferSize - s->pending);
+      if (n == 0) return NO_SEND;
+      shmRingGet(r, r->tail, (void*) &s->txA[s->pending], n);
+      shmRingRelease(r, r->tail + n);
+      shmDoorbell(&s->shm->clientSendAsleep, s->client);
+      s->pending += n;
+      return PROGRESS;
+    }
     // Is there any data to transmit?
     struct pollfd fd; fd.fd = s->client; fd.events = POLLIN;
     int ret = poll(&fd, 1, 0);
@@ -180,6 +323,13 @@ Status tx(TxState* s)
     else if (ret < 0)
       return CLOSED;
     else {
+      // The client may ask for shared-memory rings before sending data
+      if (s->atStart) {
+        int hello = shmCheckHello(s);
+        if (hello < 0) return CLOSED;
+        if (hello == 0) return NO_SEND;
+        return PROGRESS;
+      }
       // Read data from client
       int n = read(s->client, (void*) &s->txA[s->pending],
                 DMABufferSize - s->pending);
@@ -221,6 +371,7 @@ void rxInit(RxState* s, int client, volatile uint64_t* csrs,
   s->activeBuffer = 0;
   s->written = 0;
   s->available = 0;
+  s->shm = NULL;
 }
 
 // Read from FPGA and write to socket
@@ -237,17 +388,33 @@ Status rx(RxState* s)
   }
 
   // Can we send data to the client?
-  struct pollfd fd; fd.fd = s->client; fd.events = POLLOUT;
-  int ret = poll(&fd, 1, 0);
+  int ret;
+  if (s->shm)
+    ret = shmRingSpace(&s->shm->rx, s->shm->rx.head) != 0;
+  else {
+    struct pollfd fd; fd.fd = s->client; fd.events = POLLOUT;
+    ret = poll(&fd, 1, 0);
+  }
   if (ret == 0)
     return CLIENT_BUSY;
   else if (ret < 0)
     return CLOSED;
   else {
-    // Write data to socket
-    int n = write(s->client, (void*) &s->rxA[s->written],
-              s->available - s->written);
-    if (n <= 0) return CLOSED;
+    int n;
+    if (s->shm) {
+      // Copy data from the DMA buffer to the RX ring
+      ShmRing* r = &s->shm->rx;
+      n = min(shmRingSpace(r, r->head), s->available - s->written);
+      shmRingPut(r, r->head, (void*) &s->rxA[s->written], n);
+      shmRingPublish(r, r->head + n);
+      shmDoorbell(&s->shm->clientAsleep, s->client);
+    }
+    else {
+      // Write data to socket
+      n = write(s->client, (void*) &s->rxA[s->written],
+                s->available - s->written);
+      if (n <= 0) return CLOSED;
+    }
     s->written += n;
 
     // Consume data from FPGA
@@ -266,14 +433,268 @@ Status rx(RxState* s)
   return PROGRESS;
 }
 
+// Latency statistics
+// ------------------
+
+// The latency we record is the time between the last check that found
+// no work and the next check that made progress, i.e. an upper bound
+// on the delay that the daemon added to the arrival of new data
+
+typedef struct {
+  // Histogram of latencies, with log2 microsecond buckets
+  uint64_t buckets[LatencyBuckets];
+  // Number of samples
+  uint64_t count;
+  // Total and max latency in nanoseconds
+  uint64_t total;
+  uint64_t max;
+  // Number of times the event loop blocked
+  uint64_t blocks;
+} LatencyStats;
+
+// Record a latency sample
+void latencyRecord(LatencyStats* s, uint64_t ns)
+{
+  uint64_t us = ns / 1000;
+  int b = 0;
+  while (us > 0 && b < LatencyBuckets-1) { us >>= 1; b++; }
+  s->buckets[b]++;
+  s->count++;
+  s->total += ns;
+  if (ns > s->max) s->max = ns;
+}
+
+// Latency (in microseconds) below which the given fraction of samples lie
+// (Upper bound given by histogram bucket)
+uint64_t latencyPercentile(LatencyStats* s, double frac)
+{
+  uint64_t target = (uint64_t) (frac * s->count);
+  uint64_t seen = 0;
+  for (int b = 0; b < LatencyBuckets; b++) {
+    seen += s->buckets[b];
+    if (seen > target) return 1ul << b;
+  }
+  return 1ul << (LatencyBuckets-1);
+}
+
+// Log latency distribution to stderr
+void latencyReport(LatencyStats* s)
+{
+  if (s->count == 0) return;
+  fprintf(stderr, "pciestreamd: %lu wakeups (%lu blocking), "
+         "latency mean=%.2lfus p50<%luus p99<%luus max=%.2lfus\n",
+         s->count, s->blocks, (double) s->total / s->count / 1000.0,
+         latencyPercentile(s, 0.5), latencyPercentile(s, 0.99),
+         (double) s->max / 1000.0);
+  for (int b = 0; b < LatencyBuckets; b++) {
+    if (s->buckets[b] == 0) continue;
+    fprintf(stderr, "  <%8luus: %lu\n", 1ul << b, s->buckets[b]);
+  }
+  fflush(stderr);
+}
+
+// Software DMA stand-in
+// ---------------------
+
+// For testing the daemon without an FPGA, the CSRs and DMA buffers can
+// be allocated in ordinary memory, and a thread plays the role of the
+// FPGA, looping back every transmitted buffer as a received buffer
+
+typedef struct {
+  volatile uint64_t* csrs;
+  volatile char* rx[2];
+  volatile char* tx[2];
+} StandIn;
+
+void* standInLoop(void* arg)
+{
+  StandIn* s = (StandIn*) arg;
+  volatile uint64_t* csrs = s->csrs;
+  int txBuffer = 0, rxBuffer = 0;
+  for (;;) {
+    // Reset
+    if (csrs[2*CSR_EN] == 0) {
+      txBuffer = rxBuffer = 0;
+      for (int i = 0; i < 2; i++)
+        csrs[2*(CSR_LEN_RX_A+i)] = csrs[2*(CSR_LEN_TX_A+i)] = 0;
+      usleep(1000);
+      continue;
+    }
+    // Loop back a transmitted buffer, if there is one and space for it
+    uint64_t len = csrs[2*(CSR_LEN_TX_A + txBuffer)];
+    if (len == 0 || csrs[2*(CSR_LEN_RX_A + rxBuffer)] != 0) {
+      usleep(10);
+      continue;
+    }
+    __sync_synchronize();
+    memcpy((void*) s->rx[rxBuffer], (void*) s->tx[txBuffer], len*16);
+    __sync_synchronize();
+    csrs[2*(CSR_LEN_RX_A + rxBuffer)] = len;
+    csrs[2*(CSR_LEN_TX_A + txBuffer)] = 0;
+    txBuffer = (txBuffer+1)&1;
+    rxBuffer = (rxBuffer+1)&1;
+  }
+  return NULL;
+}
+
+// Allocate a page-aligned zeroed region
+volatile char* allocRegion(size_t size)
+{
+  void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    perror("mmap stand-in");
+    exit(EXIT_FAILURE);
+  }
+  return (volatile char*) ptr;
+}
+
+// Event loop
+// ----------
+
+// Add given fd to epoll set
+void epollAdd(int epfd, int fd, uint32_t events)
+{
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    perror("pciestreamd: epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Serve the given client connection until it is closed
+void serve(int conn, TxState* txState, RxState* rxState, LatencyStats* stats)
+{
+  // Epoll set containing the client socket and a timer
+  int epfd = epoll_create1(0);
+  int timer = timerfd_create(CLOCK_MONOTONIC, 0);
+  if (epfd == -1 || timer == -1) {
+    perror("pciestreamd: epoll/timerfd");
+    exit(EXIT_FAILURE);
+  }
+  epollAdd(epfd, conn, EPOLLIN | EPOLLRDHUP);
+  epollAdd(epfd, timer, EPOLLIN);
+  uint32_t connEvents = EPOLLIN | EPOLLRDHUP;
+
+  // Adaptive spin/sleep budgets
+  uint32_t spinBudget = MinSpin;
+  uint32_t sleepUs = MinSleep;
+  uint32_t idleSpins = 0;
+  bool blocked = false;
+
+  // Time of last check that found nothing to do
+  uint64_t idleSince = 0;
+
+  for (;;) {
+    Status txStatus = tx(txState);
+    if (txStatus == CLOSED) break;
+    rxState->shm = txState->shm;
+    Status rxStatus = rx(rxState);
+    if (rxStatus == CLOSED) break;
+
+    if (txStatus == PROGRESS || rxStatus == PROGRESS) {
+      if (idleSince != 0) {
+        latencyRecord(stats, nowNs() - idleSince);
+        // Spinning found work, so it's worth spinning longer next time
+        if (!blocked && spinBudget < MaxSpin) spinBudget <<= 1;
+        idleSince = 0;
+      }
+      idleSpins = 0;
+      sleepUs = MinSleep;
+      blocked = false;
+      continue;
+    }
+
+    // Nothing to do: spin for a while
+    idleSince = nowNs();
+    if (idleSpins < spinBudget) {
+      idleSpins++;
+      cpuRelax();
+      continue;
+    }
+
+    // Still nothing to do: block on client socket and timer
+    if (! alive(conn)) break;
+    ShmRegion* shm = txState->shm;
+    if (shm) {
+      // Ask client for a doorbell, and recheck the rings
+      shm->daemonAsleep = 1;
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if ((txStatus == NO_SEND && shmRingAvail(&shm->tx, shm->tx.tail)) ||
+          (rxStatus == CLIENT_BUSY && shmRingSpace(&shm->rx, shm->rx.head))) {
+        shm->daemonAsleep = 0;
+        continue;
+      }
+    }
+    if (!blocked && spinBudget > MinSpin) spinBudget >>= 1;
+    blocked = true;
+    stats->blocks++;
+
+    // Wait for client data only if we can accept it, and for client
+    // space only if we have data to give it (when using shared-memory
+    // rings, both are signalled by doorbell bytes on the socket)
+    uint32_t events = EPOLLRDHUP;
+    if (shm) events |= EPOLLIN;
+    else {
+      if (txStatus == NO_SEND) events |= EPOLLIN;
+      if (rxStatus == CLIENT_BUSY) events |= EPOLLOUT;
+    }
+    if (events != connEvents) {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = connEvents = events;
+      ev.data.fd = conn;
+      epoll_ctl(epfd, EPOLL_CTL_MOD, conn, &ev);
+    }
+
+    // The FPGA side can't wake us, so bound the sleep
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = sleepUs * 1000;
+    timerfd_settime(timer, 0, &its, NULL);
+    struct epoll_event ev[2];
+    int n = epoll_wait(epfd, ev, 2, -1);
+    bool hup = false;
+    for (int i = 0; i < n; i++) {
+      if (ev[i].data.fd == timer) {
+        uint64_t expirations;
+        ssize_t ret = read(timer, &expirations, sizeof(expirations));
+        (void) ret;
+        // Timer expired without client activity: back off
+        if (sleepUs < MaxSleep) sleepUs = min(2*sleepUs, MaxSleep);
+      }
+      else if (ev[i].events & (EPOLLHUP | EPOLLERR))
+        hup = true;
+    }
+    if (hup) break;
+    if (shm) {
+      // Discard doorbell bytes
+      shm->daemonAsleep = 0;
+      char buf[64];
+      int ret = recv(conn, buf, sizeof(buf), MSG_DONTWAIT);
+      if (ret == 0 || (ret < 0 && errno != EAGAIN)) break;
+    }
+    idleSpins = 0;
+  }
+
+  close(timer);
+  close(epfd);
+}
+
 // Main function
 // -------------
 
 // Display usage and quit
 void usage()
 {
-  fprintf(stderr, "Usage: pciestreamd [BAR0]\n"
-    "Where BAR0 is a physical address in hex\n");
+  fprintf(stderr, "Usage: pciestreamd [-v] BAR0\n"
+    "Where BAR0 is a physical address in hex\n"
+    "   or: pciestreamd [-v] -s\n"
+    "To use a software stand-in for the FPGA (loops back all data)\n"
+    "With -v, log the daemon's wakeup latency on each disconnection\n");
   exit(EXIT_FAILURE);
 }
 
@@ -344,48 +765,79 @@ int createListener()
 
 int main(int argc, char* argv[])
 {
+  // Log latency distributions?
+  bool verbose = argc > 1 && !strcmp(argv[1], "-v");
+  if (verbose) { argc--; argv++; }
   if (argc != 2) usage();
 
-  uint64_t ctrlBAR;
-  if (sscanf(argv[1], "%lx", &ctrlBAR) <= 0) usage();
+  // Use software stand-in for FPGA?
+  bool standIn = !strcmp(argv[1], "-s");
+
+  uint64_t ctrlBAR = 0;
+  if (!standIn && sscanf(argv[1], "%lx", &ctrlBAR) <= 0) usage();
 
   // Ignore SIGPIPE
   signal(SIGPIPE, SIG_IGN);
 
-  // Obtain access to control BAR
-  // ----------------------------
-
-  int memDev = open("/dev/mem", O_RDWR);
-  if (memDev == -1)
-  {
-    perror("open /dev/mem");
-    exit(EXIT_FAILURE);
+  volatile uint64_t* csrs;
+  uint64_t addrRxA, addrRxB, addrTxA, addrTxB;
+  volatile char *rxA, *rxB, *txA, *txB;
+
+  if (standIn) {
+    // Allocate CSRs and DMA buffers in ordinary memory
+    // ------------------------------------------------
+
+    csrs = (volatile uint64_t*) allocRegion(CSRRegionSize);
+    rxA = allocRegion(DMABufferSize);
+    rxB = allocRegion(DMABufferSize);
+    txA = allocRegion(DMABufferSize);
+    txB = allocRegion(DMABufferSize);
+    addrRxA = addrRxB = addrTxA = addrTxB = 0;
+
+    static StandIn s;
+    s.csrs = csrs;
+    s.rx[0] = rxA; s.rx[1] = rxB;
+    s.tx[0] = txA; s.tx[1] = txB;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, standInLoop, &s) != 0) {
+      fprintf(stderr, "pciestreamd: can't create stand-in thread\n");
+      exit(EXIT_FAILURE);
+    }
   }
+  else {
+    // Obtain access to control BAR
+    // ----------------------------
 
-  void *csrsPtr =
-    mmap(NULL,
-         0x40000,
-         PROT_READ | PROT_WRITE,
-         MAP_SHARED,
-         memDev,
-         ctrlBAR);
+    int memDev = open("/dev/mem", O_RDWR);
+    if (memDev == -1)
+    {
+      perror("open /dev/mem");
+      exit(EXIT_FAILURE);
+    }
 
-  if (csrsPtr == MAP_FAILED) {
-    perror("mmap csrs");
-    exit(EXIT_FAILURE);
-  }
+    void *csrsPtr =
+      mmap(NULL,
+           CSRRegionSize,
+           PROT_READ | PROT_WRITE,
+           MAP_SHARED,
+           memDev,
+           ctrlBAR);
 
-  volatile uint64_t* csrs = (uint64_t*) csrsPtr;
+    if (csrsPtr == MAP_FAILED) {
+      perror("mmap csrs");
+      exit(EXIT_FAILURE);
+    }
 
-  // Obtain access to DMA buffers
-  // ----------------------------
+    csrs = (uint64_t*) csrsPtr;
 
-  uint64_t addrRxA, addrRxB, addrTxA, addrTxB;
+    // Obtain access to DMA buffers
+    // ----------------------------
 
-  volatile char* rxA = openDMABuffer("/dev/dmabuffer0", PROT_READ, &addrRxA);
-  volatile char* rxB = openDMABuffer("/dev/dmabuffer1", PROT_READ, &addrRxB);
-  volatile char* txA = openDMABuffer("/dev/dmabuffer2", PROT_WRITE, &addrTxA);
-  volatile char* txB = openDMABuffer("/dev/dmabuffer3", PROT_WRITE, &addrTxB);
+    rxA = openDMABuffer("/dev/dmabuffer0", PROT_READ, &addrRxA);
+    rxB = openDMABuffer("/dev/dmabuffer1", PROT_READ, &addrRxB);
+    txA = openDMABuffer("/dev/dmabuffer2", PROT_WRITE, &addrTxA);
+    txB = openDMABuffer("/dev/dmabuffer3", PROT_WRITE, &addrTxB);
+  }
 
   // Main loop
   // ---------
@@ -425,18 +877,13 @@ int main(int argc, char* argv[])
     // Reset state
     txInit(&txState, conn, csrs, txA, txB);
     rxInit(&rxState, conn, csrs, rxA, rxB);
+    LatencyStats stats;
+    memset(&stats, 0, sizeof(stats));
 
     // Event loop
-    for (;;) {
-      Status txStatus = tx(&txState);
-      if (txStatus == CLOSED) break;
-      Status rxStatus = rx(&rxState);
-      if (rxStatus == CLOSED) break;
-      if (txStatus != PROGRESS && rxStatus != PROGRESS) {
-        if (! alive(conn)) break;
-        usleep(100);
-      }
-    }
+    serve(conn, &txState, &rxState, &stats);
+    if (verbose) latencyReport(&stats);
+    if (txState.shm) munmap(txState.shm, sizeof(ShmRegion));
 
     close(conn);
   }
@@ -3,12 +3,44 @@
 #define _NETWORK_H_
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <iostream>
 #include <fstream>
 #include <vector>
 
+// Binary edge list format
+// =======================
+//
+// A compressed sparse row (CSR) layout that can be mapped straight into
+// memory.  All fields are little-endian.
+//
+//   uint32_t magic              EdgeListMagic
+//   uint32_t version            EdgeListVersion
+//   uint32_t numNodes
+//   uint32_t numEdges
+//   uint64_t offset[numNodes]   Index of each node's row in rows[]
+//   uint32_t rows[]             For each node: number of neighbours,
+//                               followed by the neighbours
+//
+// Each row has the same layout as an entry of EdgeList::neighbours, so
+// the reader can point into the mapped file rather than copying it.
+
+#define EdgeListMagic 0x4c45504e
+#define EdgeListVersion 1
+
+struct EdgeListHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t numNodes;
+  uint32_t numEdges;
+};
+
 struct EdgeList {
   // Number of nodes and edges
   uint32_t numNodes;
@@ -18,6 +50,28 @@ struct EdgeList {
   // First element of each array holds the number of neighbours
   uint32_t** neighbours;
 
+  // Memory-mapped binary file, if read using readBinary()
+  void* mapped;
+  size_t mappedSize;
+
+  // Constructor
+  EdgeList() {
+    numNodes = numEdges = 0;
+    neighbours = NULL;
+    mapped = NULL;
+    mappedSize = 0;
+  }
+
+  // Destructor
+  ~EdgeList() {
+    if (neighbours == NULL) return;
+    if (mapped != NULL)
+      munmap(mapped, mappedSize);
+    else
+      for (uint32_t i = 0; i < numNodes; i++) free(neighbours[i]);
+    free(neighbours);
+  }
+
   // Read network from file
   void read(const char* filename)
   {
@@ -59,6 +113,94 @@ struct EdgeList {
     file.close();
   }
 
+  // Read network from binary file (see format above)
+  // The neighbour arrays point into the mapped file, which is read-only
+  void readBinary(const char* filename)
+  {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+      fprintf(stderr, "Can't open '%s'\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(EdgeListHeader)) {
+      fprintf(stderr, "Can't read '%s'\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    mappedSize = st.st_size;
+    mapped = mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+      fprintf(stderr, "Can't map '%s'\n", filename);
+      exit(EXIT_FAILURE);
+    }
+
+    // Check header
+    EdgeListHeader* header = (EdgeListHeader*) mapped;
+    if (header->magic != EdgeListMagic ||
+          header->version != EdgeListVersion) {
+      fprintf(stderr, "'%s' is not a binary edge list\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    numNodes = header->numNodes;
+    numEdges = header->numEdges;
+    uint64_t* offset = (uint64_t*) (header + 1);
+    uint32_t* rows = (uint32_t*) (offset + numNodes);
+    uint64_t rowsSize = (uint64_t) numNodes + numEdges;
+    uint64_t expectedSize = sizeof(EdgeListHeader) +
+      numNodes * sizeof(uint64_t) + rowsSize * sizeof(uint32_t);
+    if (mappedSize != expectedSize) {
+      fprintf(stderr, "'%s' has unexpected size\n", filename);
+      exit(EXIT_FAILURE);
+    }
+
+    // Point each node's neighbours at its row
+    madvise(mapped, mappedSize, MADV_SEQUENTIAL);
+    neighbours = (uint32_t**) malloc(numNodes * sizeof(uint32_t*));
+    for (uint32_t i = 0; i < numNodes; i++) {
+      // Check that the row lies within the file and that its
+      // neighbours are valid node ids
+      uint64_t off = offset[i];
+      bool ok = off < rowsSize && rows[off] < rowsSize - off;
+      for (uint32_t j = 1; ok && j <= rows[off]; j++)
+        ok = rows[off + j] < numNodes;
+      if (!ok) {
+        fprintf(stderr, "'%s' is corrupt (row of node %u)\n", filename, i);
+        exit(EXIT_FAILURE);
+      }
+      neighbours[i] = &rows[off];
+    }
+  }
+
+  // Write network to binary file (see format above)
+  void writeBinary(const char* filename)
+  {
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) {
+      fprintf(stderr, "Can't open '%s' for writing\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    EdgeListHeader header;
+    header.magic = EdgeListMagic;
+    header.version = EdgeListVersion;
+    header.numNodes = numNodes;
+    header.numEdges = numEdges;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < numNodes && ok; i++) {
+      ok = fwrite(&offset, sizeof(uint64_t), 1, fp) == 1;
+      offset += 1 + neighbours[i][0];
+    }
+    for (uint32_t i = 0; i < numNodes && ok; i++) {
+      uint32_t len = 1 + neighbours[i][0];
+      ok = fwrite(neighbours[i], sizeof(uint32_t), len, fp) == len;
+    }
+    if (fclose(fp) != 0 || !ok) {
+      fprintf(stderr, "Error writing '%s'\n", filename);
+      exit(EXIT_FAILURE);
+    }
+  }
+
   // Determine max fan-out
   uint32_t maxFanOut() {
     uint32_t max = 0;
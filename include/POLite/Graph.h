@@ -3,56 +3,117 @@
 #define _GRAPH_H_
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <POLite/Seq.h>
 
 typedef uint32_t NodeId;
 typedef int32_t PinId;
 typedef uint32_t NodeLabel;
+typedef uint32_t EdgeId;
 
-struct Graph {
-  // Incoming and outgoing edges
-  // Invariant: these two sequences always have equal length
-  Seq<Seq<NodeId>*>* incoming;
-  Seq<Seq<NodeId>*>* outgoing;
+// A read-only view of a contiguous slice of one of the graph's arrays
+// (Has the same fields as a Seq, so can be iterated in the same way)
+template <typename T> struct Slice {
+  T* elems;
+  uint32_t numElems;
 
-  // Each outgoing edge has a pin id
-  // Invariant: this sequence always has the same structure as 'outgoing'
-  Seq<Seq<PinId>*>* pins;
+  // Is given value in slice?
+  bool member(T x) {
+    for (uint32_t i = 0; i < numElems; i++)
+      if (elems[i] == x) return true;
+    return false;
+  }
+};
 
+// Edges are stored in compressed sparse row (CSR) form.  New edges are
+// appended to a flat edge buffer, which is merged into the CSR arrays by
+// finalise().  This avoids a heap allocation per node, and allows the
+// edges of each node to be iterated with no pointer chasing.
+struct Graph {
   // Each node has a label
   Seq<NodeLabel>* labels;
 
+  // Number of edges in the CSR arrays
+  uint32_t numEdges;
+
+  // Number of nodes covered by the CSR arrays
+  uint32_t numFinalNodes;
+
+  // The outgoing edges of node n are at indices outOffset[n] up to
+  // outOffset[n+1] of the outDest, outPin and outEdge arrays.  The
+  // outEdge array holds the id of each edge, i.e. its position in the
+  // order that edges were added to the graph.
+  EdgeId* outOffset;
+  NodeId* outDest;
+  PinId* outPin;
+  EdgeId* outEdge;
+
+  // The incoming edges of node n are at indices inOffset[n] up to
+  // inOffset[n+1] of the inSrc and inEdge arrays
+  EdgeId* inOffset;
+  NodeId* inSrc;
+  EdgeId* inEdge;
+
+  // Optional node and edge weights, used by the partitioner to balance
+  // load and minimise traffic (NULL when unweighted, i.e. all weights
+  // are 1).  Node weights are indexed by node id, edge weights by edge
+  // id, and any node or edge beyond the end has weight 1.
+  Seq<uint32_t>* nodeWeights;
+  Seq<uint32_t>* edgeWeights;
+
+  // Edges added since the CSR arrays were last built
+  Seq<NodeId>* newSrc;
+  Seq<NodeId>* newDest;
+  Seq<PinId>* newPin;
+
   // Constructor
   Graph() {
     const uint32_t initialCapacity = 4096;
-    incoming = new Seq<Seq<NodeId>*> (initialCapacity);
-    outgoing = new Seq<Seq<NodeId>*> (initialCapacity);
-    pins = new Seq<Seq<PinId>*> (initialCapacity);
     labels = new Seq<NodeLabel> (initialCapacity);
+    newSrc = new Seq<NodeId> (initialCapacity);
+    newDest = new Seq<NodeId> (initialCapacity);
+    newPin = new Seq<PinId> (initialCapacity);
+    numEdges = 0;
+    numFinalNodes = 0;
+    outOffset = (EdgeId*) calloc(1, sizeof(EdgeId));
+    inOffset = (EdgeId*) calloc(1, sizeof(EdgeId));
+    outDest = NULL;
+    outPin = NULL;
+    outEdge = NULL;
+    inSrc = NULL;
+    inEdge = NULL;
+    nodeWeights = NULL;
+    edgeWeights = NULL;
   }
 
   // Deconstructor
   ~Graph() {
-    for (uint32_t i = 0; i < incoming->numElems; i++) {
-      delete incoming->elems[i];
-      delete outgoing->elems[i];
-      delete pins->elems[i];
-    }
-    delete incoming;
-    delete outgoing;
-    delete pins;
     delete labels;
+    delete newSrc;
+    delete newDest;
+    delete newPin;
+    free(outOffset);
+    free(outDest);
+    free(outPin);
+    free(outEdge);
+    free(inOffset);
+    free(inSrc);
+    free(inEdge);
+    if (nodeWeights) delete nodeWeights;
+    if (edgeWeights) delete edgeWeights;
+  }
+
+  // Number of nodes
+  uint32_t numNodes() {
+    return labels->numElems;
   }
 
   // Add new node
   NodeId newNode() {
-    const uint32_t initialCapacity = 8;
-    incoming->append(new Seq<NodeId> (initialCapacity));
-    outgoing->append(new Seq<NodeId> (initialCapacity));
-    pins->append(new Seq<PinId> (initialCapacity));
-    labels->append(incoming->numElems - 1);
-    return incoming->numElems - 1;
+    labels->append(labels->numElems);
+    return labels->numElems - 1;
   }
 
   // Set node label
@@ -63,37 +124,214 @@ struct Graph {
 
   // Add edge using output pin 0
   void addEdge(NodeId x, NodeId y) {
-    outgoing->elems[x]->append(y);
-    pins->elems[x]->append(0);
-    incoming->elems[y]->append(x);
+    addEdge(x, 0, y);
+  }
+
+  // Add edge using given output pin, returning its id
+  EdgeId addEdge(NodeId x, PinId p, NodeId y) {
+    assert(x < labels->numElems && y < labels->numElems);
+    newSrc->append(x);
+    newPin->append(p);
+    newDest->append(y);
+    return numEdges + newSrc->numElems - 1;
+  }
+
+  // Set weight at given index of given weight sequence, allocating
+  // the sequence (with all weights 1) if necessary
+  static void setWeight(Seq<uint32_t>** weights, uint32_t i, uint32_t w) {
+    if (*weights == NULL) *weights = new Seq<uint32_t> (i+1);
+    while ((*weights)->numElems <= i) (*weights)->append(1);
+    (*weights)->elems[i] = w;
+  }
+
+  // Set node weight
+  void setNodeWeight(NodeId id, uint32_t w) {
+    assert(id < labels->numElems);
+    setWeight(&nodeWeights, id, w);
+  }
+
+  // Set edge weight
+  void setEdgeWeight(EdgeId id, uint32_t w) {
+    assert(id < numEdges + newSrc->numElems);
+    setWeight(&edgeWeights, id, w);
+  }
+
+  // Get node weight
+  inline uint32_t nodeWeight(NodeId id) {
+    return nodeWeights && id < nodeWeights->numElems ?
+             nodeWeights->elems[id] : 1;
+  }
+
+  // Get edge weight
+  inline uint32_t edgeWeight(EdgeId id) {
+    return edgeWeights && id < edgeWeights->numElems ?
+             edgeWeights->elems[id] : 1;
+  }
+
+  // Have all nodes and edges been merged into the CSR arrays?
+  bool isFinal() {
+    return newSrc->numElems == 0 && numFinalNodes == labels->numElems;
+  }
+
+  // Merge newly-added nodes and edges into the CSR arrays
+  // (The edges of each node remain in the order they were added)
+  void finalise() {
+    if (isFinal()) return;
+    uint32_t numNodes = labels->numElems;
+    uint32_t numNew = newSrc->numElems;
+    uint32_t total = numEdges + numNew;
+
+    // Count edges per node, and compute new offsets
+    EdgeId* out = (EdgeId*) calloc(numNodes+1, sizeof(EdgeId));
+    EdgeId* in = (EdgeId*) calloc(numNodes+1, sizeof(EdgeId));
+    for (uint32_t n = 0; n < numFinalNodes; n++) {
+      out[n+1] = outOffset[n+1] - outOffset[n];
+      in[n+1] = inOffset[n+1] - inOffset[n];
+    }
+    for (uint32_t i = 0; i < numNew; i++) {
+      out[newSrc->elems[i]+1]++;
+      in[newDest->elems[i]+1]++;
+    }
+    for (uint32_t n = 0; n < numNodes; n++) {
+      out[n+1] += out[n];
+      in[n+1] += in[n];
+    }
+
+    // Allocate new CSR arrays
+    NodeId* dest = (NodeId*) malloc(total * sizeof(NodeId));
+    PinId* pin = (PinId*) malloc(total * sizeof(PinId));
+    EdgeId* edge = (EdgeId*) malloc(total * sizeof(EdgeId));
+    NodeId* src = (NodeId*) malloc(total * sizeof(NodeId));
+    EdgeId* srcEdge = (EdgeId*) malloc(total * sizeof(EdgeId));
+
+    // Next free slot for each node
+    EdgeId* outNext = (EdgeId*) malloc(numNodes * sizeof(EdgeId));
+    EdgeId* inNext = (EdgeId*) malloc(numNodes * sizeof(EdgeId));
+
+    // Copy existing edges
+    for (uint32_t n = 0; n < numNodes; n++) {
+      outNext[n] = out[n];
+      inNext[n] = in[n];
+      if (n < numFinalNodes) {
+        uint32_t numOut = outOffset[n+1] - outOffset[n];
+        memcpy(&dest[out[n]], &outDest[outOffset[n]],
+          numOut * sizeof(NodeId));
+        memcpy(&pin[out[n]], &outPin[outOffset[n]],
+          numOut * sizeof(PinId));
+        memcpy(&edge[out[n]], &outEdge[outOffset[n]],
+          numOut * sizeof(EdgeId));
+        outNext[n] += numOut;
+        uint32_t numIn = inOffset[n+1] - inOffset[n];
+        memcpy(&src[in[n]], &inSrc[inOffset[n]], numIn * sizeof(NodeId));
+        memcpy(&srcEdge[in[n]], &inEdge[inOffset[n]],
+          numIn * sizeof(EdgeId));
+        inNext[n] += numIn;
+      }
+    }
+
+    // Add new edges
+    for (uint32_t i = 0; i < numNew; i++) {
+      NodeId x = newSrc->elems[i];
+      NodeId y = newDest->elems[i];
+      uint32_t o = outNext[x]++;
+      dest[o] = y;
+      pin[o] = newPin->elems[i];
+      edge[o] = numEdges + i;
+      uint32_t k = inNext[y]++;
+      src[k] = x;
+      srcEdge[k] = numEdges + i;
+    }
+    free(outNext);
+    free(inNext);
+
+    // Install new CSR arrays
+    free(outOffset); free(outDest); free(outPin); free(outEdge);
+    free(inOffset); free(inSrc); free(inEdge);
+    outOffset = out; outDest = dest; outPin = pin; outEdge = edge;
+    inOffset = in; inSrc = src; inEdge = srcEdge;
+    numEdges = total;
+    numFinalNodes = numNodes;
+
+    // Release the edge buffer
+    const uint32_t initialCapacity = 4096;
+    delete newSrc; newSrc = new Seq<NodeId> (initialCapacity);
+    delete newDest; newDest = new Seq<NodeId> (initialCapacity);
+    delete newPin; newPin = new Seq<PinId> (initialCapacity);
+  }
+
+  // Destinations of outgoing edges of given node
+  // (Only valid when the graph is final)
+  Slice<NodeId> outgoing(NodeId id) {
+    assert(isFinal());
+    Slice<NodeId> s;
+    s.elems = &outDest[outOffset[id]];
+    s.numElems = outOffset[id+1] - outOffset[id];
+    return s;
+  }
+
+  // Pins of outgoing edges of given node (same structure as outgoing)
+  // (Only valid when the graph is final)
+  Slice<PinId> pins(NodeId id) {
+    assert(isFinal());
+    Slice<PinId> s;
+    s.elems = &outPin[outOffset[id]];
+    s.numElems = outOffset[id+1] - outOffset[id];
+    return s;
+  }
+
+  // Ids of outgoing edges of given node (same structure as outgoing)
+  // (Only valid when the graph is final)
+  Slice<EdgeId> edgeIds(NodeId id) {
+    assert(isFinal());
+    Slice<EdgeId> s;
+    s.elems = &outEdge[outOffset[id]];
+    s.numElems = outOffset[id+1] - outOffset[id];
+    return s;
+  }
+
+  // Sources of incoming edges of given node
+  // (Only valid when the graph is final)
+  Slice<NodeId> incoming(NodeId id) {
+    assert(isFinal());
+    Slice<NodeId> s;
+    s.elems = &inSrc[inOffset[id]];
+    s.numElems = inOffset[id+1] - inOffset[id];
+    return s;
   }
 
-  // Add edge using given output pin
-  void addEdge(NodeId x, PinId p, NodeId y) {
-    outgoing->elems[x]->append(y);
-    pins->elems[x]->append(p);
-    incoming->elems[y]->append(x);
+  // Ids of incoming edges of given node (same structure as incoming)
+  // (Only valid when the graph is final)
+  Slice<EdgeId> incomingEdgeIds(NodeId id) {
+    assert(isFinal());
+    Slice<EdgeId> s;
+    s.elems = &inEdge[inOffset[id]];
+    s.numElems = inOffset[id+1] - inOffset[id];
+    return s;
   }
 
   // Determine max pin used by given node
   // (Returns -1 if node has no outgoing edges)
   PinId maxPin(NodeId x) {
+    finalise();
     int max = -1;
-    for (uint32_t i = 0; i < pins->elems[x]->numElems; i++) {
-      if (pins->elems[x]->elems[i] > max)
-        max = pins->elems[x]->elems[i];
+    Slice<PinId> p = pins(x);
+    for (uint32_t i = 0; i < p.numElems; i++) {
+      if (p.elems[i] > max)
+        max = p.elems[i];
     }
     return max;
   }
 
   // Determine fan-in of given node
   uint32_t fanIn(NodeId id) {
-    return incoming->elems[id]->numElems;
+    finalise();
+    return inOffset[id+1] - inOffset[id];
   }
 
   // Determine fan-out of given node
   uint32_t fanOut(NodeId id) {
-    return outgoing->elems[id]->numElems;
+    finalise();
+    return outOffset[id+1] - outOffset[id];
   }
 
 };
@@ -0,0 +1,282 @@
+// SPDX-License-Identifier: BSD-2-Clause
+#ifndef _HIERPLACER_H_
+#define _HIERPLACER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <POLite/Graph.h>
+#include <POLite/Placer.h>
+
+// Place a graph onto the threads of a mesh of boards, each containing a
+// mesh of mailboxes, each serving a fixed number of threads.
+//
+// Unlike nesting a Placer per board and per mailbox, the graph is
+// partitioned only once, into one part per thread, using Metis k-way.
+// The parts are then grouped into boards and mailboxes (and placed on
+// the board and mailbox meshes) by partitioning the much smaller
+// quotient graph, whose nodes are parts and whose edges carry the
+// traffic between them.  Finally, parts are swapped between threads
+// when that lowers a cost model in which traffic within a mailbox is
+// cheapest, traffic between mailboxes costs more per hop, and traffic
+// between boards costs most per hop.
+//
+// Threads are numbered by slot: the slot of thread t of the mailbox at
+// (boxX, boxY) of the board at (boardX, boardY) is
+//   ((boardY*boardsX + boardX)*boxesPerBoard +
+//      boxY*boxesX + boxX)*threadsPerBox + t
+struct HierPlacer {
+  // The graph being placed
+  Graph* graph;
+
+  // Dimensions of the hierarchy
+  uint32_t boardsX, boardsY;
+  uint32_t boxesX, boxesY;
+  uint32_t threadsPerBox;
+  uint32_t boxesPerBoard;
+  uint32_t numSlots;
+
+  // Relative cost of a unit of traffic between two threads in the same
+  // mailbox, per hop between mailboxes, and per hop between boards
+  uint32_t costThread, costBox, costBoard;
+
+  // Mapping from node id to part id
+  PartitionId* partitions;
+
+  // Mapping from part id to slot and back
+  uint32_t* slotOf;
+  PartitionId* partAt;
+
+  // Quotient graph: one node per part, and one edge per pair of
+  // communicating parts, weighted by the traffic between them
+  Graph quotient;
+
+  // Effort used when placing groups of parts on each mesh
+  uint32_t placerEffort;
+
+  // Max number of refinement passes
+  uint32_t maxRefinePasses;
+
+  // Slot of the given node
+  inline uint32_t slot(NodeId n) { return slotOf[partitions[n]]; }
+
+  // Decompose a slot into its coordinates in the hierarchy
+  inline uint32_t slotBoardX(uint32_t s) {
+    return (s / (threadsPerBox * boxesPerBoard)) % boardsX;
+  }
+  inline uint32_t slotBoardY(uint32_t s) {
+    return (s / (threadsPerBox * boxesPerBoard)) / boardsX;
+  }
+  inline uint32_t slotBoxX(uint32_t s) {
+    return ((s / threadsPerBox) % boxesPerBoard) % boxesX;
+  }
+  inline uint32_t slotBoxY(uint32_t s) {
+    return ((s / threadsPerBox) % boxesPerBoard) / boxesX;
+  }
+  inline uint32_t slotThread(uint32_t s) {
+    return s % threadsPerBox;
+  }
+
+  // Distance between two coordinates
+  static inline uint32_t dist(uint32_t a, uint32_t b) {
+    return a > b ? a - b : b - a;
+  }
+
+  // Cost of a unit of traffic between two slots
+  uint64_t slotCost(uint32_t a, uint32_t b) {
+    if (a == b) return 0;
+    uint32_t boardSize = threadsPerBox * boxesPerBoard;
+    if (a / boardSize != b / boardSize)
+      return (uint64_t) costBoard * (dist(slotBoardX(a), slotBoardX(b)) +
+                                     dist(slotBoardY(a), slotBoardY(b)));
+    if (a / threadsPerBox != b / threadsPerBox)
+      return (uint64_t) costBox * (dist(slotBoxX(a), slotBoxX(b)) +
+                                   dist(slotBoxY(a), slotBoxY(b)));
+    return costThread;
+  }
+
+  // Build the quotient graph from the partitioning
+  void computeQuotient() {
+    // Gather (source part, dest part) pairs for cut edges
+    struct Cut { uint64_t key; uint64_t weight; };
+    Seq<Cut> cuts;
+    for (uint32_t i = 0; i < graph->numNodes(); i++) {
+      Slice<NodeId> out = graph->outgoing(i);
+      Slice<EdgeId> ids = graph->edgeIds(i);
+      for (uint32_t j = 0; j < out.numElems; j++) {
+        PartitionId p = partitions[i];
+        PartitionId q = partitions[out.elems[j]];
+        if (p == q) continue;
+        Cut c;
+        c.key = ((uint64_t) p << 32) | q;
+        c.weight = graph->edgeWeight(ids.elems[j]);
+        cuts.append(c);
+      }
+    }
+
+    // Merge pairs and add an edge for each
+    std::sort(cuts.elems, cuts.elems + cuts.numElems,
+      [](const Cut& a, const Cut& b) { return a.key < b.key; });
+    for (uint32_t p = 0; p < numSlots; p++) quotient.newNode();
+    uint32_t i = 0;
+    while (i < cuts.numElems) {
+      uint64_t key = cuts.elems[i].key;
+      uint64_t weight = 0;
+      while (i < cuts.numElems && cuts.elems[i].key == key)
+        weight += cuts.elems[i++].weight;
+      EdgeId e = quotient.addEdge(key >> 32, 0, key & 0xffffffff);
+      quotient.setEdgeWeight(e, weight > ~0u ? ~0u : (uint32_t) weight);
+    }
+    quotient.finalise();
+  }
+
+  // Group parts into boards and mailboxes, and place the groups on the
+  // board and mailbox meshes
+  void groupParts() {
+    Placer boards(&quotient, boardsX, boardsY, boxesPerBoard*threadsPerBox);
+    boards.place(placerEffort);
+
+    #pragma omp parallel for collapse(2)
+    for (uint32_t boardY = 0; boardY < boardsY; boardY++) {
+      for (uint32_t boardX = 0; boardX < boardsX; boardX++) {
+        PartitionId b = boards.mapping[boardY][boardX];
+        Placer boxes(&boards.subgraphs[b], boxesX, boxesY, threadsPerBox);
+        boxes.place(placerEffort);
+        for (uint32_t boxY = 0; boxY < boxesY; boxY++) {
+          for (uint32_t boxX = 0; boxX < boxesX; boxX++) {
+            Graph* g = &boxes.subgraphs[boxes.mapping[boxY][boxX]];
+            uint32_t base = ((boardY*boardsX + boardX)*boxesPerBoard +
+                               boxY*boxesX + boxX) * threadsPerBox;
+            for (uint32_t t = 0; t < threadsPerBox; t++) {
+              PartitionId p = g->labels->elems[t];
+              slotOf[p] = base + t;
+              partAt[base + t] = p;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Change in cost from swapping the slots of parts p and r, given the
+  // undirected, weighted quotient adjacency
+  int64_t swapDelta(PartitionId p, PartitionId r,
+                    idx_t* xadj, idx_t* adjncy, idx_t* adjwgt) {
+    int64_t delta = 0;
+    PartitionId ps[2] = { p, r };
+    for (int k = 0; k < 2; k++) {
+      uint32_t from = slotOf[ps[k]];
+      uint32_t to = slotOf[ps[1-k]];
+      for (idx_t j = xadj[ps[k]]; j < xadj[ps[k]+1]; j++) {
+        PartitionId n = adjncy[j];
+        if (n == p || n == r) continue;
+        delta += (int64_t) adjwgt[j] *
+          ((int64_t) slotCost(to, slotOf[n]) -
+           (int64_t) slotCost(from, slotOf[n]));
+      }
+    }
+    return delta;
+  }
+
+  // Swap parts between threads while it lowers the cost: each part is
+  // tried in the mailboxes it has most traffic with, in exchange for a
+  // random part from that mailbox
+  void refine() {
+    idx_t* xadj = (idx_t*) calloc(numSlots+1, sizeof(idx_t));
+    idx_t* adjncy;
+    idx_t* adjwgt;
+    Placer::buildUndirectedAdjacency(&quotient, xadj, &adjncy, &adjwgt);
+
+    // Traffic from a part to each mailbox
+    uint32_t numBoxes = numSlots / threadsPerBox;
+    uint64_t* traffic = new uint64_t [numBoxes];
+
+    // Number of mailboxes tried per part
+    const uint32_t numTargets = 2;
+
+    unsigned int seed = 1;
+    for (uint32_t pass = 0; pass < maxRefinePasses; pass++) {
+      bool improved = false;
+      for (PartitionId p = 0; p < numSlots; p++) {
+        for (uint32_t b = 0; b < numBoxes; b++) traffic[b] = 0;
+        for (idx_t j = xadj[p]; j < xadj[p+1]; j++)
+          traffic[slotOf[adjncy[j]] / threadsPerBox] += adjwgt[j];
+        traffic[slotOf[p] / threadsPerBox] = 0;
+        for (uint32_t k = 0; k < numTargets; k++) {
+          // Find heaviest remaining mailbox
+          uint32_t box = 0;
+          for (uint32_t b = 1; b < numBoxes; b++)
+            if (traffic[b] > traffic[box]) box = b;
+          if (traffic[box] == 0) break;
+          traffic[box] = 0;
+          // Try swapping with a random part on that mailbox
+          uint32_t base = box * threadsPerBox;
+          PartitionId r = partAt[base + rand_r(&seed) % threadsPerBox];
+          if (swapDelta(p, r, xadj, adjncy, adjwgt) < 0) {
+            uint32_t s = slotOf[p];
+            slotOf[p] = slotOf[r]; partAt[slotOf[p]] = p;
+            slotOf[r] = s; partAt[s] = r;
+            improved = true;
+            break;
+          }
+        }
+      }
+      if (! improved) break;
+    }
+
+    delete [] traffic;
+    free(xadj);
+    free(adjncy);
+    free(adjwgt);
+  }
+
+  // Total cost of the current placement
+  uint64_t cost() {
+    uint64_t total = 0;
+    for (PartitionId p = 0; p < numSlots; p++) {
+      Slice<NodeId> out = quotient.outgoing(p);
+      Slice<EdgeId> ids = quotient.edgeIds(p);
+      for (uint32_t j = 0; j < out.numElems; j++)
+        total += quotient.edgeWeight(ids.elems[j]) *
+                   slotCost(slotOf[p], slotOf[out.elems[j]]);
+    }
+    return total;
+  }
+
+  // Constructor
+  HierPlacer(Graph* g, uint32_t bX, uint32_t bY, uint32_t mX, uint32_t mY,
+             uint32_t threads) {
+    graph = g;
+    g->finalise();
+    boardsX = bX; boardsY = bY;
+    boxesX = mX; boxesY = mY;
+    threadsPerBox = threads;
+    boxesPerBoard = boxesX * boxesY;
+    numSlots = boardsX * boardsY * boxesPerBoard * threadsPerBox;
+    costThread = 1;
+    costBox = 8;
+    costBoard = 64;
+    placerEffort = 8;
+    maxRefinePasses = 8;
+    partitions = new PartitionId [g->numNodes()];
+    slotOf = new uint32_t [numSlots];
+    partAt = new PartitionId [numSlots];
+  }
+
+  // Partition and place
+  void place() {
+    Placer::metisPartition(graph, numSlots, partitions, true);
+    computeQuotient();
+    groupParts();
+    refine();
+  }
+
+  // Deconstructor
+  ~HierPlacer() {
+    delete [] partitions;
+    delete [] slotOf;
+    delete [] partAt;
+  }
+};
+
+#endif
@@ -31,6 +31,34 @@
 #define POLITE_EDGES_PER_HEADER 6
 #endif
 
+// Opt-in message coalescing: when defined, payloads sent by devices on
+// the same thread to the same board-local mailbox and thread mask are
+// packed, up to POLITE_COALESCE at a time, into one multi-flit message,
+// saving a mailbox slot and a receive per payload.  Packs are sent when
+// full, or when the thread has nothing else to send.  Up to
+// POLITE_COALESCE_SLOTS destinations can have a pack open at once.
+#ifdef POLITE_COALESCE
+#ifndef POLITE_COALESCE_SLOTS
+#define POLITE_COALESCE_SLOTS 4
+#endif
+#endif
+
+// Scheduling policy for devices that are ready to send:
+//   POLITE_SENDERS_LIFO     - most recently ready device first (default)
+//   POLITE_SENDERS_FIFO     - least recently ready device first
+//   POLITE_SENDERS_PRIORITY - device with the lowest priority() first,
+//                             with priorities clamped to the range
+//                             0..POLITE_PRIORITY_BUCKETS-1
+#define POLITE_SENDERS_LIFO 0
+#define POLITE_SENDERS_FIFO 1
+#define POLITE_SENDERS_PRIORITY 2
+#ifndef POLITE_SENDERS
+#define POLITE_SENDERS POLITE_SENDERS_LIFO
+#endif
+#ifndef POLITE_PRIORITY_BUCKETS
+#define POLITE_PRIORITY_BUCKETS 16
+#endif
+
 // Macros for performance stats:
 //   POLITE_DUMP_STATS - dump performance stats on termination
 //   POLITE_COUNT_MSGS - include message counts in performance stats
@@ -61,6 +89,9 @@ inline PLocalDeviceId getLocalDeviceId(PDeviceAddr addr) { return addr >> 19; }
 // What's the max allowed local device address?
 inline uint32_t maxLocalDeviceId() { return 8192; }
 
+// Null local device id
+#define InvalidLocalDeviceId 0xffff
+
 // Local multicast key
 typedef uint16_t Key;
 #define InvalidKey 0xffff
@@ -95,6 +126,8 @@ template <typename S, typename E, typename M> struct PDevice {
   void recv(M* msg, E* edge);
   bool step();
   bool finish(volatile M* msg);
+  // Only needed with POLITE_SENDERS_PRIORITY
+  uint32_t priority();
 };
 
 // Generic device state structure
@@ -125,6 +158,24 @@ template <typename M> struct PMessage {
   M payload;
 };
 
+#ifdef POLITE_COALESCE
+// Destination key marking a packed message
+// (Keys must therefore be less than this value)
+#define PPackedKey 0x8000
+
+// Packed message structure
+template <typename M> struct PPackedMessage {
+  // Destination key (always PPackedKey)
+  uint16_t destKey;
+  // Number of payloads in the message
+  uint16_t numPayloads;
+  // Destination key of each payload
+  uint16_t keys[POLITE_COALESCE];
+  // Application messages
+  M payloads[POLITE_COALESCE];
+};
+#endif
+
 // An outgoing edge from a device
 struct POutEdge {
   // Destination mailbox
@@ -186,6 +237,20 @@ template <typename DeviceType,
   PTR(PLocalDeviceId) senders;
   // This array is accessed in a LIFO manner
   PTR(PLocalDeviceId) sendersTop;
+  #if POLITE_SENDERS == POLITE_SENDERS_FIFO
+  // Or as a ring buffer, from the head
+  uint32_t sendersHead;
+  #endif
+  #if POLITE_SENDERS == POLITE_SENDERS_PRIORITY
+  // Or as the links of one list per priority, from the head of each
+  PLocalDeviceId bucketHead[POLITE_PRIORITY_BUCKETS];
+  // No list below this one is non-empty
+  uint32_t minBucket;
+  #endif
+  #if POLITE_SENDERS != POLITE_SENDERS_LIFO
+  // Number of devices ready to send
+  uint32_t numSenders;
+  #endif
 
   // Count number of messages sent
   #ifdef POLITE_COUNT_MSGS
@@ -199,6 +264,11 @@ template <typename DeviceType,
 
   #ifdef TINSEL
 
+  #if POLITE_SENDERS == POLITE_SENDERS_LIFO
+
+  INLINE void senders_queue_init()
+  { sendersTop = senders; }
+
   INLINE bool senders_queue_empty() const
   { return senders==sendersTop; }
 
@@ -218,6 +288,78 @@ template <typename DeviceType,
     }
   }
 
+  #elif POLITE_SENDERS == POLITE_SENDERS_FIFO
+
+  // Each device is in the queue at most once, so a ring buffer of
+  // numDevices entries suffices
+
+  INLINE void senders_queue_init()
+  { sendersHead = numSenders = 0; }
+
+  INLINE bool senders_queue_empty() const
+  { return numSenders == 0; }
+
+  //! \pre: !senders_queue_empty()
+  PLocalDeviceId senders_queue_pop()
+  {
+    PLocalDeviceId id=senders[sendersHead];
+    sendersHead = sendersHead+1 == numDevices ? 0 : sendersHead+1;
+    numSenders--;
+    devices[id].isMarkedRTS=false;
+    return id;
+  }
+
+  void senders_queue_add(PLocalDeviceId id)
+  {
+    if(!devices[id].isMarkedRTS){
+      uint32_t tail = sendersHead + numSenders;
+      if (tail >= numDevices) tail -= numDevices;
+      senders[tail] = id;
+      numSenders++;
+      devices[id].isMarkedRTS=true;
+    }
+  }
+
+  #elif POLITE_SENDERS == POLITE_SENDERS_PRIORITY
+
+  // A device's priority is sampled when it is added to the queue
+
+  INLINE void senders_queue_init()
+  {
+    for (uint32_t i = 0; i < POLITE_PRIORITY_BUCKETS; i++)
+      bucketHead[i] = InvalidLocalDeviceId;
+    minBucket = numSenders = 0;
+  }
+
+  INLINE bool senders_queue_empty() const
+  { return numSenders == 0; }
+
+  //! \pre: !senders_queue_empty()
+  PLocalDeviceId senders_queue_pop()
+  {
+    while (bucketHead[minBucket] == InvalidLocalDeviceId) minBucket++;
+    PLocalDeviceId id=bucketHead[minBucket];
+    bucketHead[minBucket] = senders[id];
+    numSenders--;
+    devices[id].isMarkedRTS=false;
+    return id;
+  }
+
+  void senders_queue_add(PLocalDeviceId id)
+  {
+    if(!devices[id].isMarkedRTS){
+      uint32_t b = getDevice(id).priority();
+      if (b >= POLITE_PRIORITY_BUCKETS) b = POLITE_PRIORITY_BUCKETS-1;
+      senders[id] = bucketHead[b];
+      bucketHead[b] = id;
+      if (b < minBucket) minBucket = b;
+      numSenders++;
+      devices[id].isMarkedRTS=true;
+    }
+  }
+
+  #endif
+
   // Helper function to construct a device
   INLINE DeviceType getDevice(uint32_t id) {
     DeviceType dev;
@@ -261,6 +403,48 @@ template <typename DeviceType,
     #endif
   }
 
+  // Deliver a message payload to the receivers of the given key
+  INLINE void deliver(Key key, M* payload) {
+    PInHeader<E>* inHeader = &inTableHeaderBase[key];
+    // Determine number and location of edges/receivers
+    uint32_t numReceivers = inHeader->numReceivers;
+    PInEdge<E>* inEdge = inHeader->edges;
+    // For each receiver
+    for (uint32_t i = 0; i < numReceivers; i++) {
+      if (i == POLITE_EDGES_PER_HEADER)
+        inEdge = &inTableRestBase[inHeader->restIndex];
+      // Lookup destination device
+      PLocalDeviceId id = inEdge->devId;
+      DeviceType dev = getDevice(id);
+      // Invoke receive handler
+      dev.recv(payload, &inEdge->edge);
+      // Insert device into a senders array, if not already there
+      if (*dev.readyToSend != No) {
+        senders_queue_add(id);
+      }
+      inEdge++;
+      #ifdef POLITE_COUNT_MSGS
+      msgsReceived++;
+      #endif
+    }
+  }
+
+  #ifdef POLITE_COALESCE
+  // Copy a message into the send slot
+  // (Word by word, as there is no memcpy)
+  INLINE void copyToSlot(volatile void* slot, void* msg, uint32_t bytes) {
+    volatile uint32_t* dst = (volatile uint32_t*) slot;
+    uint32_t* src = (uint32_t*) msg;
+    for (uint32_t i = 0; i < bytes; i += 4) *dst++ = *src++;
+  }
+
+  // Are two out-edges to the same mailbox and threads?
+  INLINE bool sameDest(POutEdge* a, POutEdge* b) {
+    return a->mbox == b->mbox && a->threadMaskLow == b->threadMaskLow &&
+             a->threadMaskHigh == b->threadMaskHigh;
+  }
+  #endif
+
   // Invoke device handlers
   void run() {
     // Current out-going edge in multicast
@@ -277,11 +461,34 @@ template <typename DeviceType,
     // Did last call to step handler request a new time step?
     bool active = true;
 
+    #ifdef POLITE_COALESCE
+    static_assert(sizeof(PPackedMessage<M>) <= (1<<TinselLogBytesPerMsg),
+      "POLITE_COALESCE payloads do not fit in a message");
+    // Message lengths, in flits minus one
+    const int singleLen = (sizeof(PMessage<M>)-1) >> TinselLogBytesPerFlit;
+    const int packedLen =
+      (sizeof(PPackedMessage<M>)-1) >> TinselLogBytesPerFlit;
+    // Payload of the current multicast
+    union {
+      PMessage<M> msg;
+      uint32_t words[(sizeof(PMessage<M>)+3)/4];
+    } out;
+    // Open packs, oldest first, and their destinations
+    union {
+      PPackedMessage<M> msg;
+      uint32_t words[(sizeof(PPackedMessage<M>)+3)/4];
+    } packs[POLITE_COALESCE_SLOTS];
+    POutEdge packDests[POLITE_COALESCE_SLOTS];
+    uint32_t numPacks = 0;
+    // Pack to send next, if any
+    int flush = -1;
+    #endif
+
     // Reset performance counters
     tinselPerfCountReset();
 
     // Initialisation
-    sendersTop = senders;
+    senders_queue_init();
     for (uint32_t i = 0; i < numDevices; i++) {
       DeviceType dev = getDevice(i);
       // Invoke the initialiser for each device
@@ -299,9 +506,85 @@ template <typename DeviceType,
     // Event loop
     while (1) {
       // Step 1: try to send
+      #ifdef POLITE_COALESCE
+      if (flush >= 0) {
+        if (tinselCanSend()) {
+          // Send a pack, as an ordinary message if it holds one payload
+          PPackedMessage<M>* pack = &packs[flush].msg;
+          volatile void* slot = tinselSendSlot();
+          if (pack->numPayloads == 1) {
+            // (Built apart from 'out', which may hold a multicast
+            // that is still in progress)
+            union {
+              PMessage<M> msg;
+              uint32_t words[(sizeof(PMessage<M>)+3)/4];
+            } single;
+            single.msg.destKey = pack->keys[0];
+            single.msg.payload = pack->payloads[0];
+            copyToSlot(slot, single.words, sizeof(single));
+          }
+          else {
+            tinselSetLen(packedLen);
+            copyToSlot(slot, packs[flush].words, sizeof(packs[flush]));
+          }
+          POutEdge* dest = &packDests[flush];
+          tinselMulticast(dest->mbox, dest->threadMaskHigh,
+            dest->threadMaskLow, slot);
+          tinselSetLen(singleLen);
+          #ifdef POLITE_COUNT_MSGS
+          msgsSent++;
+          #endif
+          // Close the pack, keeping the rest in the order they were
+          // opened (so the oldest is always first)
+          numPacks--;
+          for (uint32_t p = flush; p < numPacks; p++) {
+            packDests[p] = packDests[p+1];
+            for (uint32_t i = 0; i < sizeof(packs[0])/4; i++)
+              packs[p].words[i] = packs[p+1].words[i];
+          }
+          flush = -1;
+        }
+        else {
+          #ifdef POLITE_COUNT_MSGS
+          blockedSends++;
+          #endif
+          tinselWaitUntil(TINSEL_CAN_SEND|TINSEL_CAN_RECV);
+        }
+      }
+      else if (outEdge->key != InvalidKey && outEdge != outHost &&
+                 outEdge->mbox != tinselUseRoutingKey()) {
+        // Add payload to the open pack for this destination
+        uint32_t p = 0;
+        while (p < numPacks && !sameDest(&packDests[p], outEdge)) p++;
+        if (p == numPacks && numPacks < POLITE_COALESCE_SLOTS) {
+          packDests[p] = *outEdge;
+          packs[p].msg.destKey = PPackedKey;
+          packs[p].msg.numPayloads = 0;
+          numPacks++;
+        }
+        if (p == numPacks) {
+          // No free pack: send the oldest
+          flush = 0;
+        }
+        else {
+          PPackedMessage<M>* pack = &packs[p].msg;
+          pack->keys[pack->numPayloads] = outEdge->key;
+          pack->payloads[pack->numPayloads] = out.msg.payload;
+          pack->numPayloads++;
+          if (pack->numPayloads == POLITE_COALESCE) flush = p;
+          outEdge++;
+        }
+      }
+      else
+      #endif
       if (outEdge->key != InvalidKey) {
         if (tinselCanSend()) {
           PMessage<M>* m = (PMessage<M>*) tinselSendSlot();
+          #ifdef POLITE_COALESCE
+          // The slot may have been used by a pack since the send handler
+          out.msg.destKey = outEdge->key;
+          copyToSlot(m, out.words, sizeof(out));
+          #endif
           // Send message
           m->destKey = outEdge->key;
           tinselMulticast(outEdge->mbox, outEdge->threadMaskHigh,
@@ -333,8 +616,12 @@ template <typename DeviceType,
             // We'll go back round the loop
           }else{
             // Invoke send handler
+            #ifdef POLITE_COALESCE
+            dev.send(&out.msg.payload);
+            #else
             PMessage<M>* m = (PMessage<M>*) tinselSendSlot();
             dev.send(&m->payload);
+            #endif
             // Reinsert sender, if it still wants to send
             if (*dev.readyToSend != No) {
               senders_queue_add(src);
@@ -356,6 +643,12 @@ template <typename DeviceType,
           tinselWaitUntil(TINSEL_CAN_SEND|TINSEL_CAN_RECV);
         }
       }
+      #ifdef POLITE_COALESCE
+      else if (numPacks > 0) {
+        // Nothing else to send: send open packs
+        flush = numPacks-1;
+      }
+      #endif
       else {
         // Idle detection
         int idle = tinselIdle(!active);
@@ -379,28 +672,16 @@ template <typename DeviceType,
       // Step 2: try to receive
       while (tinselCanRecv()) {
         PMessage<M>* inMsg = (PMessage<M>*) tinselRecv();
-        PInHeader<E>* inHeader = &inTableHeaderBase[inMsg->destKey];
-        // Determine number and location of edges/receivers
-        uint32_t numReceivers = inHeader->numReceivers;
-        PInEdge<E>* inEdge = inHeader->edges;
-        // For each receiver
-        for (uint32_t i = 0; i < numReceivers; i++) {
-          if (i == POLITE_EDGES_PER_HEADER)
-            inEdge = &inTableRestBase[inHeader->restIndex];
-          // Lookup destination device
-          PLocalDeviceId id = inEdge->devId;
-          DeviceType dev = getDevice(id);
-          // Invoke receive handler
-          dev.recv(&inMsg->payload, &inEdge->edge);
-          // Insert device into a senders array, if not already there
-          if (*dev.readyToSend != No) {
-            senders_queue_add(id);
-          }
-          inEdge++;
-          #ifdef POLITE_COUNT_MSGS
-          msgsReceived++;
-          #endif
+        #ifdef POLITE_COALESCE
+        if (inMsg->destKey == PPackedKey) {
+          // Unpack payloads
+          PPackedMessage<M>* pack = (PPackedMessage<M>*) inMsg;
+          for (uint32_t i = 0; i < pack->numPayloads; i++)
+            deliver(pack->keys[i], &pack->payloads[i]);
         }
+        else
+        #endif
+        deliver(inMsg->destKey, &inMsg->payload);
         tinselFree(inMsg);
       }
     }
@@ -6,15 +6,18 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
 #include <HostLink.h>
 #include <config.h>
 #include <POLite.h>
 #include <POLite/Seq.h>
 #include <POLite/Graph.h>
 #include <POLite/Placer.h>
+#include <POLite/HierPlacer.h>
 #include <POLite/Bitmap.h>
 #include <POLite/ProgRouters.h>
 #include <type_traits>
+#include <algorithm>
 #include <tinsel-interface.h>
 
 // Nodes of a POETS graph are devices
@@ -31,7 +34,7 @@ template <typename E> struct PReceiverGroup {
 
 // This structure holds info about an edge destination
 struct PEdgeDest {
-  // Index of edge in outgoing edge list
+  // Id of edge in graph (used to look up its label)
   uint32_t index;
   // Destination device
   PDeviceId dest;
@@ -39,6 +42,52 @@ struct PEdgeDest {
   PDeviceAddr addr;
 };
 
+// A run of edge destinations, all from the same device pin and all on
+// the same mailbox.  Each run yields one multicast routing record.
+struct PMailboxRun {
+  // Destination mailbox
+  uint32_t mbox;
+  // Index of first destination in the chunk, and number of destinations
+  uint32_t start;
+  uint32_t size;
+  // Number of distinct threads among the destinations
+  uint32_t numThreads;
+  // Routing record (valid once keys have been allocated)
+  PRoutingDestMRM mrm;
+};
+
+// Routing work for a contiguous range of devices
+// (Used internally by the routing-table computation)
+struct PRoutingChunk {
+  // Destinations of each (device, pin) pair in turn, split into runs
+  Seq<PEdgeDest> dests;
+  Seq<PMailboxRun> runs;
+  // Indices of runs, grouped by mailbox: the runs to mailbox m are
+  // mboxRuns[mboxStart[m]] up to mboxRuns[mboxStart[m+1]]
+  uint32_t* mboxStart;
+  uint32_t* mboxRuns;
+
+  PRoutingChunk() {
+    mboxStart = NULL;
+    mboxRuns = NULL;
+  }
+
+  ~PRoutingChunk() {
+    if (mboxStart) free(mboxStart);
+    if (mboxRuns) free(mboxRuns);
+  }
+};
+
+// A contiguous region of tinsel memory to be written via a core's
+// boot loader when uploading a graph
+struct PUploadSegment {
+  // Tinsel address of region
+  uint32_t base;
+  // Host copy of region, and its size in bytes (a multiple of 4)
+  uint8_t* data;
+  uint32_t size;
+};
+
 // Comparison function for PEdgeDest
 // (Useful to sort destinations by thread id of destination)
 inline int cmpEdgeDest(const void* e0, const void* e1) {
@@ -47,6 +96,22 @@ inline int cmpEdgeDest(const void* e0, const void* e1) {
   return getThreadId(d0->addr) < getThreadId(d1->addr);
 }
 
+// Memory footprint of a thread's partition, in bytes
+struct PThreadFootprint {
+  // Initialised size of each region
+  uint32_t vertex, thread, inHeader, inRest, out;
+  // Total size of vertex region, including uninitialised portion
+  uint32_t totalVertex;
+  // Total SRAM and DRAM used
+  uint32_t sram, dram;
+  // Where each region is placed
+  bool vertexInDRAM, inHeaderInDRAM, inRestInDRAM, outInDRAM;
+};
+
+// Mapping cache file format identifiers
+#define PGraphMapCacheMagic 0x4d504f50
+#define PGraphMapCacheVersion 1
+
 // POETS graph
 template <typename DeviceType,
           typename S, typename E, typename M> class PGraph {
@@ -89,10 +154,6 @@ template <typename DeviceType,
   // Programmable routing tables
   ProgRouterMesh* progRouterTables;
 
-  // Receiver groups (used internally by some methods, but declared once
-  // to avoid repeated allocation)
-  PReceiverGroup<E> groups[TinselThreadsPerMailbox];
-
   // Generic constructor
   void constructor(uint32_t lenX, uint32_t lenY) {
     meshLenX = lenX;
@@ -123,6 +184,7 @@ template <typename DeviceType,
     mapInEdgeHeadersToDRAM = true;
     mapInEdgeRestToDRAM = true;
     mapOutEdgesToDRAM = true;
+    autoMapRegions = false;
     outTable = NULL;
     inTableHeaders = NULL;
     inTableRest = NULL;
@@ -142,8 +204,14 @@ template <typename DeviceType,
   // Graph containing device ids and connections
   Graph graph;
 
-  // Edge labels: has same structure as graph.outgoing
-  Seq<Seq<E>*> edgeLabels;
+  // Edge labels, indexed by edge id
+  // (Not stored when edges are unlabelled)
+  Seq<E> edgeLabels;
+
+  // Traffic weight of each device pin, indexed by device id times
+  // POLITE_NUM_PINS plus pin, where 0 means not set
+  // (Not stored unless setPinWeight() is used)
+  Seq<uint32_t> pinWeights;
 
   // Mapping from device id to device state
   // (Not valid until the mapper is called)
@@ -180,6 +248,10 @@ template <typename DeviceType,
   bool mapInEdgeRestToDRAM;
   bool mapOutEdgesToDRAM;
 
+  // Decide per thread which edge regions to map to SRAM, overriding
+  // the above flags for edge regions (see placeRegions())
+  bool autoMapRegions;
+
   // Allow mapper to print useful information to stdout
   uint32_t chatty;
 
@@ -196,7 +268,6 @@ template <typename DeviceType,
 
   // Create new device
   inline PDeviceId newDevice() {
-    edgeLabels.append(new SmallSeq<E>);
     numDevices++;
     return graph.newNode();
   }
@@ -208,23 +279,302 @@ template <typename DeviceType,
       exit(EXIT_FAILURE);
     }
     graph.addEdge(from, pin, to);
-    E edge;
-    edgeLabels.elems[from]->append(edge);
+    if (! std::is_same<E, None>::value) {
+      E edge;
+      edgeLabels.append(edge);
+    }
   }
 
   // Add labelled edge using given output pin
   void addLabelledEdge(E edge, PDeviceId x, PinId pin, PDeviceId y) {
     graph.addEdge(x, pin, y);
-    edgeLabels.elems[x]->append(edge);
+    if (! std::is_same<E, None>::value)
+      edgeLabels.append(edge);
+  }
+
+  // Set the relative compute cost of a device (default 1), which the
+  // mapper uses to balance load between threads, mailboxes and boards
+  void setDeviceWeight(PDeviceId id, uint32_t weight) {
+    graph.setNodeWeight(id, weight);
+  }
+
+  // Set the relative message rate of a device's output pin (default 1),
+  // which the mapper uses to keep heavy traffic local.  This sets the
+  // weight of every edge from the pin.
+  void setPinWeight(PDeviceId id, PinId pin, uint32_t weight) {
+    if (pin >= POLITE_NUM_PINS || weight == 0) {
+      printf("setPinWeight: invalid pin or zero weight\n");
+      exit(EXIT_FAILURE);
+    }
+    uint32_t i = id * POLITE_NUM_PINS + pin;
+    while (pinWeights.numElems <= i) pinWeights.append(0);
+    pinWeights.elems[i] = weight;
+  }
+
+  // Apply pin weights to the edges of the (final) graph
+  void applyPinWeights() {
+    uint32_t numWeighted = pinWeights.numElems / POLITE_NUM_PINS;
+    for (uint32_t d = 0; d < numWeighted && d < graph.numNodes(); d++) {
+      Slice<PinId> pins = graph.pins(d);
+      Slice<EdgeId> ids = graph.edgeIds(d);
+      for (uint32_t i = 0; i < pins.numElems; i++) {
+        uint32_t w = pinWeights.elems[d * POLITE_NUM_PINS + pins.elems[i]];
+        if (w != 0) graph.setEdgeWeight(ids.elems[i], w);
+      }
+    }
+  }
+
+  // Decide a maximum partition size that is reasonable
+  // SRAM: Partition size minus 2048 bytes for the stack
+  uint32_t maxSRAMPartitionSize() {
+    return (1<<TinselLogBytesPerSRAMPartition) - 2048;
+  }
+  // DRAM: Partition size minus 65536 bytes for the stack
+  uint32_t maxDRAMPartitionSize() {
+    return (1<<TinselLogBytesPerDRAMPartition) - 65536;
+  }
+
+  // Measure the memory footprint of a thread's partition
+  // (Only valid after routing tables have been computed)
+  PThreadFootprint footprint(uint32_t threadId) {
+    PThreadFootprint f;
+    // Add space for thread structure (always stored in SRAM)
+    f.thread = cacheAlign(sizeof(PThread<DeviceType, S, E, M>));
+    // Add space for devices
+    uint32_t numDevs = numDevicesOnThread[threadId];
+    f.vertex = numDevs * sizeof(PState<S>);
+    // Add space for incoming edge tables
+    f.inHeader = f.inRest = 0;
+    if (inTableHeaders[threadId]) {
+      f.inHeader = inTableHeaders[threadId]->numElems *
+                     sizeof(PInHeader<E>);
+      f.inHeader = wordAlign(f.inHeader);
+    }
+    if (inTableRest[threadId]) {
+      f.inRest = inTableRest[threadId]->numElems * sizeof(PInEdge<E>);
+      f.inRest = wordAlign(f.inRest);
+    }
+    // Add space for outgoing edge table
+    f.out = 0;
+    for (uint32_t devNum = 0; devNum < numDevs; devNum++) {
+      PDeviceId id = fromDeviceAddr[threadId][devNum];
+      for (uint32_t p = 0; p < POLITE_NUM_PINS; p++) {
+        Seq<POutEdge>* edges = outTable[id][p];
+        f.out += sizeof(POutEdge) * edges->numElems;
+      }
+    }
+    f.out = wordAlign(f.out);
+    // The total partition size including uninitialised portions
+    f.totalVertex = f.vertex + wordAlign(sizeof(PLocalDeviceId) * numDevs);
+    // Decide where each region goes
+    f.vertexInDRAM = mapVerticesToDRAM;
+    f.inHeaderInDRAM = mapInEdgeHeadersToDRAM;
+    f.inRestInDRAM = mapInEdgeRestToDRAM;
+    f.outInDRAM = mapOutEdgesToDRAM;
+    if (autoMapRegions) placeRegions(threadId, &f);
+    // Total SRAM and DRAM usage
+    f.sram = f.thread;
+    f.dram = 0;
+    if (f.vertexInDRAM) f.dram += f.totalVertex;
+                   else f.sram += f.totalVertex;
+    if (f.inHeaderInDRAM) f.dram += f.inHeader;
+                     else f.sram += f.inHeader;
+    if (f.inRestInDRAM) f.dram += f.inRest;
+                   else f.sram += f.inRest;
+    if (f.outInDRAM) f.dram += f.out;
+                else f.sram += f.out;
+    return f;
+  }
+
+  // Fill the SRAM left over by the thread structure and vertices with
+  // the edge regions that the thread accesses most per byte, spilling
+  // the rest to DRAM.  Accesses are estimated from the thread's routing
+  // tables: every received message reads its header, and every edge
+  // delivered reads an in-edge from the header or the rest region;
+  // every message sent reads one out-edge per destination.  Ties go to
+  // the in-edge headers, then the out-edges, then the in-edge rest.
+  void placeRegions(uint32_t threadId, PThreadFootprint* f) {
+    // Estimate accesses to each region
+    uint64_t numHeaders = inTableHeaders[threadId] ?
+      inTableHeaders[threadId]->numElems : 0;
+    uint64_t numRest = inTableRest[threadId] ?
+      inTableRest[threadId]->numElems : 0;
+    uint64_t numIn = 0;
+    for (uint32_t i = 0; i < numDevicesOnThread[threadId]; i++)
+      numIn += graph.fanIn(fromDeviceAddr[threadId][i]);
+    uint64_t numInline = numIn > numRest ? numIn - numRest : 0;
+    const uint32_t numRegions = 3;
+    uint64_t accesses[numRegions] = {
+      numHeaders + numInline, f->out / sizeof(POutEdge), numRest };
+    uint32_t bytes[numRegions] = { f->inHeader, f->out, f->inRest };
+    bool* inDRAM[numRegions] =
+      { &f->inHeaderInDRAM, &f->outInDRAM, &f->inRestInDRAM };
+
+    // Order regions by accesses per byte
+    uint32_t order[numRegions] = { 0, 1, 2 };
+    std::stable_sort(order, order + numRegions, [&](uint32_t a, uint32_t b) {
+      return accesses[a] * bytes[b] > accesses[b] * bytes[a]; });
+
+    // Fill SRAM in that order
+    uint32_t used = f->thread + (f->vertexInDRAM ? 0 : f->totalVertex);
+    uint32_t limit = maxSRAMPartitionSize();
+    for (uint32_t i = 0; i < numRegions; i++) {
+      uint32_t r = order[i];
+      *inDRAM[r] = true;
+      if (bytes[r] == 0) continue;
+      if (used <= limit && bytes[r] <= limit - used) {
+        *inDRAM[r] = false;
+        used += bytes[r];
+      }
+    }
+  }
+
+  // Estimate the SRAM and DRAM that a device contributes to the
+  // footprint of its thread
+  void deviceFootprint(PDeviceId d, uint32_t* sram, uint32_t* dram) {
+    uint32_t vertex = sizeof(PState<S>) + sizeof(PLocalDeviceId);
+    uint32_t in = graph.fanIn(d) * sizeof(PInEdge<E>);
+    uint32_t out = 0;
+    for (uint32_t p = 0; p < POLITE_NUM_PINS; p++)
+      out += outTable[d][p]->numElems * sizeof(POutEdge);
+    *sram = *dram = 0;
+    if (mapVerticesToDRAM) *dram += vertex; else *sram += vertex;
+    // (Automatically placed regions can always spill to DRAM)
+    if (mapInEdgeRestToDRAM || autoMapRegions) *dram += in;
+      else *sram += in;
+    if (mapOutEdgesToDRAM || autoMapRegions) *dram += out;
+      else *sram += out;
+  }
+
+  // Move devices off threads whose partitions exceed the SRAM or DRAM
+  // limits, onto other threads in the same mailbox (so that the
+  // mailbox-level routing is unaffected).  Routing tables are rebuilt
+  // after each round of moves, and footprints remeasured.
+  void balanceThreadLoads() {
+    const uint32_t maxRounds = 4;
+    const uint32_t threadsPerMailbox = 1 << TinselLogThreadsPerMailbox;
+    uint32_t maxSRAM = maxSRAMPartitionSize();
+    uint32_t maxDRAM = maxDRAMPartitionSize();
+    uint32_t sram[threadsPerMailbox], dram[threadsPerMailbox];
+
+    for (uint32_t round = 0; round < maxRounds; round++) {
+      uint32_t numMoved = 0;
+      for (uint32_t base = 0; base < TinselMaxThreads;
+             base += threadsPerMailbox) {
+        // Measure threads on this mailbox
+        bool over = false;
+        for (uint32_t i = 0; i < threadsPerMailbox; i++) {
+          sram[i] = dram[i] = 0;
+          if (numDevicesOnThread[base+i] == 0) continue;
+          PThreadFootprint f = footprint(base+i);
+          sram[i] = f.sram;
+          dram[i] = f.dram;
+          over = over || sram[i] > maxSRAM || dram[i] > maxDRAM;
+        }
+        if (! over) continue;
+
+        // Move devices from the end of each overloaded thread to the
+        // thread with the most headroom that can take them
+        for (uint32_t i = 0; i < threadsPerMailbox; i++) {
+          uint32_t from = base+i;
+          while ((sram[i] > maxSRAM || dram[i] > maxDRAM) &&
+                   numDevicesOnThread[from] > 0) {
+            PDeviceId d = fromDeviceAddr[from][numDevicesOnThread[from]-1];
+            uint32_t ds, dd;
+            deviceFootprint(d, &ds, &dd);
+            int best = -1;
+            uint64_t bestRoom = 0;
+            for (uint32_t j = 0; j < threadsPerMailbox; j++) {
+              if (j == i || sram[j] + ds > maxSRAM ||
+                    dram[j] + dd > maxDRAM ||
+                    numDevicesOnThread[base+j]+1 >= maxLocalDeviceId())
+                continue;
+              uint64_t room = (uint64_t) (maxSRAM - sram[j] - ds) +
+                                (maxDRAM - dram[j] - dd);
+              if (best < 0 || room > bestRoom) {
+                best = j;
+                bestRoom = room;
+              }
+            }
+            if (best < 0) break;
+            // Move device
+            uint32_t to = base+best;
+            numDevicesOnThread[from]--;
+            uint32_t n = numDevicesOnThread[to]++;
+            fromDeviceAddr[to] = (PDeviceId*)
+              realloc(fromDeviceAddr[to], sizeof(PDeviceId) * (n+1));
+            fromDeviceAddr[to][n] = d;
+            toDeviceAddr[d] = makeDeviceAddr(to, n);
+            // The thread structure stays behind on an emptied thread
+            sram[i] = sram[i] > ds ? sram[i] - ds : 0;
+            dram[i] = dram[i] > dd ? dram[i] - dd : 0;
+            if (sram[best] == 0)
+              sram[best] = cacheAlign(sizeof(PThread<DeviceType, S, E, M>));
+            sram[best] += ds;
+            dram[best] += dd;
+            numMoved++;
+          }
+        }
+      }
+      if (numMoved == 0) break;
+      if (chatty > 0)
+        printf("POLite load balancer: moved %u devices\n", numMoved);
+
+      // Rebuild routing tables
+      releaseRoutingTables();
+      allocateRoutingTables();
+      computeRoutingTables();
+    }
+  }
+
+  // Display a histogram of thread partition usage, as a percentage of
+  // the SRAM or DRAM limit (whichever is more heavily used)
+  void printLoadReport() {
+    const uint32_t numBuckets = 11;
+    uint32_t hist[numBuckets];
+    for (uint32_t b = 0; b < numBuckets; b++) hist[b] = 0;
+    uint32_t maxSRAM = maxSRAMPartitionSize();
+    uint32_t maxDRAM = maxDRAMPartitionSize();
+    uint32_t worstThread = 0;
+    double worst = 0;
+    for (uint32_t t = 0; t < TinselMaxThreads; t++) {
+      if (numDevicesOnThread[t] == 0) continue;
+      PThreadFootprint f = footprint(t);
+      double use = (double) f.sram / maxSRAM;
+      if ((double) f.dram / maxDRAM > use) use = (double) f.dram / maxDRAM;
+      // (The last band holds only overflowing threads)
+      uint32_t b = (uint32_t) (use * 10);
+      if (b >= numBuckets-1) b = use > 1.0 ? numBuckets-1 : numBuckets-2;
+      hist[b]++;
+      if (use > worst) { worst = use; worstThread = t; }
+    }
+    printf("POLite thread memory usage (threads per band):\n");
+    for (uint32_t b = 0; b < numBuckets; b++) {
+      if (b < numBuckets-1)
+        printf("  %3u-%3u%%: %u\n", b*10, b*10+10, hist[b]);
+      else
+        printf("     >100%%: %u\n", hist[b]);
+    }
+    printf("  Most used: thread %u at %.1lf%%\n", worstThread, worst*100);
+    if (autoMapRegions) {
+      uint32_t inSRAM[3] = { 0, 0, 0 };
+      for (uint32_t t = 0; t < TinselMaxThreads; t++) {
+        if (numDevicesOnThread[t] == 0) continue;
+        PThreadFootprint f = footprint(t);
+        inSRAM[0] += !f.inHeaderInDRAM;
+        inSRAM[1] += !f.outInDRAM;
+        inSRAM[2] += !f.inRestInDRAM;
+      }
+      printf("POLite threads with region in SRAM: in-edge headers %u, "
+             "out-edges %u, in-edge rest %u\n",
+             inSRAM[0], inSRAM[1], inSRAM[2]);
+    }
   }
 
   // Allocate SRAM and DRAM partitions
   void allocatePartitions() {
-    // Decide a maximum partition size that is reasonable
-    // SRAM: Partition size minus 2048 bytes for the stack
-    uint32_t maxSRAMSize = (1<<TinselLogBytesPerSRAMPartition) - 2048;
-    // DRAM: Partition size minus 65536 bytes for the stack
-    uint32_t maxDRAMSize = (1<<TinselLogBytesPerDRAMPartition) - 65536;
+    uint32_t maxSRAMSize = maxSRAMPartitionSize();
+    uint32_t maxDRAMSize = maxDRAMPartitionSize();
     // Allocate partition sizes and bases
     vertexMem = (uint8_t**) calloc(TinselMaxThreads, sizeof(uint8_t*));
     vertexMemSize = (uint32_t*) calloc(TinselMaxThreads, sizeof(uint32_t));
@@ -245,63 +595,34 @@ template <typename DeviceType,
     outEdgeMemBase = (uint32_t*) calloc(TinselMaxThreads, sizeof(uint32_t));
     // Compute partition sizes for each thread
     for (uint32_t threadId = 0; threadId < TinselMaxThreads; threadId++) {
-      // This variable is used to count the size of the *initialised*
-      // partition.  The total partition size is larger as it includes
-      // uninitialised portions.
-      uint32_t sizeVMem = 0;
-      uint32_t sizeEIHeaderMem = 0;
-      uint32_t sizeEIRestMem = 0;
-      uint32_t sizeEOMem = 0;
-      uint32_t sizeTMem = 0;
-      // Add space for thread structure (always stored in SRAM)
-      sizeTMem = cacheAlign(sizeof(PThread<DeviceType, S, E, M>));
-      // Add space for devices
-      uint32_t numDevs = numDevicesOnThread[threadId];
-      for (uint32_t devNum = 0; devNum < numDevs; devNum++) {
-        // Add space for device
-        sizeVMem = sizeVMem + sizeof(PState<S>);
-      }
-      // Add space for incoming edge tables
-      if (inTableHeaders[threadId]) {
-        sizeEIHeaderMem = inTableHeaders[threadId]->numElems *
-                            sizeof(PInHeader<E>);
-        sizeEIHeaderMem = wordAlign(sizeEIHeaderMem);
-      }
-      if (inTableRest[threadId]) {
-        sizeEIRestMem = inTableRest[threadId]->numElems * sizeof(PInEdge<E>);
-        sizeEIRestMem = wordAlign(sizeEIRestMem);
-      }
-      // Add space for outgoing edge table
-      for (uint32_t devNum = 0; devNum < numDevs; devNum++) {
-        PDeviceId id = fromDeviceAddr[threadId][devNum];
-        for (uint32_t p = 0; p < POLITE_NUM_PINS; p++) {
-          Seq<POutEdge>* edges = outTable[id][p];
-          sizeEOMem += sizeof(POutEdge) * edges->numElems;
-        }
-      }
-      sizeEOMem = wordAlign(sizeEOMem);
-      // The total partition size including uninitialised portions
-      uint32_t totalSizeVMem =
-        sizeVMem + wordAlign(sizeof(PLocalDeviceId) * numDevs);
+      // Measure the partition
+      PThreadFootprint f = footprint(threadId);
+      uint32_t sizeVMem = f.vertex;
+      uint32_t sizeEIHeaderMem = f.inHeader;
+      uint32_t sizeEIRestMem = f.inRest;
+      uint32_t sizeEOMem = f.out;
+      uint32_t sizeTMem = f.thread;
+      uint32_t totalSizeVMem = f.totalVertex;
       // Check that total size is reasonable
-      uint32_t totalSizeSRAM = sizeTMem;
-      uint32_t totalSizeDRAM = 0;
-      if (mapVerticesToDRAM) totalSizeDRAM += totalSizeVMem;
-                        else totalSizeSRAM += totalSizeVMem;
-      if (mapInEdgeHeadersToDRAM) totalSizeDRAM += sizeEIHeaderMem;
-                             else totalSizeSRAM += sizeEIHeaderMem;
-      if (mapInEdgeRestToDRAM) totalSizeDRAM += sizeEIRestMem;
-                          else totalSizeSRAM += sizeEIRestMem;
-      if (mapOutEdgesToDRAM) totalSizeDRAM += sizeEOMem;
-                        else totalSizeSRAM += sizeEOMem;
-      if (totalSizeDRAM > maxDRAMSize) {
-        printf("Error: max DRAM partition size exceeded\n");
+      if (f.dram > maxDRAMSize) {
+        printf("Error: max DRAM partition size exceeded on thread %u "
+               "(%u bytes, limit %u)\n", threadId, f.dram, maxDRAMSize);
+        exit(EXIT_FAILURE);
+      }
+      if (f.sram > maxSRAMSize) {
+        printf("Error: max SRAM partition size exceeded on thread %u "
+               "(%u bytes, limit %u)\n", threadId, f.sram, maxSRAMSize);
         exit(EXIT_FAILURE);
       }
-      if (totalSizeSRAM > maxSRAMSize) {
-        printf("Error: max SRAM partition size exceeded\n");
+      #ifdef POLITE_COALESCE
+      // Keys from PPackedKey upwards mark packed messages
+      if (inTableHeaders[threadId] &&
+            inTableHeaders[threadId]->numElems > PPackedKey) {
+        printf("Error: too many routing keys for POLITE_COALESCE "
+               "on thread %u\n", threadId);
         exit(EXIT_FAILURE);
       }
+      #endif
       // Allocate space for the initialised portion of the partition
       assert((sizeVMem%4) == 0);
       assert((sizeTMem%4) == 0);
@@ -329,7 +650,7 @@ template <typename DeviceType,
       threadMemBase[threadId] = sramBase;
       sramBase += threadMemSize[threadId];
       // Determine base addresses of each region
-      if (mapVerticesToDRAM) {
+      if (f.vertexInDRAM) {
         vertexMemBase[threadId] = dramBase;
         dramBase += totalSizeVMem;
       }
@@ -337,7 +658,7 @@ template <typename DeviceType,
         vertexMemBase[threadId] = sramBase;
         sramBase += totalSizeVMem;
       }
-      if (mapInEdgeHeadersToDRAM) {
+      if (f.inHeaderInDRAM) {
         inEdgeHeaderMemBase[threadId] = dramBase;
         dramBase += sizeEIHeaderMem;
       }
@@ -345,7 +666,7 @@ template <typename DeviceType,
         inEdgeHeaderMemBase[threadId] = sramBase;
         sramBase += sizeEIHeaderMem;
       }
-      if (mapInEdgeRestToDRAM) {
+      if (f.inRestInDRAM) {
         inEdgeRestMemBase[threadId] = dramBase;
         dramBase += sizeEIRestMem;
       }
@@ -353,7 +674,7 @@ template <typename DeviceType,
         inEdgeRestMemBase[threadId] = sramBase;
         sramBase += sizeEIRestMem;
       }
-      if (mapOutEdgesToDRAM) {
+      if (f.outInDRAM) {
         outEdgeMemBase[threadId] = dramBase;
         dramBase += sizeEOMem;
       }
@@ -481,7 +802,7 @@ template <typename DeviceType,
 
   // Determine local-multicast routing key for given set of receivers
   // (The key must be the same for all receivers)
-  uint32_t findKey(uint32_t numGroups) { 
+  uint32_t findKey(PReceiverGroup<E>* groups, uint32_t numGroups) {
     // Fast path (single receiver)
     if (numGroups == 1) {
       Bitmap* bm = inTableBitmaps[groups[0].threadId];
@@ -519,8 +840,8 @@ template <typename DeviceType,
 
   // Add entries to the input tables for the given receivers
   // (Only valid after mapper is called)
-  uint32_t addInTableEntries(uint32_t numGroups) {
-    uint32_t key = findKey(numGroups);
+  uint32_t addInTableEntries(PReceiverGroup<E>* groups, uint32_t numGroups) {
+    uint32_t key = findKey(groups, numGroups);
     if (key >= 0xffff) {
       printf("Routing key exceeds 16 bits\n");
       exit(EXIT_FAILURE);
@@ -535,8 +856,11 @@ template <typename DeviceType,
         uint32_t t = g->threadId;
         // Extend table
         Seq<PInHeader<E>>* headers = inTableHeaders[t];
-        if (key >= headers->numElems)
-          headers->extendBy(key + 1 - headers->numElems);
+        if (key >= headers->numElems) {
+          uint32_t n = headers->numElems;
+          headers->extendBy(key + 1 - n);
+          memset(&headers->elems[n], 0, (key + 1 - n) * sizeof(PInHeader<E>));
+        }
         // Fill in header
         PInHeader<E>* header = &inTableHeaders[t]->elems[key];
         header->numReceivers = numEdges;
@@ -572,13 +896,14 @@ template <typename DeviceType,
     PDeviceAddr devAddr = toDeviceAddr[devId];
     uint32_t devBoard = getThreadId(devAddr) >> TinselLogThreadsPerBoard;
     // Split destinations into local/non-local
-    Seq<PDeviceId>* dests = graph.outgoing->elems[devId];
-    Seq<PinId>* pinIds = graph.pins->elems[devId];
-    for (uint32_t d = 0; d < dests->numElems; d++) {
-      if (pinIds->elems[d] == pinId) {
+    Slice<PDeviceId> dests = graph.outgoing(devId);
+    Slice<PinId> pinIds = graph.pins(devId);
+    Slice<EdgeId> edgeIds = graph.edgeIds(devId);
+    for (uint32_t d = 0; d < dests.numElems; d++) {
+      if (pinIds.elems[d] == pinId) {
         PEdgeDest e;
-        e.index = d;
-        e.dest = dests->elems[d];
+        e.index = edgeIds.elems[d];
+        e.dest = dests.elems[d];
         e.addr = toDeviceAddr[e.dest];
         uint32_t destBoard = getThreadId(e.addr) >> TinselLogThreadsPerBoard;
         if (devBoard == destBoard)
@@ -593,117 +918,259 @@ template <typename DeviceType,
     qsort(nonLocal->elems, nonLocal->numElems, sizeof(PEdgeDest), cmpEdgeDest);
   }
 
-  // Compute table updates for destinations for given device
+  // Group the receivers in a run of destinations (all on the same
+  // mailbox) by thread, and add entries to the receivers' input tables
   // (Only valid after mapper is called)
-  void computeTables(Seq<PEdgeDest>* dests, uint32_t d,
-         Seq<PRoutingDest>* out) {
-    out->clear();
-    uint32_t index = 0;
-    while (index < dests->numElems) {
-      // New set of receiver groups on same mailbox
-      uint32_t threadMaskLow = 0;
-      uint32_t threadMaskHigh = 0;
-      uint32_t nextGroup = 0;
-      // Current mailbox & thread being considered
-      PDeviceAddr mbox = getThreadId(dests->elems[index].addr) >>
-                           TinselLogThreadsPerMailbox;
-      uint32_t thread = getThreadId(dests->elems[index].addr) &
-                          ((1<<TinselLogThreadsPerMailbox)-1);
-      // Determine edges targetting same mailbox
-      while (index < dests->numElems) {
-        PEdgeDest* edge = &dests->elems[index];
-        // Determine destination mailbox address and mailbox-local thread
-        uint32_t destMailbox = getThreadId(edge->addr) >>
-                                 TinselLogThreadsPerMailbox;
-        uint32_t destThread = getThreadId(edge->addr) &
-                                 ((1<<TinselLogThreadsPerMailbox)-1);
-        // Does destination match current destination?
-        if (destMailbox == mbox) {
-          if (destThread == thread) {
-            // Add to current receiver group
-            PInEdge<E> in;
-            in.devId = getLocalDeviceId(edge->addr);
-            Seq<E>* edges = edgeLabels.elems[d];
-            if (! std::is_same<E, None>::value)
-              in.edge = edges->elems[edge->index];
-            // Update current receiver group
-            groups[nextGroup].receivers.append(in);
-            groups[nextGroup].threadId = getThreadId(edge->addr);
-            if (thread < 32) threadMaskLow |= 1 << thread;
-            if (thread >= 32) threadMaskHigh |= 1 << (thread-32);
-            index++;
-          }
-          else {
-            // Start new receiver group
-            thread = destThread;
-            nextGroup++;
-            assert(nextGroup < TinselThreadsPerMailbox);
-          }
-        }
-        else break;
+  void computeRunTables(PEdgeDest* dests, PMailboxRun* run,
+         PReceiverGroup<E>* groups) {
+    uint32_t index = run->start;
+    uint32_t end = run->start + run->size;
+    // New set of receiver groups on same mailbox
+    uint32_t threadMaskLow = 0;
+    uint32_t threadMaskHigh = 0;
+    uint32_t nextGroup = 0;
+    // Current thread being considered
+    uint32_t thread = getThreadId(dests[index].addr) &
+                        ((1<<TinselLogThreadsPerMailbox)-1);
+    while (index < end) {
+      PEdgeDest* edge = &dests[index];
+      // Determine mailbox-local thread
+      uint32_t destThread = getThreadId(edge->addr) &
+                               ((1<<TinselLogThreadsPerMailbox)-1);
+      // Does destination match current destination?
+      if (destThread == thread) {
+        // Add to current receiver group
+        PInEdge<E> in;
+        in.devId = getLocalDeviceId(edge->addr);
+        if (! std::is_same<E, None>::value)
+          in.edge = edgeLabels.elems[edge->index];
+        // Update current receiver group
+        groups[nextGroup].receivers.append(in);
+        groups[nextGroup].threadId = getThreadId(edge->addr);
+        if (thread < 32) threadMaskLow |= 1 << thread;
+        if (thread >= 32) threadMaskHigh |= 1 << (thread-32);
+        index++;
+      }
+      else {
+        // Start new receiver group
+        thread = destThread;
+        nextGroup++;
+        assert(nextGroup < TinselThreadsPerMailbox);
+      }
+    }
+    // Add input table entries
+    run->mrm.key = addInTableEntries(groups, nextGroup+1);
+    run->mrm.threadMaskLow = threadMaskLow;
+    run->mrm.threadMaskHigh = threadMaskHigh;
+    // Clear receiver groups, for a new run
+    for (uint32_t i = 0; i <= nextGroup; i++) groups[i].receivers.clear();
+  }
+
+  // Append a sorted list of destinations to a routing chunk, splitting
+  // it into runs of destinations on the same mailbox
+  // Returns the number of runs added
+  uint32_t addRuns(PRoutingChunk* chunk, Seq<PEdgeDest>* dests) {
+    uint32_t numRuns = 0;
+    for (uint32_t i = 0; i < dests->numElems; i++) {
+      PEdgeDest e = dests->elems[i];
+      uint32_t mbox = getThreadId(e.addr) >> TinselLogThreadsPerMailbox;
+      if (i == 0 || mbox != chunk->runs.elems[chunk->runs.numElems-1].mbox) {
+        PMailboxRun run;
+        run.mbox = mbox;
+        run.start = chunk->dests.numElems;
+        run.size = 0;
+        run.numThreads = 0;
+        chunk->runs.append(run);
+        numRuns++;
       }
-      // Add input table entries
-      uint32_t key = addInTableEntries(nextGroup+1);
-      // Add output entry
-      PRoutingDest dest;
-      dest.kind = PRDestKindMRM;
-      dest.mbox = mbox;
-      dest.mrm.key = key;
-      dest.mrm.threadMaskLow = threadMaskLow;
-      dest.mrm.threadMaskHigh = threadMaskHigh;
-      out->append(dest);
-      // Clear receiver groups, for a new iteration
-      for (uint32_t i = 0; i <= nextGroup; i++) groups[i].receivers.clear();
+      PMailboxRun* run = &chunk->runs.elems[chunk->runs.numElems-1];
+      if (run->size == 0 || getThreadId(e.addr) !=
+            getThreadId(dests->elems[i-1].addr))
+        run->numThreads++;
+      run->size++;
+      chunk->dests.append(e);
     }
+    return numRuns;
   }
 
   // Compute routing tables
   // (Only valid after mapper is called)
+  // This is done in three phases:
+  //   1. In parallel over senders: split the destinations of each
+  //      (device, pin) pair into runs on the same mailbox
+  //   2. In parallel over receiving mailboxes: allocate keys and fill in
+  //      the input tables of the mailbox's threads.  Keys are coloured
+  //      first-fit across all of the mailbox's threads at once, visiting
+  //      the runs that span the most threads first, so that the
+  //      single-thread runs fill the gaps that they leave and the
+  //      header tables stay dense.
+  //   3. Serially: fill in the output tables and programmable routers
+  // Each mailbox's input tables are only touched by the runs targetting
+  // it (visited in a deterministic order), so the resulting tables are
+  // the same as a serial computation.
   void computeRoutingTables() {
-    // Edge destinations (local to sender board, or not)
-    Seq<PEdgeDest> local;
-    Seq<PEdgeDest> nonLocal;
-
-    // Routing destinations
-    Seq<PRoutingDest> dests;
-
     // Allocate per-board programmable routing tables
     progRouterTables = new ProgRouterMesh(numBoardsX, numBoardsY);
 
-    // For each device
-    for (uint32_t d = 0; d < numDevices; d++) {
-      // For each pin
-      for (uint32_t p = 0; p < POLITE_NUM_PINS; p++) {
-        // Split edge lists into local/non-local and sort by target thread id
-        splitDests(d, p, &local, &nonLocal);
-        // Deal with board-local connections
-        computeTables(&local, d, &dests);
-        for (uint32_t i = 0; i < dests.numElems; i++) {
-          PRoutingDest dest = dests.elems[i];
+    // Divide the devices into chunks
+    const uint32_t numMailboxes = TinselMaxThreads >>
+      TinselLogThreadsPerMailbox;
+    uint32_t numChunks = 8 * omp_get_max_threads();
+    uint32_t chunkSize = (numDevices + numChunks - 1) / numChunks;
+    if (chunkSize == 0) chunkSize = 1;
+    numChunks = (numDevices + chunkSize - 1) / chunkSize;
+    PRoutingChunk* chunks = new PRoutingChunk [numChunks];
+
+    // Number of local and non-local runs for each (device, pin) pair
+    uint32_t* numLocalRuns = (uint32_t*)
+      calloc(numDevices * POLITE_NUM_PINS, sizeof(uint32_t));
+    uint32_t* numNonLocalRuns = (uint32_t*)
+      calloc(numDevices * POLITE_NUM_PINS, sizeof(uint32_t));
+
+    // Phase 1: split destinations into runs
+    #pragma omp parallel
+    {
+      // Edge destinations (local to sender board, or not)
+      Seq<PEdgeDest> local;
+      Seq<PEdgeDest> nonLocal;
+
+      #pragma omp for schedule(dynamic)
+      for (uint32_t c = 0; c < numChunks; c++) {
+        PRoutingChunk* chunk = &chunks[c];
+        uint32_t first = c * chunkSize;
+        uint32_t last = min(first + chunkSize, numDevices);
+        for (uint32_t d = first; d < last; d++) {
+          for (uint32_t p = 0; p < POLITE_NUM_PINS; p++) {
+            // Split edge lists into local/non-local and sort by thread id
+            splitDests(d, p, &local, &nonLocal);
+            numLocalRuns[d*POLITE_NUM_PINS + p] = addRuns(chunk, &local);
+            numNonLocalRuns[d*POLITE_NUM_PINS + p] =
+              addRuns(chunk, &nonLocal);
+          }
+        }
+        // Index the runs by mailbox (preserving order)
+        chunk->mboxStart = (uint32_t*)
+          calloc(numMailboxes+1, sizeof(uint32_t));
+        chunk->mboxRuns = (uint32_t*)
+          malloc(chunk->runs.numElems * sizeof(uint32_t));
+        for (uint32_t i = 0; i < chunk->runs.numElems; i++)
+          chunk->mboxStart[chunk->runs.elems[i].mbox+1]++;
+        for (uint32_t m = 0; m < numMailboxes; m++)
+          chunk->mboxStart[m+1] += chunk->mboxStart[m];
+        uint32_t* next = (uint32_t*) malloc(numMailboxes * sizeof(uint32_t));
+        memcpy(next, chunk->mboxStart, numMailboxes * sizeof(uint32_t));
+        for (uint32_t i = 0; i < chunk->runs.numElems; i++)
+          chunk->mboxRuns[next[chunk->runs.elems[i].mbox]++] = i;
+        free(next);
+      }
+    }
+
+    // Phase 2: fill in input tables
+    #pragma omp parallel
+    {
+      // Receiver groups for the current run
+      PReceiverGroup<E>* groups =
+        new PReceiverGroup<E> [TinselThreadsPerMailbox];
+
+      // Runs targetting the current mailbox, with their chunks
+      Seq<std::pair<PRoutingChunk*, PMailboxRun*>> mboxRuns;
+
+      #pragma omp for schedule(dynamic)
+      for (uint32_t m = 0; m < numMailboxes; m++) {
+        mboxRuns.clear();
+        for (uint32_t c = 0; c < numChunks; c++) {
+          PRoutingChunk* chunk = &chunks[c];
+          for (uint32_t i = chunk->mboxStart[m];
+                 i < chunk->mboxStart[m+1]; i++) {
+            PMailboxRun* run = &chunk->runs.elems[chunk->mboxRuns[i]];
+            mboxRuns.append(std::make_pair(chunk, run));
+          }
+        }
+        // Widest runs first (otherwise in (device, pin) order)
+        std::stable_sort(mboxRuns.elems, mboxRuns.elems + mboxRuns.numElems,
+          [](const std::pair<PRoutingChunk*, PMailboxRun*>& a,
+             const std::pair<PRoutingChunk*, PMailboxRun*>& b) {
+            return a.second->numThreads > b.second->numThreads; });
+        for (uint32_t i = 0; i < mboxRuns.numElems; i++)
+          computeRunTables(mboxRuns.elems[i].first->dests.elems,
+            mboxRuns.elems[i].second, groups);
+      }
+
+      delete [] groups;
+    }
+
+    // Phase 3: fill in output tables
+    Seq<PRoutingDest> dests;
+    for (uint32_t c = 0; c < numChunks; c++) {
+      PRoutingChunk* chunk = &chunks[c];
+      PMailboxRun* run = chunk->runs.elems;
+      uint32_t first = c * chunkSize;
+      uint32_t last = min(first + chunkSize, numDevices);
+      for (uint32_t d = first; d < last; d++) {
+        for (uint32_t p = 0; p < POLITE_NUM_PINS; p++) {
+          // Deal with board-local connections
+          uint32_t n = numLocalRuns[d*POLITE_NUM_PINS + p];
+          for (uint32_t i = 0; i < n; i++, run++) {
+            POutEdge edge;
+            edge.mbox = run->mbox;
+            edge.key = run->mrm.key;
+            edge.threadMaskLow = run->mrm.threadMaskLow;
+            edge.threadMaskHigh = run->mrm.threadMaskHigh;
+            outTable[d][p]->append(edge);
+          }
+          // Deal with non-board-local connections
+          dests.clear();
+          n = numNonLocalRuns[d*POLITE_NUM_PINS + p];
+          for (uint32_t i = 0; i < n; i++, run++) {
+            PRoutingDest dest;
+            dest.kind = PRDestKindMRM;
+            dest.mbox = run->mbox;
+            dest.mrm = run->mrm;
+            dests.append(dest);
+          }
+          uint32_t src = getThreadId(toDeviceAddr[d]) >>
+            TinselLogThreadsPerMailbox;
+          uint32_t key = progRouterTables->addDestsFromBoard(src, &dests);
           POutEdge edge;
-          edge.mbox = dest.mbox;
-          edge.key = dest.mrm.key;
-          edge.threadMaskLow = dest.mrm.threadMaskLow;
-          edge.threadMaskHigh = dest.mrm.threadMaskHigh;
+          edge.mbox = tinselUseRoutingKey();
+          edge.key = 0;
+          edge.threadMaskLow = key;
+          edge.threadMaskHigh = 0; 
           outTable[d][p]->append(edge);
+          // Add output list terminator
+          POutEdge term;
+          term.key = InvalidKey;
+          outTable[d][p]->append(term);
         }
-        // Deal with non-board-local connections
-        computeTables(&nonLocal, d, &dests);
-        uint32_t src = getThreadId(toDeviceAddr[d]) >>
-          TinselLogThreadsPerMailbox;
-        uint32_t key = progRouterTables->addDestsFromBoard(src, &dests);
-        POutEdge edge;
-        edge.mbox = tinselUseRoutingKey();
-        edge.key = 0;
-        edge.threadMaskLow = key;
-        edge.threadMaskHigh = 0; 
-        outTable[d][p]->append(edge);
-        // Add output list terminator
-        POutEdge term;
-        term.key = InvalidKey;
-        outTable[d][p]->append(term);
       }
     }
+
+    // Release memory
+    delete [] chunks;
+    free(numLocalRuns);
+    free(numNonLocalRuns);
+
+    if (chatty > 0) printKeyReport();
+  }
+
+  // Display routing key usage: the largest key, and the packing
+  // density of the in-table headers (the fraction of header entries,
+  // up to each thread's largest key, that are in use)
+  void printKeyReport() {
+    uint64_t allocated = 0, used = 0;
+    uint32_t maxKeys = 0;
+    for (uint32_t t = 0; t < TinselMaxThreads; t++) {
+      if (inTableHeaders[t] == NULL) continue;
+      uint32_t n = inTableHeaders[t]->numElems;
+      allocated += n;
+      if (n > maxKeys) maxKeys = n;
+      Bitmap* bm = inTableBitmaps[t];
+      for (uint32_t i = 0; i < bm->contents->numElems; i++)
+        used += __builtin_popcountll(bm->contents->elems[i]);
+    }
+    printf("POLite routing keys: max %u per thread, "
+           "header density %.1lf%%\n", maxKeys,
+           allocated == 0 ? 100.0 : 100.0 * used / allocated);
   }
 
   // Release all structures
@@ -741,6 +1208,11 @@ template <typename DeviceType,
       free(outEdgeMemSize);
       free(outEdgeMemBase);
     }
+    releaseRoutingTables();
+  }
+
+  // Release routing tables
+  void releaseRoutingTables() {
     if (inTableHeaders != NULL) {
       for (uint32_t t = 0; t < TinselMaxThreads; t++)
         if (inTableHeaders[t] != NULL) delete inTableHeaders[t];
@@ -769,25 +1241,246 @@ template <typename DeviceType,
       free(outTable);
       outTable = NULL;
     }
-    if (progRouterTables != NULL) delete progRouterTables;
+    if (progRouterTables != NULL) {
+      delete progRouterTables;
+      progRouterTables = NULL;
+    }
   }
 
-  // Implement mapping to tinsel threads
-  void map() {
-    // Let's measure some times
-    struct timeval placementStart, placementFinish;
-    struct timeval routingStart, routingFinish;
-    struct timeval initStart, initFinish;
+  // Mapping cache
+  // =============
+  //
+  // If POLITE_MAP_CACHE names a directory, the result of placement and
+  // routing is saved there, in a file named after a hash of the graph
+  // and the board configuration.  A later run on the same graph loads
+  // the file instead of recomputing the mapping.
+
+  // Mix a block of memory into a 64-bit FNV-1a hash, a word at a time
+  uint64_t hashBytes(uint64_t h, const void* data, uint64_t numBytes) {
+    const uint64_t prime = 1099511628211ull;
+    const uint8_t* ptr = (const uint8_t*) data;
+    while (numBytes >= 8) {
+      uint64_t word;
+      memcpy(&word, ptr, 8);
+      h = (h ^ word) * prime;
+      ptr += 8;
+      numBytes -= 8;
+    }
+    while (numBytes > 0) {
+      h = (h ^ *ptr) * prime;
+      ptr++;
+      numBytes--;
+    }
+    return h;
+  }
 
-    // Release all mapping and heap structures
-    releaseAll();
+  // Hash the inputs to the mapper
+  // (Edge labels are hashed as raw bytes, so a label type with
+  // uninitialised padding will simply never hit in the cache)
+  uint64_t mappingHash() {
+    uint64_t h = 14695981039346656037ull;
+    // Mapper and table layout parameters
+    uint32_t params[] = {
+      PGraphMapCacheVersion, meshLenX, meshLenY, numBoardsX, numBoardsY,
+      POLITE_NUM_PINS, POLITE_EDGES_PER_HEADER, TinselMaxThreads,
+      TinselLogThreadsPerMailbox, TinselMailboxMeshXLen,
+      TinselMailboxMeshYLen, TinselDRAMsPerBoard,
+      (uint32_t) sizeof(POutEdge), (uint32_t) sizeof(PInHeader<E>),
+      (uint32_t) sizeof(PInEdge<E>)
+    };
+    h = hashBytes(h, params, sizeof(params));
+    // Memory layout, which affects thread load balancing
+    uint32_t layout[] = {
+      mapVerticesToDRAM, mapInEdgeHeadersToDRAM, mapInEdgeRestToDRAM,
+      mapOutEdgesToDRAM, autoMapRegions,
+      (uint32_t) sizeof(PState<S>),
+      (uint32_t) sizeof(PThread<DeviceType, S, E, M>),
+      maxSRAMPartitionSize(), maxDRAMPartitionSize()
+    };
+    h = hashBytes(h, layout, sizeof(layout));
+    const char* placer = getenv("POLITE_PLACER");
+    if (placer) h = hashBytes(h, placer, strlen(placer));
+    const char* mapper = getenv("POLITE_MAPPER");
+    if (mapper) h = hashBytes(h, mapper, strlen(mapper));
+    // Graph structure
+    assert(graph.isFinal());
+    uint32_t sizes[] = { graph.numNodes(), graph.numEdges };
+    h = hashBytes(h, sizes, sizeof(sizes));
+    h = hashBytes(h, graph.outOffset, (graph.numNodes()+1) * sizeof(EdgeId));
+    h = hashBytes(h, graph.outDest, graph.numEdges * sizeof(NodeId));
+    h = hashBytes(h, graph.outPin, graph.numEdges * sizeof(PinId));
+    h = hashBytes(h, graph.outEdge, graph.numEdges * sizeof(EdgeId));
+    // Edge labels
+    h = hashBytes(h, edgeLabels.elems, edgeLabels.numElems * sizeof(E));
+    // Device and edge weights
+    Seq<uint32_t>* weights[] = { graph.nodeWeights, graph.edgeWeights };
+    for (int i = 0; i < 2; i++) {
+      uint32_t n = weights[i] ? weights[i]->numElems : 0;
+      h = hashBytes(h, &n, sizeof(uint32_t));
+      if (n > 0) h = hashBytes(h, weights[i]->elems, n * sizeof(uint32_t));
+    }
+    return h;
+  }
 
-    // Reallocate mapping structures
-    allocateMapping();
+  // Write a block to the cache file
+  bool writeBlock(FILE* fp, const void* data, uint64_t numBytes) {
+    return numBytes == 0 || fwrite(data, numBytes, 1, fp) == 1;
+  }
 
-    // Start placement timer
-    gettimeofday(&placementStart, NULL);
+  // Read a block from the cache file
+  bool readBlock(FILE* fp, void* data, uint64_t numBytes) {
+    return numBytes == 0 || fread(data, numBytes, 1, fp) == 1;
+  }
+
+  // Write a sequence (length followed by elements) to the cache file
+  template <typename T> bool writeSeq(FILE* fp, Seq<T>* seq) {
+    uint32_t n = seq->numElems;
+    return writeBlock(fp, &n, sizeof(uint32_t)) &&
+           writeBlock(fp, seq->elems, n * sizeof(T));
+  }
 
+  // Read a sequence (length followed by elements) from the cache file
+  template <typename T> bool readSeq(FILE* fp, Seq<T>* seq) {
+    uint32_t n;
+    if (! readBlock(fp, &n, sizeof(uint32_t))) return false;
+    if (n > (1u << 31)) return false;
+    seq->clear();
+    seq->setCapacity(n);
+    if (! readBlock(fp, seq->elems, n * sizeof(T))) return false;
+    seq->numElems = n;
+    return true;
+  }
+
+  // Save result of placement and routing to cache file
+  void saveMapping(const char* filename, uint64_t hash) {
+    // Write to a temporary file and rename it, so that concurrent
+    // runs never see a partially-written cache file
+    char tmpName[strlen(filename) + 32];
+    snprintf(tmpName, sizeof(tmpName), "%s.%d.tmp", filename, getpid());
+    FILE* fp = fopen(tmpName, "wb");
+    if (fp == NULL) {
+      fprintf(stderr, "Warning: can't write mapping cache '%s'\n", tmpName);
+      return;
+    }
+    uint32_t magic = PGraphMapCacheMagic;
+    bool ok = writeBlock(fp, &magic, sizeof(magic)) &&
+              writeBlock(fp, &hash, sizeof(hash)) &&
+              writeBlock(fp, &numDevices, sizeof(numDevices));
+    // Placement
+    ok = ok && writeBlock(fp, numDevicesOnThread,
+                 TinselMaxThreads * sizeof(uint32_t));
+    for (uint32_t t = 0; t < TinselMaxThreads && ok; t++)
+      ok = writeBlock(fp, fromDeviceAddr[t],
+             numDevicesOnThread[t] * sizeof(PDeviceId));
+    ok = ok && writeBlock(fp, toDeviceAddr, numDevices * sizeof(PDeviceAddr));
+    // Routing tables
+    for (uint32_t d = 0; d < numDevices && ok; d++)
+      for (uint32_t p = 0; p < POLITE_NUM_PINS && ok; p++)
+        ok = writeSeq(fp, outTable[d][p]);
+    for (uint32_t t = 0; t < TinselMaxThreads && ok; t++) {
+      if (numDevicesOnThread[t] == 0) continue;
+      ok = writeSeq(fp, inTableHeaders[t]) && writeSeq(fp, inTableRest[t]);
+    }
+    for (uint32_t y = 0; y < numBoardsY && ok; y++)
+      for (uint32_t x = 0; x < numBoardsX && ok; x++)
+        for (uint32_t i = 0; i < TinselDRAMsPerBoard && ok; i++)
+          ok = writeSeq(fp, progRouterTables->table[y][x].table[i]);
+    ok = (fclose(fp) == 0) && ok;
+    if (ok) ok = rename(tmpName, filename) == 0;
+    if (! ok) {
+      fprintf(stderr, "Warning: can't write mapping cache '%s'\n", tmpName);
+      remove(tmpName);
+    }
+  }
+
+  // Load result of placement and routing from cache file
+  // (Returns false, with no mapping or routing tables, on failure)
+  bool loadMapping(const char* filename, uint64_t hash) {
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) return false;
+    uint32_t magic, n;
+    uint64_t fileHash;
+    bool ok = readBlock(fp, &magic, sizeof(magic)) &&
+              readBlock(fp, &fileHash, sizeof(fileHash)) &&
+              readBlock(fp, &n, sizeof(n)) &&
+              magic == PGraphMapCacheMagic && fileHash == hash &&
+              n == numDevices;
+    // Placement
+    ok = ok && readBlock(fp, numDevicesOnThread,
+                 TinselMaxThreads * sizeof(uint32_t));
+    for (uint32_t t = 0; t < TinselMaxThreads && ok; t++) {
+      if (numDevicesOnThread[t] == 0) continue;
+      if (numDevicesOnThread[t] > numDevices) { ok = false; break; }
+      fromDeviceAddr[t] = (PDeviceId*)
+        malloc(sizeof(PDeviceId) * numDevicesOnThread[t]);
+      ok = readBlock(fp, fromDeviceAddr[t],
+             numDevicesOnThread[t] * sizeof(PDeviceId));
+    }
+    ok = ok && readBlock(fp, toDeviceAddr, numDevices * sizeof(PDeviceAddr));
+    // Routing tables
+    if (ok) {
+      allocateRoutingTables();
+      progRouterTables = new ProgRouterMesh(numBoardsX, numBoardsY);
+    }
+    for (uint32_t d = 0; d < numDevices && ok; d++)
+      for (uint32_t p = 0; p < POLITE_NUM_PINS && ok; p++)
+        ok = readSeq(fp, outTable[d][p]);
+    for (uint32_t t = 0; t < TinselMaxThreads && ok; t++) {
+      if (numDevicesOnThread[t] == 0) continue;
+      ok = readSeq(fp, inTableHeaders[t]) && readSeq(fp, inTableRest[t]);
+    }
+    for (uint32_t y = 0; y < numBoardsY && ok; y++)
+      for (uint32_t x = 0; x < numBoardsX && ok; x++)
+        for (uint32_t i = 0; i < TinselDRAMsPerBoard && ok; i++)
+          ok = readSeq(fp, progRouterTables->table[y][x].table[i]);
+    // Check for trailing data
+    ok = ok && fgetc(fp) == EOF;
+    fclose(fp);
+    if (! ok) {
+      // Undo partial load
+      releaseRoutingTables();
+      for (uint32_t t = 0; t < TinselMaxThreads; t++) {
+        if (fromDeviceAddr[t] != NULL) free(fromDeviceAddr[t]);
+        fromDeviceAddr[t] = NULL;
+        numDevicesOnThread[t] = 0;
+      }
+    }
+    return ok;
+  }
+
+  // Determine tinsel thread id from position in hierarchy
+  uint32_t hierThreadId(uint32_t boardX, uint32_t boardY,
+                        uint32_t boxX, uint32_t boxY, uint32_t threadNum) {
+    uint32_t threadId = boardY;
+    threadId = (threadId << TinselMeshXBits) | boardX;
+    threadId = (threadId << TinselMailboxMeshYBits) | boxY;
+    threadId = (threadId << TinselMailboxMeshXBits) | boxX;
+    threadId = (threadId << (TinselLogCoresPerMailbox +
+                  TinselLogThreadsPerCore)) | threadNum;
+    return threadId;
+  }
+
+  // Place the given devices on the given thread
+  void placeOnThread(uint32_t threadId, uint32_t numDevs, PDeviceId* devs) {
+    // Populate fromDeviceAddr mapping
+    numDevicesOnThread[threadId] = numDevs;
+    fromDeviceAddr[threadId] = (PDeviceId*)
+      malloc(sizeof(PDeviceId) * numDevs);
+    for (uint32_t devNum = 0; devNum < numDevs; devNum++)
+      fromDeviceAddr[threadId][devNum] = devs[devNum];
+
+    // Populate toDeviceAddr mapping
+    assert(numDevs < maxLocalDeviceId());
+    for (uint32_t devNum = 0; devNum < numDevs; devNum++) {
+      PDeviceAddr devAddr =
+        makeDeviceAddr(threadId, devNum);
+      toDeviceAddr[devs[devNum]] = devAddr;
+    }
+  }
+
+  // Partition and place using a placer per board, per mailbox, and
+  // per thread
+  void mapNested() {
     // Partition into subgraphs, one per board
     Placer boards(&graph, numBoardsX, numBoardsY);
 
@@ -816,36 +1509,105 @@ template <typename DeviceType,
             // For each thread
             for (uint32_t threadNum = 0; threadNum < numThreads; threadNum++) {
               // Determine tinsel thread id
-              uint32_t threadId = boardY;
-              threadId = (threadId << TinselMeshXBits) | boardX;
-              threadId = (threadId << TinselMailboxMeshYBits) | boxY;
-              threadId = (threadId << TinselMailboxMeshXBits) | boxX;
-              threadId = (threadId << (TinselLogCoresPerMailbox +
-                            TinselLogThreadsPerCore)) | threadNum;
+              uint32_t threadId =
+                hierThreadId(boardX, boardY, boxX, boxY, threadNum);
 
               // Get subgraph
               Graph* g = &threads.subgraphs[threadNum];
-
-              // Populate fromDeviceAddr mapping
-              uint32_t numDevs = g->incoming->numElems;
-              numDevicesOnThread[threadId] = numDevs;
-              fromDeviceAddr[threadId] = (PDeviceId*)
-                malloc(sizeof(PDeviceId) * numDevs);
-              for (uint32_t devNum = 0; devNum < numDevs; devNum++)
-                fromDeviceAddr[threadId][devNum] = g->labels->elems[devNum];
-  
-              // Populate toDeviceAddr mapping
-              assert(numDevs < maxLocalDeviceId());
-              for (uint32_t devNum = 0; devNum < numDevs; devNum++) {
-                PDeviceAddr devAddr =
-                  makeDeviceAddr(threadId, devNum);
-                toDeviceAddr[g->labels->elems[devNum]] = devAddr;
-              }
+              placeOnThread(threadId, g->numNodes(), g->labels->elems);
             }
           }
         }
       }
     }
+  }
+
+  // Partition the whole graph into threads in one pass, and then
+  // group and place threads on mailboxes and boards (see HierPlacer)
+  void mapOnePass() {
+    HierPlacer placer(&graph, numBoardsX, numBoardsY,
+      TinselMailboxMeshXLen, TinselMailboxMeshYLen,
+      1<<TinselLogThreadsPerMailbox);
+    placer.place();
+    if (chatty > 0)
+      printf("POLite one-pass mapper: placement cost %lu\n", placer.cost());
+
+    // Group devices by slot
+    uint32_t* start = (uint32_t*) calloc(placer.numSlots+1, sizeof(uint32_t));
+    for (uint32_t d = 0; d < numDevices; d++) start[placer.slot(d)+1]++;
+    for (uint32_t s = 0; s < placer.numSlots; s++) start[s+1] += start[s];
+    PDeviceId* devs = (PDeviceId*) malloc(numDevices * sizeof(PDeviceId));
+    uint32_t* next = (uint32_t*) malloc(placer.numSlots * sizeof(uint32_t));
+    memcpy(next, start, placer.numSlots * sizeof(uint32_t));
+    for (uint32_t d = 0; d < numDevices; d++) devs[next[placer.slot(d)]++] = d;
+
+    // Place each slot's devices on the corresponding thread
+    for (uint32_t s = 0; s < placer.numSlots; s++) {
+      uint32_t threadId = hierThreadId(
+        placer.slotBoardX(s), placer.slotBoardY(s),
+        placer.slotBoxX(s), placer.slotBoxY(s), placer.slotThread(s));
+      placeOnThread(threadId, start[s+1] - start[s], &devs[start[s]]);
+    }
+
+    free(start);
+    free(devs);
+    free(next);
+  }
+
+  // Implement mapping to tinsel threads
+  void map() {
+    // Let's measure some times
+    struct timeval placementStart, placementFinish;
+    struct timeval routingStart, routingFinish;
+    struct timeval initStart, initFinish;
+
+    // Release all mapping and heap structures
+    releaseAll();
+
+    // Reallocate mapping structures
+    allocateMapping();
+
+    // Start placement timer
+    gettimeofday(&placementStart, NULL);
+
+    // Consult the mapping cache, if enabled
+    graph.finalise();
+    applyPinWeights();
+    char* cacheDir = getenv("POLITE_MAP_CACHE");
+    char* cacheFile = NULL;
+    uint64_t hash = 0;
+    if (cacheDir != NULL) {
+      hash = mappingHash();
+      cacheFile = (char*) malloc(strlen(cacheDir) + 32);
+      sprintf(cacheFile, "%s/%016lx.map", cacheDir, hash);
+      if (loadMapping(cacheFile, hash)) {
+        if (chatty > 0) printf("POLite mapping loaded from %s\n", cacheFile);
+        free(cacheFile);
+        gettimeofday(&initStart, NULL);
+        allocatePartitions();
+        initialisePartitions();
+        gettimeofday(&initFinish, NULL);
+        if (chatty > 0) {
+          struct timeval diff;
+          timersub(&initFinish, &placementStart, &diff);
+          double duration = (double) diff.tv_sec +
+            (double) diff.tv_usec / 1000000.0;
+          printf("POLite mapper time (cached): %lfs\n", duration);
+        }
+        return;
+      }
+    }
+
+    // Partition and place, either in one pass or using nested placers
+    char* mapper = getenv("POLITE_MAPPER");
+    if (mapper != NULL && !strcmp(mapper, "onepass"))
+      mapOnePass();
+    else if (mapper == NULL || !strcmp(mapper, "nested"))
+      mapNested();
+    else {
+      fprintf(stderr, "Don't understand mapper : %s\n", mapper);
+      exit(EXIT_FAILURE);
+    }
 
     // Stop placement timer and start routing timer
     gettimeofday(&placementFinish, NULL);
@@ -855,8 +1617,20 @@ template <typename DeviceType,
     allocateRoutingTables();
     computeRoutingTables();
 
-    // Stop routing timer and start init timer
+    // Relieve threads whose partitions overflow
+    balanceThreadLoads();
+    if (chatty > 0) printLoadReport();
+
+    // Stop routing timer
     gettimeofday(&routingFinish, NULL);
+
+    // Save mapping to cache, if enabled
+    if (cacheFile != NULL) {
+      saveMapping(cacheFile, hash);
+      free(cacheFile);
+    }
+
+    // Start init timer
     gettimeofday(&initStart, NULL);
 
     // Reallocate and initialise heap structures
@@ -903,92 +1677,120 @@ template <typename DeviceType,
   // Deconstructor
   ~PGraph() {
     releaseAll();
-    for (uint32_t i = 0; i < edgeLabels.numElems; i++)
-      delete edgeLabels.elems[i];
   }
 
-  // Write partition to tinsel machine
-  void writeRAM(HostLink* hostLink,
-         uint8_t** heap, uint32_t* heapSize, uint32_t* heapBase) {
-    // Number of bytes written by each thread
-    uint32_t* writeCount = (uint32_t*)
-      calloc(TinselMaxThreads, sizeof(uint32_t));
-
-    // Number of threads completed by each core
-    uint32_t*** threadCount = (uint32_t***)
-      calloc(meshLenX, sizeof(uint32_t**));
-    for (uint32_t x = 0; x < meshLenX; x++) {
-      threadCount[x] = (uint32_t**)
-        calloc(meshLenY, sizeof(uint32_t*));
-      for (uint32_t y = 0; y < meshLenY; y++)
-        threadCount[x][y] = (uint32_t*)
-          calloc(TinselCoresPerBoard, sizeof(uint32_t));
-    }
-
-    // Initialise write addresses
-    for (int x = 0; x < meshLenX; x++)
-      for (int y = 0; y < meshLenY; y++)
-        for (int c = 0; c < TinselCoresPerBoard; c++)
-          hostLink->setAddr(x, y, c, heapBase[hostLink->toAddr(x, y, c, 0)]);
-
-    // Write heaps
-    uint32_t done = false;
-    while (! done) {
-      done = true;
-      for (int x = 0; x < meshLenX; x++) {
-        for (int y = 0; y < meshLenY; y++) {
-          for (int c = 0; c < TinselCoresPerBoard; c++) {
-            uint32_t t = threadCount[x][y][c];
-            if (t < TinselThreadsPerCore) {
-              done = false;
-              uint32_t threadId = hostLink->toAddr(x, y, c, t);
-              uint32_t written = writeCount[threadId];
-              if (written == heapSize[threadId]) {
-                threadCount[x][y][c] = t+1;
-                if ((t+1) < TinselThreadsPerCore)
-                  hostLink->setAddr(x, y, c,
-                    heapBase[hostLink->toAddr(x, y, c, t+1)]);
-              } else {
-                uint32_t send = min((heapSize[threadId] - written)>>2, 15);
-                hostLink->store(x, y, c, send,
-                  (uint32_t*) &heap[threadId][written]);
-                writeCount[threadId] = written + send * sizeof(uint32_t);
-              }
-            }
-          }
-        }
-      }
-    }
-
-    // Release memory
-    free(writeCount);
-    for (uint32_t x = 0; x < meshLenX; x++) {
-      for (uint32_t y = 0; y < meshLenY; y++)
-        free(threadCount[x][y]);
-      free(threadCount[x]);
-    }
-    free(threadCount);
+  // Add a thread's heap region to an upload stream, if non-empty
+  void addUploadSegment(Seq<PUploadSegment>* stream,
+         uint8_t** heap, uint32_t* heapSize, uint32_t* heapBase,
+         uint32_t threadId) {
+    if (heapSize[threadId] == 0) return;
+    PUploadSegment seg;
+    seg.base = heapBase[threadId];
+    seg.data = heap[threadId];
+    seg.size = heapSize[threadId];
+    stream->append(seg);
   }
 
   // Write graph to tinsel machine
+  // Each core's boot loader receives one stream, containing every heap
+  // region of each of its threads (and, for the cores that initialise
+  // the DRAMs, the programmable router tables).  The streams are sent
+  // round-robin, with consecutive messages going to different boards,
+  // so that all the boards are kept busy at once.
   void write(HostLink* hostLink) { 
     // Start timer
     struct timeval start, finish;
     gettimeofday(&start, NULL);
 
+    // Compute number of cores per DRAM
+    const uint32_t coresPerDRAM = 1 <<
+      (TinselLogCoresPerDCache + TinselLogDCachesPerDRAM);
+
+    // Build upload stream for each core
+    uint32_t numCores = meshLenX * meshLenY * TinselCoresPerBoard;
+    Seq<PUploadSegment>** streams = new Seq<PUploadSegment>* [numCores];
+    uint64_t totalBytes = 0;
+    for (uint32_t y = 0; y < meshLenY; y++) {
+      for (uint32_t x = 0; x < meshLenX; x++) {
+        for (uint32_t c = 0; c < TinselCoresPerBoard; c++) {
+          uint32_t core = (y * meshLenX + x) * TinselCoresPerBoard + c;
+          Seq<PUploadSegment>* stream = new SmallSeq<PUploadSegment>;
+          streams[core] = stream;
+          for (uint32_t t = 0; t < TinselThreadsPerCore; t++) {
+            uint32_t threadId = hostLink->toAddr(x, y, c, t);
+            addUploadSegment(stream, vertexMem, vertexMemSize,
+                               vertexMemBase, threadId);
+            addUploadSegment(stream, threadMem, threadMemSize,
+                               threadMemBase, threadId);
+            addUploadSegment(stream, inEdgeHeaderMem, inEdgeHeaderMemSize,
+                               inEdgeHeaderMemBase, threadId);
+            addUploadSegment(stream, inEdgeRestMem, inEdgeRestMemSize,
+                               inEdgeRestMemBase, threadId);
+            addUploadSegment(stream, outEdgeMem, outEdgeMemSize,
+                               outEdgeMemBase, threadId);
+          }
+          // Use one core to initialise each DRAM's routing table
+          if ((c % coresPerDRAM) == 0 &&
+                x < numBoardsX && y < numBoardsY) {
+            Seq<uint8_t>* table =
+              progRouterTables->table[y][x].table[c / coresPerDRAM];
+            // Tables consist of whole 32-byte beats
+            assert((table->numElems % 32) == 0);
+            PUploadSegment seg;
+            seg.base = TinselPOLiteProgRouterBase;
+            seg.data = table->elems;
+            seg.size = table->numElems;
+            if (seg.size > 0) stream->append(seg);
+          }
+          for (uint32_t i = 0; i < stream->numElems; i++)
+            totalBytes += stream->elems[i].size;
+        }
+      }
+    }
+
+    // Progress through each stream
+    uint32_t* segIndex = (uint32_t*) calloc(numCores, sizeof(uint32_t));
+    uint32_t* segOffset = (uint32_t*) calloc(numCores, sizeof(uint32_t));
+
+    // Send the streams
     bool useSendBufferOld = hostLink->useSendBuffer;
     hostLink->useSendBuffer = true;
-    writeRAM(hostLink, vertexMem, vertexMemSize, vertexMemBase);
-    writeRAM(hostLink, threadMem, threadMemSize, threadMemBase);
-    writeRAM(hostLink, inEdgeHeaderMem,
-               inEdgeHeaderMemSize, inEdgeHeaderMemBase);
-    writeRAM(hostLink, inEdgeRestMem, inEdgeRestMemSize, inEdgeRestMemBase);
-    writeRAM(hostLink, outEdgeMem, outEdgeMemSize, outEdgeMemBase);
-    progRouterTables->write(hostLink);
+    bool done = false;
+    while (! done) {
+      done = true;
+      for (uint32_t c = 0; c < TinselCoresPerBoard; c++) {
+        for (uint32_t y = 0; y < meshLenY; y++) {
+          for (uint32_t x = 0; x < meshLenX; x++) {
+            uint32_t core = (y * meshLenX + x) * TinselCoresPerBoard + c;
+            Seq<PUploadSegment>* stream = streams[core];
+            uint32_t i = segIndex[core];
+            if (i == stream->numElems) continue;
+            done = false;
+            PUploadSegment* seg = &stream->elems[i];
+            uint32_t offset = segOffset[core];
+            if (offset == 0) hostLink->setAddr(x, y, c, seg->base);
+            uint32_t words = min((seg->size - offset) >> 2, BootReqMaxArgs);
+            hostLink->store(x, y, c, words, (uint32_t*) &seg->data[offset]);
+            offset += words * sizeof(uint32_t);
+            if (offset == seg->size) {
+              segIndex[core] = i+1;
+              offset = 0;
+            }
+            segOffset[core] = offset;
+          }
+        }
+      }
+    }
     hostLink->flush();
     hostLink->useSendBuffer = useSendBufferOld;
 
-    // Display time if chatty
+    // Release memory
+    for (uint32_t i = 0; i < numCores; i++) delete streams[i];
+    delete [] streams;
+    free(segIndex);
+    free(segOffset);
+
+    // Display time and throughput if chatty
     gettimeofday(&finish, NULL);
     if (chatty > 0) {
       struct timeval diff;
@@ -996,6 +1798,9 @@ template <typename DeviceType,
       double duration = (double) diff.tv_sec +
         (double) diff.tv_usec / 1000000.0;
       printf("POLite graph upload time: %lfs\n", duration);
+      printf("POLite graph upload size: %.2lfMB (%.2lfMB/s)\n",
+        (double) totalBytes / 1000000.0,
+        (double) totalBytes / 1000000.0 / duration);
     }
   }
 
@@ -3,13 +3,19 @@
 #define _PLACER_H_
 
 #include <stdint.h>
+#include <string.h>
+#include <math.h>
 #include <metis.h>
 #include <POLite/Graph.h>
 #include <queue>
+#include <algorithm>
 #include <omp.h>
 
 typedef uint32_t PartitionId;
 
+// Vertex and edge weights passed to Metis are capped at this value
+#define PlacerMaxWeight 0xffffff
+
 // Partition and place a graph on a 2D mesh
 struct Placer {
   // Select between different methods
@@ -22,6 +28,12 @@ struct Placer {
   };
   const Method defaultMethod=Metis;
 
+  // Select between different methods of placing partitions on the mesh
+  enum PlaceMethod {
+    HillClimb,
+    Anneal
+  };
+
   // The graph being placed
   Graph* graph;
 
@@ -31,6 +43,9 @@ struct Placer {
   // Mapping from node id to partition id
   PartitionId* partitions;
 
+  // If non-zero, every partition must contain exactly this many nodes
+  uint32_t capacity;
+
   // Mapping from partition id to subgraph
   Graph* subgraphs;
 
@@ -60,43 +75,118 @@ struct Placer {
 
   // Controls which strategy is used
   Method method = Default;
+  PlaceMethod placeMethod = HillClimb;
 
   // Select placer method
+  // (POLITE_PLACER is a comma-separated list, containing at most one
+  // partitioning method and at most one placement method)
   void chooseMethod()
   {
     auto e = getenv("POLITE_PLACER");
     if (e) {
-      if (!strcmp(e, "metis"))
-        method=Metis;
-      else if (!strcmp(e, "random"))
-        method=Random;
-      else if (!strcmp(e, "direct"))
-        method=Direct;
-      else if (!strcmp(e, "bfs"))
-        method=BFS;
-      else if (!strcmp(e, "default") || *e == '\0')
-        method=Default;
-      else {
-        fprintf(stderr, "Don't understand placer method : %s\n", e);
-        exit(EXIT_FAILURE);
+      char str[256];
+      strncpy(str, e, sizeof(str)-1);
+      str[sizeof(str)-1] = '\0';
+      char* save;
+      for (char* tok = strtok_r(str, ",", &save); tok != NULL;
+             tok = strtok_r(NULL, ",", &save)) {
+        if (!strcmp(tok, "metis"))
+          method=Metis;
+        else if (!strcmp(tok, "random"))
+          method=Random;
+        else if (!strcmp(tok, "direct"))
+          method=Direct;
+        else if (!strcmp(tok, "bfs"))
+          method=BFS;
+        else if (!strcmp(tok, "default"))
+          method=Default;
+        else if (!strcmp(tok, "anneal"))
+          placeMethod=Anneal;
+        else if (!strcmp(tok, "hillclimb"))
+          placeMethod=HillClimb;
+        else {
+          fprintf(stderr, "Don't understand placer method : %s\n", tok);
+          exit(EXIT_FAILURE);
+        }
       }
     }
     if (method == Default)
       method = defaultMethod;
   }
 
-  // Partition the graph using Metis
-  void partitionMetis() {
-    // Compute total number of edges
-    uint32_t numEdges = 0;
-    for (uint32_t i = 0; i < graph->incoming->numElems; i++) {
-      numEdges += graph->incoming->elems[i]->numElems +
-                  graph->outgoing->elems[i]->numElems;
+  // Build undirected adjacency of graph in Metis (CSR) format, without
+  // self-loops, where the weight of each undirected edge is the total
+  // weight of the directed edges between its endpoints (in either
+  // direction).  The neighbours of each vertex are deduplicated by
+  // sorting and merging, in parallel across vertices.
+  static void buildUndirectedAdjacency(Graph* graph, idx_t* xadj,
+                                       idx_t** adjncy, idx_t** adjwgt) {
+    uint32_t numNodes = graph->numNodes();
+
+    // Upper bound on number of neighbours of each vertex
+    uint32_t* bound = (uint32_t*) malloc((numNodes+1) * sizeof(uint32_t));
+    bound[0] = 0;
+    for (uint32_t i = 0; i < numNodes; i++)
+      bound[i+1] = bound[i] + graph->fanIn(i) + graph->fanOut(i);
+    // Each neighbour is paired with an edge weight (in the lower half)
+    uint64_t* adj = (uint64_t*) malloc(bound[numNodes] * sizeof(uint64_t));
+
+    // Deduplicate neighbours of each vertex, recording counts in xadj
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (uint32_t i = 0; i < numNodes; i++) {
+      uint64_t* nbrs = &adj[bound[i]];
+      // Gather neighbours, excluding self-loops, with capped weights
+      uint32_t len = 0;
+      Slice<NodeId> lists[2] = { graph->incoming(i), graph->outgoing(i) };
+      Slice<EdgeId> ids[2] = {
+        graph->incomingEdgeIds(i), graph->edgeIds(i) };
+      for (int l = 0; l < 2; l++)
+        for (uint32_t j = 0; j < lists[l].numElems; j++)
+          if (lists[l].elems[j] != i) {
+            uint32_t w = graph->edgeWeight(ids[l].elems[j]);
+            if (w > PlacerMaxWeight) w = PlacerMaxWeight;
+            nbrs[len++] = ((uint64_t) lists[l].elems[j] << 32) | w;
+          }
+      // Sort and merge duplicates, summing weights
+      std::sort(nbrs, nbrs + len);
+      uint32_t num = 0;
+      for (uint32_t j = 0; j < len; j++) {
+        if (num > 0 && (nbrs[num-1] >> 32) == (nbrs[j] >> 32)) {
+          uint64_t w = (nbrs[num-1] & 0xffffffff) + (nbrs[j] & 0xffffffff);
+          if (w > PlacerMaxWeight) w = PlacerMaxWeight;
+          nbrs[num-1] = (nbrs[num-1] & ~0xffffffffull) | w;
+        }
+        else
+          nbrs[num++] = nbrs[j];
+      }
+      xadj[i+1] = (idx_t) num;
     }
 
+    // Compact into final arrays
+    for (uint32_t i = 0; i < numNodes; i++) xadj[i+1] += xadj[i];
+    *adjncy = (idx_t*) malloc((xadj[numNodes]+1) * sizeof(idx_t));
+    *adjwgt = (idx_t*) malloc((xadj[numNodes]+1) * sizeof(idx_t));
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (uint32_t i = 0; i < numNodes; i++) {
+      uint32_t num = xadj[i+1] - xadj[i];
+      for (uint32_t j = 0; j < num; j++) {
+        uint64_t nbr = adj[bound[i] + j];
+        (*adjncy)[xadj[i] + j] = (idx_t) (nbr >> 32);
+        (*adjwgt)[xadj[i] + j] = (idx_t) (nbr & 0xffffffff);
+      }
+    }
+
+    free(bound);
+    free(adj);
+  }
+
+  // Partition the given graph into the given number of parts using
+  // Metis, either by recursive bisection or by k-way partitioning
+  static void metisPartition(Graph* graph, uint32_t numParts,
+                             PartitionId* partitions, bool kway) {
     // Create Metis parameters
-    idx_t nvtxs = (idx_t) graph->incoming->numElems;
-    idx_t nparts = (idx_t) (width * height);
+    idx_t nvtxs = (idx_t) graph->numNodes();
+    idx_t nparts = (idx_t) numParts;
     idx_t nconn = 1;
     idx_t objval;
 
@@ -117,23 +207,21 @@ struct Placer {
       return;
     }
 
-    // Allocate Metis adjacency matrix
+    // Allocate Metis adjacency matrix and edge weights
     idx_t* xadj = (idx_t*) calloc(nvtxs+1, sizeof(idx_t));
-    idx_t* adjncy = (idx_t*) calloc(numEdges, sizeof(idx_t));
-
-    // Populate undirected adjacency matrix
-    uint32_t next = 0;
-    for (uint32_t i = 0; i < nvtxs; i++) {
-      xadj[i] = next;
-      Seq<NodeId>* in = graph->incoming->elems[i];
-      Seq<NodeId>* out = graph->outgoing->elems[i];
-      for (uint32_t j = 0; j < in->numElems; j++)
-        adjncy[next++] = (idx_t) in->elems[j];
-      for (uint32_t j = 0; j < out->numElems; j++)
-        if (! in->member(out->elems[j]))
-          adjncy[next++] = (idx_t) out->elems[j];
+    idx_t* adjncy;
+    idx_t* adjwgt;
+    buildUndirectedAdjacency(graph, xadj, &adjncy, &adjwgt);
+
+    // Vertex weights, if any
+    idx_t* vwgt = NULL;
+    if (graph->nodeWeights) {
+      vwgt = (idx_t*) malloc(nvtxs * sizeof(idx_t));
+      for (uint32_t i = 0; i < nvtxs; i++) {
+        uint32_t w = graph->nodeWeight(i);
+        vwgt[i] = (idx_t) (w > PlacerMaxWeight ? PlacerMaxWeight : w);
+      }
     }
-    xadj[nvtxs] = (idx_t) next;
 
     // Allocate Metis result array
     idx_t* parts = (idx_t*) calloc(nvtxs, sizeof(idx_t));
@@ -144,25 +232,38 @@ struct Placer {
 
     // Invoke partitioner
     // Note: METIS_PartGraphKway gives poor results when the number of
-    // vertices is close to the number of partitions, so we use
-    // METIS_PartGraphRecursive.
-    int ret = METIS_PartGraphRecursive(
-      &nvtxs, &nconn, xadj, adjncy,
-      NULL, NULL, NULL, &nparts, NULL, NULL, options, &objval, parts);
+    // vertices is close to the number of partitions, so by default we
+    // use METIS_PartGraphRecursive.
+    int ret;
+    if (kway)
+      ret = METIS_PartGraphKway(
+        &nvtxs, &nconn, xadj, adjncy,
+        vwgt, NULL, adjwgt, &nparts, NULL, NULL, options, &objval, parts);
+    else
+      ret = METIS_PartGraphRecursive(
+        &nvtxs, &nconn, xadj, adjncy,
+        vwgt, NULL, adjwgt, &nparts, NULL, NULL, options, &objval, parts);
 
     // Populate result array
-    for (uint32_t i = 0; i < graph->incoming->numElems; i++)
+    for (uint32_t i = 0; i < graph->numNodes(); i++)
       partitions[i] = (uint32_t) parts[i];
 
     // Release Metis structures
     free(xadj);
     free(adjncy);
+    free(adjwgt);
+    if (vwgt) free(vwgt);
     free(parts);
   }
 
+  // Partition the graph using Metis
+  void partitionMetis() {
+    metisPartition(graph, width * height, partitions, false);
+  }
+
   // Partition the graph randomly
   void partitionRandom() {
-    uint32_t numVertices = graph->incoming->numElems;
+    uint32_t numVertices = graph->numNodes();
     uint32_t numParts = width * height;
 
     // Populate result array
@@ -173,7 +274,7 @@ struct Placer {
 
   // Partition the graph using direct mapping
   void partitionDirect() {
-    uint32_t numVertices = graph->incoming->numElems;
+    uint32_t numVertices = graph->numNodes();
     uint32_t numParts = width * height;
     uint32_t partSize = (numVertices + numParts) / numParts;
 
@@ -185,7 +286,7 @@ struct Placer {
 
   // Partition the graph using repeated BFS
   void partitionBFS() {
-    uint32_t numVertices = graph->incoming->numElems;
+    uint32_t numVertices = graph->numNodes();
     uint32_t numParts = width * height;
     uint32_t partSize = (numVertices + numParts) / numParts;
 
@@ -215,9 +316,9 @@ struct Placer {
             partitions[v] = nextPart;
             count++;
             // Add unvisited neighbours of v to the frontier
-            Seq<uint32_t>* dests = graph->outgoing->elems[v];
-            for (uint32_t i = 0; i < dests->numElems; i++) {
-              uint32_t w = dests->elems[i];
+            Slice<NodeId> dests = graph->outgoing(v);
+            for (uint32_t i = 0; i < dests.numElems; i++) {
+              uint32_t w = dests.elems[i];
               if (!seen[w]) frontier.push(w);
             }
           }
@@ -250,34 +351,200 @@ struct Placer {
     }
   }
 
+  // Best move of node i out of partition p into a non-full partition,
+  // returning the gain and setting *dest.  This is the move that a scan
+  // of all partitions in order would choose: ties go to the lowest
+  // partition, and firstFree must be the lowest non-full partition.
+  // (The affinity array must be zero on entry, and is left zero; the
+  // touched array needs room for one entry per partition.)
+  int64_t bestMove(NodeId i, PartitionId p, PartitionId firstFree,
+                   uint32_t* size, int64_t* affinity, PartitionId* touched,
+                   PartitionId* dest) {
+    // Connectivity of the node to each neighbouring partition, plus one
+    // (so that zero marks partitions not yet touched)
+    uint32_t numTouched = 0;
+    Slice<NodeId> lists[2] = { graph->incoming(i), graph->outgoing(i) };
+    Slice<EdgeId> ids[2] = { graph->incomingEdgeIds(i), graph->edgeIds(i) };
+    for (int l = 0; l < 2; l++) {
+      for (uint32_t j = 0; j < lists[l].numElems; j++) {
+        PartitionId q = partitions[lists[l].elems[j]];
+        if (affinity[q] == 0) {
+          touched[numTouched++] = q;
+          affinity[q] = 1;
+        }
+        affinity[q] += graph->edgeWeight(ids[l].elems[j]);
+      }
+    }
+
+    // Partitions not touched have zero connectivity, so only the lowest
+    // non-full one need be considered
+    int64_t fromP = affinity[p] ? affinity[p]-1 : 0;
+    int64_t best = affinity[firstFree] ? affinity[firstFree]-1 : 0;
+    PartitionId bestDest = firstFree;
+    for (uint32_t t = 0; t < numTouched; t++) {
+      PartitionId q = touched[t];
+      int64_t a = affinity[q] - 1;
+      affinity[q] = 0;
+      if (size[q] >= capacity) continue;
+      if (a > best || (a == best && q < bestDest)) {
+        best = a;
+        bestDest = q;
+      }
+    }
+    *dest = bestDest;
+    return best - fromP;
+  }
+
+  // Candidate move for balanceExact()
+  struct BalanceMove {
+    int64_t gain;
+    NodeId node;
+    PartitionId dest;
+    // Version of the node when the move was computed
+    uint32_t version;
+    // Order by gain, and then by lowest node id
+    bool operator<(const BalanceMove& other) const {
+      return gain < other.gain || (gain == other.gain && node > other.node);
+    }
+  };
+
+  // Move nodes out of over-full partitions, and into under-full ones,
+  // until every partition contains exactly 'capacity' nodes.  Each move
+  // is chosen greedily to lose the least connectivity.  The best move of
+  // each node in the partition being drained is kept in a heap, and
+  // recomputed only when the node's neighbours move or its destination
+  // fills up.
+  void balanceExact() {
+    uint32_t numPartitions = width*height;
+    uint32_t numNodes = graph->numNodes();
+    assert(numNodes == capacity * numPartitions);
+
+    // Size of each partition, and its initial members (over-full
+    // partitions never gain members, so these stay valid for them)
+    uint32_t* size = new uint32_t [numPartitions+1];
+    for (uint32_t p = 0; p <= numPartitions; p++) size[p] = 0;
+    for (uint32_t i = 0; i < numNodes; i++) size[partitions[i]]++;
+    uint32_t* start = new uint32_t [numPartitions+1];
+    start[0] = 0;
+    for (uint32_t p = 0; p < numPartitions; p++)
+      start[p+1] = start[p] + size[p];
+    NodeId* members = new NodeId [numNodes];
+    for (uint32_t i = 0; i < numNodes; i++)
+      members[start[partitions[i]]++] = i;
+    for (uint32_t p = numPartitions; p > 0; p--) start[p] = start[p-1];
+    start[0] = 0;
+
+    // Scratch space for bestMove()
+    int64_t* affinity = new int64_t [numPartitions];
+    for (uint32_t p = 0; p < numPartitions; p++) affinity[p] = 0;
+    PartitionId* touched = new PartitionId [numPartitions];
+
+    // Version of each node's candidate move
+    uint32_t* version = new uint32_t [numNodes];
+    for (uint32_t i = 0; i < numNodes; i++) version[i] = 0;
+
+    // Lowest non-full partition (partitions only fill up)
+    PartitionId firstFree = 0;
+
+    for (uint32_t p = 0; p < numPartitions; p++) {
+      if (size[p] <= capacity) continue;
+      while (size[firstFree] >= capacity) firstFree++;
+
+      // Best move of each node in the partition
+      std::priority_queue<BalanceMove> heap;
+      for (uint32_t k = start[p]; k < start[p+1]; k++) {
+        BalanceMove m;
+        m.node = members[k];
+        m.version = version[m.node];
+        m.gain = bestMove(m.node, p, firstFree, size, affinity, touched,
+                          &m.dest);
+        heap.push(m);
+      }
+
+      while (size[p] > capacity) {
+        BalanceMove m = heap.top();
+        heap.pop();
+        if (m.version != version[m.node]) continue;
+        if (size[m.dest] >= capacity) {
+          // Destination has filled up since the move was computed
+          m.gain = bestMove(m.node, p, firstFree, size, affinity, touched,
+                            &m.dest);
+          heap.push(m);
+          continue;
+        }
+
+        // Move it
+        partitions[m.node] = m.dest;
+        version[m.node]++;
+        size[p]--;
+        size[m.dest]++;
+        while (size[firstFree] >= capacity) firstFree++;
+        if (size[p] == capacity) break;
+
+        // Recompute the moves of its neighbours still in the partition
+        Slice<NodeId> lists[2] = {
+          graph->incoming(m.node), graph->outgoing(m.node) };
+        for (int l = 0; l < 2; l++) {
+          for (uint32_t j = 0; j < lists[l].numElems; j++) {
+            NodeId n = lists[l].elems[j];
+            if (partitions[n] != p) continue;
+            BalanceMove nm;
+            nm.node = n;
+            nm.version = ++version[n];
+            nm.gain = bestMove(n, p, firstFree, size, affinity, touched,
+                               &nm.dest);
+            heap.push(nm);
+          }
+        }
+      }
+    }
+
+    delete [] size;
+    delete [] start;
+    delete [] members;
+    delete [] affinity;
+    delete [] touched;
+    delete [] version;
+  }
+
   // Create subgraph for each partition
   void computeSubgraphs() {
     uint32_t numPartitions = width*height;
 
     // Create mapping from node id to subgraph node id
-    NodeId* mappedTo = new NodeId [graph->incoming->numElems];
+    NodeId* mappedTo = new NodeId [graph->numNodes()];
 
     // Create subgraphs
-    for (uint32_t i = 0; i < graph->incoming->numElems; i++) {
+    for (uint32_t i = 0; i < graph->numNodes(); i++) {
       // What parition is this node in?
       PartitionId p = partitions[i];
       // Add node to subgraph
       NodeId n = subgraphs[p].newNode();
       subgraphs[p].setLabel(n, graph->labels->elems[i]);
+      if (graph->nodeWeights)
+        subgraphs[p].setNodeWeight(n, graph->nodeWeight(i));
       mappedTo[i] = n;
     }
 
     // Add edges to subgraphs
-    for (uint32_t i = 0; i < graph->incoming->numElems; i++) {
+    for (uint32_t i = 0; i < graph->numNodes(); i++) {
       PartitionId p = partitions[i];
-      Seq<NodeId>* out = graph->outgoing->elems[i];
-      for (uint32_t j = 0; j < out->numElems; j++) {
-        NodeId neighbour = out->elems[j];
-        if (partitions[neighbour] == p)
-          subgraphs[p].addEdge(mappedTo[i], mappedTo[neighbour]);
+      Slice<NodeId> out = graph->outgoing(i);
+      Slice<EdgeId> ids = graph->edgeIds(i);
+      for (uint32_t j = 0; j < out.numElems; j++) {
+        NodeId neighbour = out.elems[j];
+        if (partitions[neighbour] == p) {
+          EdgeId e = subgraphs[p].addEdge(mappedTo[i], 0, mappedTo[neighbour]);
+          if (graph->edgeWeights)
+            subgraphs[p].setEdgeWeight(e, graph->edgeWeight(ids.elems[j]));
+        }
       }
     }
 
+    // Convert subgraphs to CSR form
+    for (uint32_t p = 0; p < numPartitions; p++)
+      subgraphs[p].finalise();
+
     // Release mapping
     delete [] mappedTo;
   }
@@ -291,14 +558,18 @@ struct Placer {
       for (uint32_t j = 0; j < numPartitions; j++)
         connCount[i][j] = 0;
 
-    // Iterative over graph and count connections
-    for (uint32_t i = 0; i < graph->incoming->numElems; i++) {
-      Seq<NodeId>* in = graph->incoming->elems[i];
-      Seq<NodeId>* out = graph->outgoing->elems[i];
-      for (uint32_t j = 0; j < in->numElems; j++)
-        connCount[partitions[i]][partitions[in->elems[j]]]++;
-      for (uint32_t j = 0; j < out->numElems; j++)
-        connCount[partitions[i]][partitions[out->elems[j]]]++;
+    // Iterative over graph and count connections, weighted by traffic
+    for (uint32_t i = 0; i < graph->numNodes(); i++) {
+      Slice<NodeId> in = graph->incoming(i);
+      Slice<NodeId> out = graph->outgoing(i);
+      Slice<EdgeId> inIds = graph->incomingEdgeIds(i);
+      Slice<EdgeId> outIds = graph->edgeIds(i);
+      for (uint32_t j = 0; j < in.numElems; j++)
+        connCount[partitions[i]][partitions[in.elems[j]]] +=
+          graph->edgeWeight(inIds.elems[j]);
+      for (uint32_t j = 0; j < out.numElems; j++)
+        connCount[partitions[i]][partitions[out.elems[j]]] +=
+          graph->edgeWeight(outIds.elems[j]);
     }
   }
 
@@ -350,21 +621,22 @@ struct Placer {
 
   // Cost function
   // Sum of products of manhatten distance and connection count
-  uint64_t cost() {
+  uint64_t cost(const uint32_t* xs, const uint32_t* ys) {
     uint64_t total = 0;
     uint32_t numPartitions = width*height;
     for (uint32_t i = 0; i < numPartitions; i++) {
       for (uint32_t j = 0; j < i; j++) {
-        uint32_t xDist = xCoord[i] >= xCoord[j] ?
-                           xCoord[i] - xCoord[j] : xCoord[j] - xCoord[i];
-        uint32_t yDist = yCoord[i] >= yCoord[j] ?
-                           yCoord[i] - yCoord[j] : yCoord[j] - yCoord[i];
+        uint32_t xDist = xs[i] >= xs[j] ? xs[i] - xs[j] : xs[j] - xs[i];
+        uint32_t yDist = ys[i] >= ys[j] ? ys[i] - ys[j] : ys[j] - ys[i];
         total += ((uint64_t) (xDist + yDist)) * connCount[i][j];
       }
     }
     return total;
   }
 
+  // Cost of current mapping
+  uint64_t cost() { return cost(xCoord, yCoord); }
+
   // Swap two mesh nodes
   inline void swap(uint32_t x, uint32_t y, uint32_t xNew, uint32_t yNew) {
     PartitionId p = mapping[y][x];
@@ -377,25 +649,184 @@ struct Placer {
     yCoord[pNew] = y;
   }
 
+  // Manhattan distance between mesh coords
+  inline uint32_t dist(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+    uint32_t xDist = x0 >= x1 ? x0 - x1 : x1 - x0;
+    uint32_t yDist = y0 >= y1 ? y0 - y1 : y1 - y0;
+    return xDist + yDist;
+  }
+
+  // Connection count between two partitions, as seen by the cost function
+  // (which only considers the lower triangle of the connCount matrix)
+  inline uint64_t pairCount(PartitionId i, PartitionId j) {
+    return i > j ? connCount[i][j] : connCount[j][i];
+  }
+
+  // Change in cost that would result from swapping the mesh positions
+  // of partitions p and q, given the partition coords xs and ys
+  // Only the pairs involving the two swapped partitions change, so
+  // this is O(P) rather than the O(P^2) of a full cost() evaluation
+  int64_t swapDelta(PartitionId p, PartitionId q,
+                      const uint32_t* xs, const uint32_t* ys) {
+    int64_t delta = 0;
+    uint32_t numPartitions = width*height;
+    for (uint32_t r = 0; r < numPartitions; r++) {
+      if (r == p || r == q) continue;
+      int64_t dOld = dist(xs[p], ys[p], xs[r], ys[r]);
+      int64_t dNew = dist(xs[q], ys[q], xs[r], ys[r]);
+      // Partition p moves to q's position, and q moves the other way;
+      // the distance between p and q is unchanged
+      delta += (dNew - dOld) * (int64_t) pairCount(p, r);
+      delta += (dOld - dNew) * (int64_t) pairCount(q, r);
+    }
+    return delta;
+  }
+
+  // Change in cost that would result from swapping two mesh nodes
+  int64_t swapDelta(uint32_t x, uint32_t y, uint32_t xNew, uint32_t yNew) {
+    return swapDelta(mapping[y][x], mapping[yNew][xNew], xCoord, yCoord);
+  }
+
   // Swap two mesh nodes only if cost is reduced
   bool trySwap(uint32_t x, uint32_t y, uint32_t xNew, uint32_t yNew) {
-    // Try swap
-    swap(x, y, xNew, yNew);
-    // Undo if cost not lowered
-    uint64_t c = cost();
-    if (c < currentCost) {
-      currentCost = c;
+    int64_t delta = swapDelta(x, y, xNew, yNew);
+    if (delta < 0) {
+      swap(x, y, xNew, yNew);
+      currentCost += delta;
       return true;
     }
-    else {
-      swap(x, y, xNew, yNew);
-      return false;
+    return false;
+  }
+
+  // Simulated annealing from a random placement, using the given seed
+  // Swaps arbitrary pairs of partitions, accepting cost increases with a
+  // probability that falls as the temperature is lowered.  The best
+  // placement seen is written to xs and ys (partition id -> mesh coords)
+  // and its cost is returned.
+  uint64_t annealOnce(unsigned int s, uint32_t* xs, uint32_t* ys) {
+    uint32_t numPartitions = width*height;
+
+    // Random initial placement (Fisher-Yates shuffle of cells)
+    uint32_t* cellOf = new uint32_t [numPartitions];
+    for (uint32_t i = 0; i < numPartitions; i++) cellOf[i] = i;
+    for (uint32_t i = numPartitions-1; i > 0; i--) {
+      uint32_t j = rand_r(&s) % (i+1);
+      uint32_t tmp = cellOf[i]; cellOf[i] = cellOf[j]; cellOf[j] = tmp;
+    }
+    uint32_t* curX = new uint32_t [numPartitions];
+    uint32_t* curY = new uint32_t [numPartitions];
+    for (uint32_t p = 0; p < numPartitions; p++) {
+      curX[p] = cellOf[p] % width;
+      curY[p] = cellOf[p] / width;
+    }
+    delete [] cellOf;
+
+    uint64_t cur = cost(curX, curY);
+    uint64_t best = cur;
+    memcpy(xs, curX, numPartitions * sizeof(uint32_t));
+    memcpy(ys, curY, numPartitions * sizeof(uint32_t));
+
+    if (numPartitions > 2) {
+      // Initial temperature: mean cost increase of a sample of random swaps
+      uint64_t sum = 0;
+      uint32_t count = 0;
+      for (uint32_t i = 0; i < numPartitions; i++) {
+        PartitionId p = rand_r(&s) % numPartitions;
+        PartitionId q = rand_r(&s) % numPartitions;
+        if (p == q) continue;
+        int64_t delta = swapDelta(p, q, curX, curY);
+        if (delta > 0) { sum += delta; count++; }
+      }
+      double temp = count == 0 ? 1.0 : (double) sum / count;
+
+      // Cooling schedule
+      const uint32_t numSteps = 100;
+      const uint32_t movesPerStep = 8 * numPartitions;
+      const double cooling = 0.95;
+
+      for (uint32_t step = 0; step < numSteps; step++) {
+        for (uint32_t m = 0; m < movesPerStep; m++) {
+          PartitionId p = rand_r(&s) % numPartitions;
+          PartitionId q = rand_r(&s) % numPartitions;
+          if (p == q) continue;
+          int64_t delta = swapDelta(p, q, curX, curY);
+          bool accept = delta <= 0;
+          if (!accept) {
+            double r = (double) rand_r(&s) / RAND_MAX;
+            accept = r < exp(-(double) delta / temp);
+          }
+          if (accept) {
+            uint32_t tx = curX[p], ty = curY[p];
+            curX[p] = curX[q]; curY[p] = curY[q];
+            curX[q] = tx; curY[q] = ty;
+            cur += delta;
+            if (cur < best) {
+              best = cur;
+              memcpy(xs, curX, numPartitions * sizeof(uint32_t));
+              memcpy(ys, curY, numPartitions * sizeof(uint32_t));
+            }
+          }
+        }
+        temp *= cooling;
+      }
+    }
+
+    delete [] curX;
+    delete [] curY;
+    return best;
+  }
+
+  // Multi-start simulated annealing, with restarts run in parallel
+  // The best placement found is installed as the current and saved one
+  void placeAnneal(uint32_t numAttempts) {
+    uint32_t numPartitions = width*height;
+    if (numAttempts == 0) numAttempts = 1;
+
+    // Per-attempt results
+    uint32_t** xs = new uint32_t* [numAttempts];
+    uint32_t** ys = new uint32_t* [numAttempts];
+    uint64_t* costs = new uint64_t [numAttempts];
+    unsigned int* seeds = new unsigned int [numAttempts];
+    for (uint32_t n = 0; n < numAttempts; n++) {
+      xs[n] = new uint32_t [numPartitions];
+      ys[n] = new uint32_t [numPartitions];
+      seeds[n] = getRand();
     }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (uint32_t n = 0; n < numAttempts; n++)
+      costs[n] = annealOnce(seeds[n], xs[n], ys[n]);
+
+    // Install the best placement
+    uint32_t bestAttempt = 0;
+    for (uint32_t n = 1; n < numAttempts; n++)
+      if (costs[n] < costs[bestAttempt]) bestAttempt = n;
+    for (uint32_t p = 0; p < numPartitions; p++) {
+      xCoord[p] = xs[bestAttempt][p];
+      yCoord[p] = ys[bestAttempt][p];
+      mapping[yCoord[p]][xCoord[p]] = p;
+    }
+    currentCost = costs[bestAttempt];
+    save();
+
+    for (uint32_t n = 0; n < numAttempts; n++) {
+      delete [] xs[n];
+      delete [] ys[n];
+    }
+    delete [] xs;
+    delete [] ys;
+    delete [] costs;
+    delete [] seeds;
   }
 
   // Very simple local search algorithm for placement
   // Repeatedly swap a mesh node with it's neighbour if it lowers cost
   void place(uint32_t numAttempts) {
+    if (placeMethod == Anneal) {
+      placeAnneal(numAttempts);
+      return;
+    }
+
     // Initialise best cost
     savedCost = ~0;
 
@@ -425,14 +856,19 @@ struct Placer {
   }
 
   // Constructor
-  Placer(Graph* g, uint32_t w, uint32_t h) {
+  // (If cap is non-zero, the graph must have exactly cap*w*h nodes,
+  // and each partition will receive exactly cap of them)
+  Placer(Graph* g, uint32_t w, uint32_t h, uint32_t cap = 0) {
     graph = g;
+    capacity = cap;
+    // Ensure the graph is in CSR form
+    g->finalise();
     width = w;
     height = h;
     // Random seed
     setRand(1 + omp_get_thread_num());
     // Allocate the partitions array
-    partitions = new PartitionId [g->incoming->numElems];
+    partitions = new PartitionId [g->numNodes()];
     // Allocate subgraphs
     subgraphs = new Graph [width*height];
     // Allocate the connection count matrix
@@ -456,6 +892,7 @@ struct Placer {
     chooseMethod();
     // Partition the graph using Metis
     partition();
+    if (capacity > 0) balanceExact();
     // Compute subgraphs, one per partition
     computeSubgraphs();
     // Count connections between each pair of partitions
@@ -351,6 +351,7 @@ class ProgRouterMesh {
   void write(HostLink* hostLink) {
     // Request to boot loader
     BootReq req;
+    memset(&req, 0, sizeof(BootReq));
 
     // Compute number of cores per DRAM
     const uint32_t coresPerDRAM = 1 <<
@@ -366,15 +367,13 @@ class ProgRouterMesh {
           req.numArgs = 1;
           req.args[0] = TinselPOLiteProgRouterBase;
           hostLink->send(dest, 1, &req);
-          // Ensure space for an extra 32 bytes in each 
-          // table so we don't have to check for overflow below
-          // when consuming the tables in chunks of 12 bytes
-          table[y][x].table[i]->ensureSpaceFor(32);
+          // Tables consist of whole 32-byte beats
+          assert((table[y][x].table[i]->numElems % 32) == 0);
         }
       }
     }
 
-    // Write each routing table
+    // Write each routing table, in chunks of up to BootReqMaxArgs words
     bool allDone = false;
     uint32_t offset = 0;
     while (! allDone) {
@@ -385,19 +384,19 @@ class ProgRouterMesh {
             Seq<uint8_t>* seq = table[y][x].table[i];
             if (offset < seq->numElems) {
               uint32_t dest = hostLink->toAddr(x, y, coresPerDRAM * i, 0);
-              uint8_t* base = &seq->elems[offset];
+              uint32_t* base = (uint32_t*) &seq->elems[offset];
+              uint32_t numWords = (seq->numElems - offset) >> 2;
+              if (numWords > BootReqMaxArgs) numWords = BootReqMaxArgs;
               allDone = false;
               req.cmd = StoreCmd;
-              req.numArgs = 3;
-              req.args[0] = ((uint32_t*) base)[0];
-              req.args[1] = ((uint32_t*) base)[1];
-              req.args[2] = ((uint32_t*) base)[2];
-              hostLink->send(dest, 1, &req);
+              req.numArgs = numWords;
+              for (uint32_t j = 0; j < numWords; j++) req.args[j] = base[j];
+              hostLink->send(dest, BootReqFlits(numWords), &req);
             }
           }
         }
       }
-      offset += 12;
+      offset += 4 * BootReqMaxArgs;
     }
   }
 
@@ -4,13 +4,22 @@
 
 #include <stdint.h>
 
+// Max number of args in a boot request
+#define BootReqMaxArgs 15
+
+// Number of flits needed for a boot request with given number of args
+#define BootReqFlits(numArgs) (1 + ((numArgs) >> 2))
+
 // Boot request
 // (Number of flits required depends on the number of args used)
+// (The programmable router overwrites the cmd and numArgs fields of a
+// multicast request with MulticastCmd, so these are carried separately)
 typedef struct {
   uint8_t cmd;
   uint8_t numArgs;
-  uint16_t unused;
-  uint32_t args[15];
+  uint8_t mcastCmd;
+  uint8_t mcastNumArgs;
+  uint32_t args[BootReqMaxArgs];
 } BootReq;
 
 // Various commands supported by the boot loader
@@ -21,12 +30,12 @@ typedef enum {
   SetAddrCmd,
 
   // Write to instruction memory and increment address register.
-  // Argument: up to 3 x 32-bit instructions to write.
+  // Argument: up to 15 x 32-bit instructions to write.
   // The address is taken from the address register.
   WriteInstrCmd,
  
   // Perform a store instruction and increment address register.
-  // Argument: up to 3 x 32-bit words to store.
+  // Argument: up to 15 x 32-bit words to store.
   // The address is taken from the address register.
   StoreCmd,
 
@@ -41,6 +50,15 @@ typedef enum {
   // to start.
   StartCmd,
 
+  // Perform a cache flush and send ack to the host.
+  // No arguments.
+  FlushCmd,
+
+  // A request multicast using a routing key, whose MRM records have
+  // MulticastCmd as local key.  The command and number of arguments
+  // are taken from the mcastCmd and mcastNumArgs fields.
+  MulticastCmd,
+
 } BootCmd;
 
 